@@ -3,7 +3,6 @@
 #include <stdint.h>
 
 #define CLOCK_FREQ      5000
-#define DEFUALT_TICKS   10
 #define RELOAD_TICKS (1193182 / CLOCK_FREQ)
 
 #define VIRTUAL_ADDR_0 0xffff800000000000
@@ -11,10 +10,17 @@
 
 #define VIRTUAL_ADDR_USER_HIGHEST 0x800000000000
 #define VIRTUAL_ADDR_USER_ELF_HIGHEST 0x700000000000
+/// 用户堆(usr/pub/mem.c)的范围, 按2M大页填充
+#define VIRTUAL_ADDR_USER_HEAP_START 0x400000000000
+#define VIRTUAL_ADDR_USER_HEAP_END 0x700000000000
+/// mmap未指定地址时从这里分配, 再往上是用户栈
+#define VIRTUAL_ADDR_USER_MMAP_START 0x700000000000
+#define VIRTUAL_ADDR_USER_MMAP_END 0x7f0000000000
 
 #define easy_phy2linear(addr) (void*)((uint64_t)(addr) + VIRTUAL_ADDR_0)
 #define easy_linear2phy(addr) (void*)((uint64_t)(addr) - VIRTUAL_ADDR_0)
 uint64_t mem_linear2phy_get(uint64_t addr,uint64_t cr3);
+int prefault_user_range(const void *buf, uint64_t len);
 int copy_to_user(void *dest,void *source,uint32_t length);
 int put_user(char num,char *buf);
 
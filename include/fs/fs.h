@@ -184,6 +184,15 @@ static inline void exit_cwd(dentry_t *dentry){
     sb_put(dentry->in_mnt);
 }
 dentry_t *dentry_create(const char *name,inode_t *inode);
+ssize_t vfs_pread(struct file *file, char *buf, size_t count, uint64_t pos);
+int vfs_close(struct file *file);
+
+#include "mm/slab.h"
+
+/* inode/dentry/file 的专用cache, 由init_fs_mem创建 */
+extern kmem_cache_t *inode_cachep;
+extern kmem_cache_t *dentry_cachep;
+extern kmem_cache_t *file_cachep;
 
 int sys_open(const char *path, int flags, int mode);
 ssize_t sys_read(int fd, char *buf, size_t count);
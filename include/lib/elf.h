@@ -168,6 +168,7 @@ typedef struct elf64_part_header {
 
 #include "fs/fs.h"
 elf64_header_t* elf_file_executable(int fd);
-int elf_file_copy(int fd, elf64_header_t* header, uint64_t cr3);
+struct pcb;
+int elf_file_map(int fd, elf64_header_t* header, struct pcb *task);
 
 #endif
\ No newline at end of file
@@ -116,6 +116,22 @@ static inline void write_cr4(uint64_t val) {
     __asm__ volatile ("mov %0, %%cr4" : : "r" (val));
 }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile ("wrmsr" : : "c" (msr), "a" ((uint32_t)val), "d" ((uint32_t)(val >> 32)));
+}
+
 // 刷新单个缓存行 (通常是 64 字节)
 static inline void clflush(volatile void *p) {
     __asm__ __volatile__("clflush (%0)" : : "r"(p) : "memory");
@@ -0,0 +1,26 @@
+#ifndef OS_LZ_H
+#define OS_LZ_H
+
+#include <stdint.h>
+
+/**
+ * LZ4块格式的快速压缩
+ * 每个序列: token(高4位字面量长度, 低4位匹配长度-4), 长度为15时后跟255累加的扩展字节,
+ * 然后是字面量, 2字节小端的匹配偏移, 最后一个序列只有字面量
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1U << LZ_HASH_BITS)
+/// 单次压缩的最大输入, 哈希表里用16位记位置
+#define LZ_MAX_INPUT 0xffffU
+
+/**
+ * @param hash 调用者提供的LZ_HASH_SIZE项的工作区, 不需要清零
+ * @return 压缩后的长度, 放不进cap时返回0
+ */
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap, uint16_t *hash);
+
+/// @return 解压出的长度, 数据损坏或者放不进cap时返回-1
+int lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap);
+
+#endif
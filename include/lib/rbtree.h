@@ -0,0 +1,53 @@
+#ifndef OS_RBTREE_H
+#define OS_RBTREE_H
+
+#include <stddef.h>
+#include "lib/my_list.h"
+
+/**
+ * 侵入式红黑树
+ * 和链表一样把节点嵌在对象里, 比较由调用者在插入时自己完成:
+ *   找到插入位置后rb_link_node, 再rb_insert_color重新平衡
+ */
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+} rb_node_t;
+
+typedef struct rb_root {
+    rb_node_t *node;
+} rb_root_t;
+
+#define RB_ROOT ((rb_root_t){ NULL })
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline int rb_empty(rb_root_t *root)
+{
+    return root->node == NULL;
+}
+
+/// @brief 把新节点挂到parent的*link位置上, 之后必须调用rb_insert_color
+static inline void rb_link_node(rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+void rb_insert_color(rb_node_t *node, rb_root_t *root);
+void rb_erase(rb_node_t *node, rb_root_t *root);
+
+rb_node_t *rb_first(rb_root_t *root);
+rb_node_t *rb_last(rb_root_t *root);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
+
+#endif
@@ -45,6 +45,7 @@ void rwlock_init(rwlock_t *lock);
 void read_lock(rwlock_t *lock);
 void read_unlock(rwlock_t *lock);
 void write_lock(rwlock_t *lock);
+int write_trylock(rwlock_t *lock);
 void write_unlock(rwlock_t *lock);
 
 /* 带自旋锁的链表（最常用） */
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include "task.h"
 #include "lib/atomic.h"
+#include "lib/wait_queue.h"
 
 enum timer_type_enum{
     TIMER_TASK_SING,
@@ -20,12 +21,65 @@ typedef struct timer
     /* 周期性时钟的间隔 */
     uint32_t delta_ticks;
     enum timer_type_enum timer_type;
+    /* 所在的时间轮槽 */
     list_head_t list_item;
+    /* TIMER_TASK_*挂在task->timers上, 不排序 */
     list_head_t in_task_item;
     pcb_t *task;
     uint32_t signal;
 } timer_t;
 
+/*
+ * 分级时间轮
+ * 第一级256个槽, 每槽一个tick, 放256个tick以内到期的定时器;
+ * 之后4级各64个槽, 每个槽的跨度是上一级整个轮的长度.
+ * 第一级转完一圈时把第二级当前槽里的定时器重新分配下来, 依此类推.
+ * 插入和取消都是O(1), 超出2^32个tick的定时器先放在最后一级, 转到时再重新分配.
+ */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+typedef struct timer_wheel {
+    spinlock_t lock;
+    /// @brief 下一个要处理的tick, 在它之前到期的定时器都已经取走
+    uint64_t clk;
+    uint32_t nr_timers;
+    list_head_t tv1[TVR_SIZE];
+    list_head_t tvn[TVN_LEVELS][TVN_SIZE];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+void timer_wheel_add(timer_wheel_t *wheel, timer_t *timer);
+void timer_wheel_del(timer_wheel_t *wheel, timer_t *timer);
+void timer_wheel_run(timer_wheel_t *wheel, uint64_t now, list_head_t *expired);
+uint64_t timer_wheel_next(timer_wheel_t *wheel, uint64_t limit);
+void timer_wheel_bench(void);
+
+/*
+ * 高精度定时器
+ * 到期时刻是HPET主计数器的纳秒数, 不按tick取整. 挂在设置它的CPU上,
+ * 由Local APIC单次定时器在到期时刻打断, 唤醒等在wq上的任务.
+ * 没有Local APIC定时器时退回到每个时钟中断检查一次.
+ */
+typedef struct hrtimer {
+    /// @brief 到期时刻, 与hpet_read_ns同一时间轴
+    uint64_t expires;
+    list_head_t list_item;
+    wait_queue_t wq;
+    volatile bool pending;
+} hrtimer_t;
+
+void hrtimer_sleep_until(uint64_t expires);
+void msleep(uint64_t ms);
+
+#include "mm/slab.h"
+extern kmem_cache_t *timer_cachep;
+
 // local_timer_timeout的返回取值约定：位标志
 void mdelay(uint64_t ms);
 void hpet_udelay(uint64_t us);
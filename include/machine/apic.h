@@ -79,6 +79,8 @@
 #define TIMER_MODE_ONESHOT 0
 #define TIMER_MODE_PERIODIC ((uint32_t)1 << 17)
 #define TIMER_TSC_DEADLINE ((uint32_t)2 << 17)
+/* Timer Divide Configuration: 3 为16分频 */
+#define TIMER_DIVIDE_16 0x3
 /* LVT CMCI */
 /// 31-17|16  |15-13|12             |11|10-8         |7-0
 /// R    |Mask|R    |Dilivery Status|R |Dilivery Mode|Interrupt Vector
@@ -193,6 +195,12 @@
 #define INTERRUPT_VECTOR_PIRQF 0x35
 #define INTERRUPT_VECTOR_PIRQG 0x36
 #define INTERRUPT_VECTOR_PIRQH 0x37
+/// Local APIC定时器, 每个CPU单独编程
+#define INTERRUPT_VECTOR_LAPIC_TIMER 0xef
+/// 处理器间中断
+#define INTERRUPT_VECTOR_TLB_SHOOTDOWN 0xf0
+/// 唤醒停了时钟的CPU
+#define INTERRUPT_VECTOR_RESCHEDULE 0xf1
 
 typedef struct IoAPIC {
     uint8_t* RegisterSelect;
@@ -6,10 +6,11 @@
 #include "lib/my_list.h"
 #include "task.h"
 #include "protect.h"
+#include "mm/page_pool.h"
 
 #include <stdint.h>
 
-typedef struct
+typedef struct cpu_item
 {
     uint64_t *gdt_table;
     uint64_t *idt_table;
@@ -19,9 +20,39 @@ typedef struct
     pcb_t* now_running;
     pcb_t* idle;
     volatile uint32_t total_ready_num;
-    spin_list_head_t ready_list;
+    cfs_rq_t rq;
+    /// @brief 醒来的任务要求抢占当前任务, 在下一个时钟中断切换
+    volatile bool need_resched;
+    /// @brief 空闲时从别的CPU偷来的任务数, 周期均衡迁入的任务数
+    uint64_t nr_steal;
+    uint64_t nr_balance;
+    /// @brief 下一次周期负载均衡的ticks
+    uint64_t next_balance;
+    /// @brief 下一个时钟周期没有编程时钟中断, 往这里放任务要叫醒它
+    volatile bool tick_stopped;
     uint32_t time_intr_reenter;
-    spin_list_head_t timer_list;
+    /// @brief 本CPU的定时器, 见include/lib/timer.h
+    struct timer_wheel *wheel;
+    /// @brief 本CPU上按到期时刻排序的高精度定时器(hrtimer_t)
+    spin_list_head_t hrtimers;
+    PER_CPU_PAGES pcp;
+    /// @brief 本CPU上PCID的分配代数, pcb中代数不同的PCID已失效
+    uint64_t pcid_gen;
+    /// @brief 下一个可分配的PCID, 0留给内核页表
+    uint32_t pcid_next;
+    /// @brief 切换CR3时保留TLB(pcid_hit)与刷新TLB(pcid_flush)的次数
+    uint64_t pcid_hit;
+    uint64_t pcid_flush;
+    /// @brief 当前CR3中装载的页表(虚拟地址)
+    volatile uint64_t active_cr3;
+    /// @brief 正在运行内核线程, 沿用上一个进程的页表
+    volatile bool tlb_lazy;
+    /// @brief 懒惰期间跳过了对active_cr3的刷新, 切回同一地址空间时要刷新
+    volatile bool tlb_stale;
+    /// @brief 已经可以接收TLB刷新IPI
+    bool tlb_online;
+    /// @brief 所在的NUMA节点, 没有SRAT时为0
+    uint32_t node;
 } CPU_ITEM;
 
 typedef struct
@@ -3,27 +3,50 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
-void put_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type);
-void __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type, uint64_t usr_define);
+int put_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type);
+int __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type, uint64_t usr_define);
 int exist_page_4k(uint64_t vir_addr, uint64_t ptable_vir);
 void rm_page_4k(uint64_t vir_addr, uint64_t ptable_vir);
+uint64_t __unmap_kernel_page_locked(uint64_t vir_addr);
 void put_page_2M(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir);
 
 void free_ptable_and_mem(uint64_t pml4_vir);
-void copy_pagetable_and_mem(uint64_t dest,uint64_t source);
+int copy_pagetable_and_mem(uint64_t dest,uint64_t source);
+int do_cow_fault(uint64_t vir_addr, uint64_t ptable_vir);
+int put_user_page_2m(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir);
+int put_zero_page_4k(uint64_t vir_addr, uint64_t ptable_vir);
+int try_put_user_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type);
+int unmap_user_range(uint64_t ptable_vir, uint64_t start, uint64_t end);
+int protect_user_range(uint64_t ptable_vir, uint64_t start, uint64_t end, uint32_t prot);
 
 uint64_t alloc_page_4k(void);
-uint8_t decrease_reference_page_4k(uint64_t addr);
+uint64_t alloc_zeroed_page_4k(void);
+uint64_t try_alloc_zeroed_page_4k(void);
+bool page_zero_idle_fill(void);
+uint32_t decrease_reference_page_4k(uint64_t addr);
 uint8_t add_reference_page_4k(uint64_t addr);
 
 uint64_t alloc_n_pages_4k(uint32_t n);
+uint64_t alloc_n_pages_4k_node(uint32_t n, uint32_t node);
 void free_n_pages_4k(uint32_t n, uint64_t addr);
+uint64_t alloc_huge_page_2m(void);
+void put_huge_page_2m(uint64_t addr);
+
+struct PcpStat;
+struct BuddyStat;
+void buddy_stat(struct BuddyStat *stat);
+void init_page_pcp(void);
+void page_pcp_stat(struct PcpStat *stat);
+void page_pcp_tune(uint32_t batch, uint32_t high);
 
 void* kmalloc(uint32_t size);
 void kfree(void* vir_addr);
 
 uint64_t io_remap(uint64_t phy_addr, size_t size);
+uint64_t io_remap_wc(uint64_t phy_addr, size_t size);
+void init_pat(void);
 void io_unmap(uint64_t vir_addr, size_t size);
 
 #endif
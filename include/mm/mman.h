@@ -0,0 +1,23 @@
+#ifndef OS_MMAN_H
+#define OS_MMAN_H
+
+/* 页面权限 */
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+/* 映射类型, MAP_SHARED与MAP_PRIVATE必须且只能选一个 */
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10   /* 必须映射到指定地址, 覆盖已有的映射 */
+#define MAP_ANONYMOUS   0x20   /* 不关联文件, 内容全为0 */
+
+#define MAP_FAILED      ((void *)-1)
+
+/* madvise的建议 */
+#define MADV_NORMAL     0
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4   /* 丢掉范围内的页, 再访问时匿名页为0, 文件页重新读 */
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef OS_NUMA_H
+#define OS_NUMA_H
+
+#include <stdint.h>
+
+/// 支持的NUMA节点数, SRAT中更多的邻近域并入节点0
+#define MAX_NUMA_NODES 8
+/// SRAT中内存范围的上限
+#define NUMA_MAX_RANGES 32
+/// SLIT中本节点的距离, 没有SLIT时远端节点按2倍计
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/// @brief SRAT中的一段内存, 节点号是邻近域按出现顺序重新编的号
+typedef struct NumaMemRange {
+    uint64_t start;
+    uint64_t end;
+    uint32_t node;
+} NUMA_MEM_RANGE;
+
+/// @brief SRAT/SLIT的解析结果
+typedef struct NumaInfo {
+    uint32_t nr_nodes;
+    uint32_t nr_ranges;
+    NUMA_MEM_RANGE ranges[NUMA_MAX_RANGES];
+    uint8_t distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+} NUMA_INFO;
+
+typedef struct NumaNode {
+    /// @brief 按SLIT距离从近到远排列的节点号, 第一个是自己
+    uint8_t fallback[MAX_NUMA_NODES];
+    /// @brief 节点上由buddy管理的页数与其中空闲的页数
+    uint64_t total_pages;
+    uint64_t free_pages;
+    /// @brief 从本节点分配出去的页: 本节点就是首选节点 / 首选节点不够时退到这里
+    uint64_t alloc_local;
+    uint64_t alloc_remote;
+} NUMA_NODE;
+
+typedef struct NumaStat {
+    uint32_t nr_nodes;
+    struct {
+        uint64_t total_pages;
+        uint64_t free_pages;
+        uint64_t used_pages;
+        uint64_t alloc_local;
+        uint64_t alloc_remote;
+    } node[MAX_NUMA_NODES];
+} NUMA_STAT;
+
+void init_numa(void);
+uint32_t numa_node_id(void);
+uint32_t page_to_node(uint64_t phy_addr);
+void numa_stat(NUMA_STAT *stat);
+
+/* acpi_madt.c */
+void acpi_numa_init(NUMA_INFO *info);
+uint32_t acpi_cpu_node(uint32_t apic_id);
+
+#endif
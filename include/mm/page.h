@@ -0,0 +1,69 @@
+#ifndef OS_PAGE_H
+#define OS_PAGE_H
+
+#include "const.h"
+#include <stdint.h>
+
+/// 不可用的页(内核映像, 描述符表, 空洞)的引用计数
+#define PAGE_REF_RESERVED 0xffffffffU
+/// 引用计数的上限, add_reference_page_4k到这里返回1
+#define PAGE_REF_MAX (PAGE_REF_RESERVED - 1)
+
+/* page_t.flags */
+#define PG_RESERVED (1 << 0)
+/// slab的页, owner指向所属的kmem_cache
+#define PG_SLAB     (1 << 1)
+/// 内核堆窗口里映射的页
+#define PG_HEAP     (1 << 2)
+/// 用户2M大页的首页, 引用计数只记在首页上
+#define PG_HUGE     (1 << 3)
+
+/**
+ * @brief 物理页描述符, 每个物理页一个, 连续放在_mrt_start
+ * @note 保持16字节, 一条cache line放4个
+ */
+typedef struct Page {
+    /// @brief 0 空闲, PAGE_REF_RESERVED 不可用
+    uint32_t refcount;
+    uint16_t flags;
+    /// @brief 空闲块首页记录块的阶, 其它页为BUDDY_ORDER_NONE
+    uint8_t order;
+    /// @brief 所在物理区域在pais中的下标
+    uint8_t area;
+    union {
+        /// @brief 以页号链接的双向链表, 给LRU等按页挂链的用户
+        struct {
+            uint32_t next;
+            uint32_t prev;
+        } link;
+        /// @brief 页的所有者, 例如slab页指向kmem_cache
+        void *owner;
+        uint64_t private;
+    };
+} page_t;
+
+_Static_assert(sizeof(page_t) == 16, "page_t must stay 16 bytes");
+
+extern page_t *mem_map;
+
+static inline page_t *pfn_to_page(uint64_t pfn)
+{
+    return &mem_map[pfn];
+}
+
+static inline page_t *phys_to_page(uint64_t addr)
+{
+    return &mem_map[addr >> 12];
+}
+
+static inline uint64_t page_to_phys(page_t *page)
+{
+    return (uint64_t)(page - mem_map) << 12;
+}
+
+static inline page_t *virt_to_page(void *addr)
+{
+    return phys_to_page((uint64_t)addr - VIRTUAL_ADDR_0);
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "const.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 ///@brief maximum memory of 1024G=1T
 #define MAX_MEM_SUPPORTED 1024UL * 1024UL * 1024UL * 1024UL
@@ -12,6 +13,26 @@
 #define NUMBER_OF_OTHER_IN_PML4 (7 + 2)
 #define SLAB_START_ID_IN_PML4 (256 + 2)
 
+#include "lib/my_list.h"
+#include "lib/rbtree.h"
+#include "mm/page.h"
+#include "mm/numa.h"
+
+/// buddy分配器的最高阶: 2^10页 = 4M
+#define BUDDY_MAX_ORDER 10
+/// page_t.order中非空闲块首页的取值
+#define BUDDY_ORDER_NONE 0xff
+/// 用户2M大页: 一个order 9的buddy块, 引用计数只记在首页上
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_SIZE ((uint64_t)1 << (HUGE_PAGE_ORDER + 12))
+
+typedef struct FreeArea {
+    /// @brief 空闲块链表, 节点放在块首页的直接映射地址上
+    list_head_t free_list;
+    /// @brief Number of free blocks of this order
+    uint64_t nr_free;
+} FREE_AREA;
+
 typedef struct PhysicAreaItem {
     /// @brief Starting Physical Address
     uint64_t spa;
@@ -19,21 +40,95 @@ typedef struct PhysicAreaItem {
     uint64_t epa;
     /// @brief Number of Free Physical Pages
     uint64_t fpp;
-    /// @brief Next Free Page Address
-    uint64_t nfpa;
+    /// @brief NUMA node of the area, 区域不跨节点
+    uint32_t node;
+    /// @brief buddy free lists of order 0..BUDDY_MAX_ORDER
+    FREE_AREA free_area[BUDDY_MAX_ORDER + 1];
 } PHYSIC_AREA_ITEM;
 
+typedef struct BuddyStat {
+    /// @brief Free blocks of each order, summed over all areas
+    uint64_t nr_free[BUDDY_MAX_ORDER + 1];
+    /// @brief Failed allocations of each order
+    uint64_t alloc_fail[BUDDY_MAX_ORDER + 1];
+    uint64_t free_pages;
+    /// @brief 对于每一阶, 不能用来满足该阶分配的空闲页所占的千分比
+    uint32_t unusable_index[BUDDY_MAX_ORDER + 1];
+} BUDDY_STAT;
+
+void init_buddy(void);
+uint64_t __buddy_alloc_locked(uint32_t order);
+uint64_t __buddy_alloc_node_locked(uint32_t order, uint32_t node);
+void buddy_split_areas(NUMA_MEM_RANGE *ranges, uint32_t nr);
+void __buddy_free_locked(uint64_t addr, uint32_t order);
+void __buddy_free_range_locked(uint64_t addr, uint64_t end);
+
 #include "mm/slab.h"
 #include "lib/safelist.h"
 
+/// 每CPU页缓存的默认水位: 超过high时一次归还batch页, 为空时一次取batch页
+#define PCP_DEFAULT_BATCH 32
+#define PCP_DEFAULT_HIGH (PCP_DEFAULT_BATCH * 6)
+/// 每CPU预清零页的上限, 由idle填充
+#define PCP_ZERO_HIGH 64
+
+/// @brief per-CPU page frame cache, 只允许本CPU在关中断时访问
+/// @note 链表节点直接放在空闲页的直接映射地址上, 链表头部是hot页, 尾部是cold页
+typedef struct PerCpuPages {
+    list_head_t list;
+    /// @brief Number of cached pages
+    uint32_t count;
+    /// @brief Drain to the global pool above this count
+    uint32_t high;
+    /// @brief Pages moved per refill / drain
+    uint32_t batch;
+    /* 统计 */
+    uint64_t alloc_hit;
+    uint64_t alloc_miss;
+    uint64_t refill;
+    uint64_t drain;
+    uint64_t free_hot;
+    /// @brief 已经清零的页, 节点占用的头16字节在取出时清掉
+    list_head_t zero_list;
+    uint32_t zero_count;
+    uint32_t zero_high;
+    uint64_t zero_hit;
+    uint64_t zero_miss;
+    uint64_t zero_filled;
+} PER_CPU_PAGES;
+
+typedef struct PcpStat {
+    uint64_t alloc_hit;
+    uint64_t alloc_miss;
+    uint64_t refill;
+    uint64_t drain;
+    uint64_t free_hot;
+    /// @brief Pages currently held by all per-CPU caches
+    uint64_t cached;
+    /// @brief alloc_zeroed_page_4k served from / missed the zeroed pools
+    uint64_t zero_hit;
+    uint64_t zero_miss;
+    /// @brief Pages zeroed by the idle loop
+    uint64_t zero_filled;
+    /// @brief Pages currently held by all zeroed pools
+    uint64_t zeroed;
+} PCP_STAT;
+
+/// @brief 内核堆的一块, 相邻的块按地址链在一起
 typedef struct Heap {
     struct Heap* next;
     struct Heap* last;
-    struct Heap* nextf;
-    struct Heap* lastf;
+    /// @brief node in mm.heap_addr, 所有块按起始地址排序
+    rb_node_t addr_node;
+    /// @brief node in mm.heap_free, 只有空闲块按(大小, 地址)排序
+    rb_node_t free_node;
     uint64_t start_addr;
     uint64_t size;
     uint8_t used;
+    /// @brief 空闲块里可能还有映射着的页
+    uint8_t mapped;
+    /// @brief 正在被回收解除映射, 不参与分配与合并
+    uint8_t busy;
 } HEAP;
 
 typedef struct MmManager {
@@ -45,25 +140,47 @@ typedef struct MmManager {
     uint64_t tfpp;
     /// @brief Number of physic area items
     uint32_t npai;
-    /// @brief Slab End ID
-    uint64_t slabei[7];
-
-    /// @brief Next free Slab ID
-    uint64_t nfslabi[7];
-
-    /// @brief Medium Slab pointers
-    struct SlabMiddle* mslab[2];
-
-    /// @brief Next Free Medium Slab pointers
-    struct SlabMiddle* mnfslab[2];
-
-    /// @brief start heap pointer
-    struct Heap* shp;
-    /// @brief next free heap pointer
-    struct Heap* nfhp;
-    /// @brief heap end
-    uint64_t he;
+    /// @brief NUMA节点, 没有SRAT时只有节点0
+    uint32_t nr_nodes;
+    NUMA_NODE node[MAX_NUMA_NODES];
+    /// @brief 堆的所有块, 按地址
+    rb_root_t heap_addr;
+    /// @brief 堆的空闲块, 按(大小, 地址), 分配取最小的够用的块
+    rb_root_t heap_free;
+    /// @brief 映射过的页都在这个地址之下
+    uint64_t heap_top;
+    /// @brief 堆窗口里映射着的页数与已分配块的页数, 差值是空闲块占着的页
+    uint64_t heap_mapped;
+    uint64_t heap_used;
     spinlock_t lock;
+    /// @brief protects pais and the free state in mem_map
+    spinlock_t page_lock;
+    /// @brief per-CPU page caches are usable (cpus and local apic ready)
+    bool pcp_enabled;
+    /// @brief buddy allocation failures of each order
+    uint64_t buddy_fail[BUDDY_MAX_ORDER + 1];
+    /// @brief 空闲页低于wmark_low时唤醒kswapd, 回收到wmark_high为止
+    uint64_t wmark_low;
+    uint64_t wmark_high;
+    /* 写时复制统计 */
+    uint64_t cow_shared;
+    uint64_t cow_copied;
+    uint64_t cow_reused;
+    /* 2M大页统计 */
+    uint64_t huge_alloc;
+    uint64_t huge_fallback;
+    uint64_t huge_split;
+    /// @brief 全局只读零页, 匿名内存的读缺页都映射到这里
+    uint64_t zero_page;
+    /* 零页统计: 映射次数与写缺页时换成私有页的次数, 原子地更新 */
+    uint64_t zero_page_map;
+    uint64_t zero_page_cow;
+    /// @brief 当前指向零页的表项数, 也就是零页省下的页数
+    uint64_t zero_page_refs;
+    /// @brief 缺页预映射顺带映射的页数
+    uint64_t fault_around_map;
+    /// @brief PAT第4项已经设为写合并, 否则io_remap_wc退回不可缓存
+    bool pat_wc;
 } MM_MANAGER;
 
 #define DEFAULT_PAI_NUMBER 128
@@ -90,12 +207,40 @@ typedef struct MmManager {
 #define PAGE_BIG_ENTRY ((uint64_t)1 << 7)
 #define PAGE_GLOBAL ((uint64_t)1 << 8)
 #define PAGE_FULL ((uint64_t)1 << 9)
+/// 软件位: 只读共享的写时复制页, 写缺页时复制或恢复可写
+#define PAGE_COW ((uint64_t)1 << 10)
+/// 软件位: MAP_SHARED映射的页, fork时不做写时复制
+#define PAGE_SHARED_MAP ((uint64_t)1 << 11)
+/// 软件位, 只用在不存在的表项里: 页压缩换出了, 表项高位是swap slot
+#define PAGE_SWAPPED ((uint64_t)1 << 9)
+
+/// 选择PAT的第4项(本内核设为写合并), 4K表项在bit 7, 2M表项在bit 12
+#define PAGE_PAT_4K ((uint64_t)1 << 7)
+#define PAGE_PAT_2M ((uint64_t)1 << 12)
 
 #define PAGE_KERNEL_4K (PAGE_PRESENT | PAGE_WRITABLE | PAGE_SYSTEM_MODE | PAGE_LEVEL_CACHE_ENABLE | PAGE_GLOBAL)
 #define PAGE_KERNEL_DIR PAGE_KERNEL_4K
 #define PAGE_KERNEL_2M (PAGE_PRESENT | PAGE_WRITABLE | PAGE_SYSTEM_MODE | PAGE_LEVEL_CACHE_ENABLE | PAGE_GLOBAL | PAGE_BIG_ENTRY)
 #define PAGE_USER_4K (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER_MODE | PAGE_LEVEL_CACHE_ENABLE)
 #define PAGE_USER_DIR PAGE_USER_4K
-#define PAGE_USER_4K_COPY_ON_WRITE (PAGE_PRESENT | PAGE_USER_MODE | PAGE_LEVEL_CACHE_ENABLE)
+#define PAGE_USER_4K_READONLY (PAGE_PRESENT | PAGE_USER_MODE | PAGE_LEVEL_CACHE_ENABLE)
+#define PAGE_USER_4K_COPY_ON_WRITE (PAGE_PRESENT | PAGE_USER_MODE | PAGE_LEVEL_CACHE_ENABLE | PAGE_COW)
+#define PAGE_USER_2M (PAGE_USER_4K | PAGE_BIG_ENTRY)
+#define PAGE_USER_4K_SHARED (PAGE_USER_4K | PAGE_SHARED_MAP)
+/* MMIO映射: 不可缓存和写合并 */
+#define PAGE_KERNEL_IO_4K (PAGE_PRESENT | PAGE_WRITABLE | PAGE_SYSTEM_MODE | PAGE_WRITE_THROUGH | PAGE_LEVEL_CACHE_DISABLE | PAGE_GLOBAL)
+#define PAGE_KERNEL_IO_2M (PAGE_KERNEL_IO_4K | PAGE_BIG_ENTRY)
+#define PAGE_KERNEL_WC_4K (PAGE_PRESENT | PAGE_WRITABLE | PAGE_SYSTEM_MODE | PAGE_GLOBAL | PAGE_PAT_4K)
+#define PAGE_KERNEL_WC_2M (PAGE_PRESENT | PAGE_WRITABLE | PAGE_SYSTEM_MODE | PAGE_GLOBAL | PAGE_BIG_ENTRY | PAGE_PAT_2M)
+
+#define MSR_IA32_PAT 0x277
+/// PAT的内存类型编码
+#define PAT_TYPE_UC 0x00
+#define PAT_TYPE_WC 0x01
+#define PAT_TYPE_WB 0x06
+
+/// protect_user_range的权限
+#define USER_PROT_ACCESS 0x1
+#define USER_PROT_WRITE 0x2
 
 #endif
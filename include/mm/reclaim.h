@@ -0,0 +1,54 @@
+#ifndef OS_RECLAIM_H
+#define OS_RECLAIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lib/my_list.h"
+
+/// 每轮回收扫描可回收对象的1/2^priority, priority逐轮降低
+#define RECLAIM_PRIORITY_MAX 4
+/// 直接回收的轮数, 仍然没有进展就让分配失败
+#define RECLAIM_DIRECT_RETRIES 4
+
+/**
+ * @brief 缓存向回收子系统登记的回调
+ * @note scan可能在分配路径上被调用, 不能睡眠, 也不能阻塞等待调用者可能持有的锁,
+ *       拿不到锁的对象直接跳过
+ */
+typedef struct Shrinker {
+    const char *name;
+    /// @brief 当前可回收的对象数
+    uint64_t (*count)(struct Shrinker *shrinker);
+    /// @brief 回收最多nr个对象, 返回实际回收的个数
+    uint64_t (*scan)(struct Shrinker *shrinker, uint64_t nr);
+    /// @brief node in the shrinker list
+    list_head_t list;
+    /* 统计 */
+    uint64_t nr_scanned;
+    uint64_t nr_reclaimed;
+} SHRINKER;
+
+typedef struct ReclaimStat {
+    /// @brief kswapd被唤醒的次数
+    uint64_t kswapd_wakeups;
+    /// @brief kswapd回收的对象数
+    uint64_t kswapd_reclaimed;
+    /// @brief 进入直接回收的次数
+    uint64_t direct_runs;
+    /// @brief 直接回收的对象数
+    uint64_t direct_reclaimed;
+    /// @brief 回收之后仍然失败的分配
+    uint64_t alloc_fail;
+} RECLAIM_STAT;
+
+void register_shrinker(SHRINKER *shrinker);
+void unregister_shrinker(SHRINKER *shrinker);
+void init_watermarks(void);
+void kswapd_thread(void);
+void wakeup_kswapd(void);
+bool reclaim_direct(void);
+void reclaim_alloc_failed(void);
+void reclaim_stat(RECLAIM_STAT *stat);
+uint32_t shrinker_show(char *buf, uint32_t size);
+
+#endif
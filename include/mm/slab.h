@@ -18,25 +18,98 @@
 #define IO_REMAP_START (HEAP_ADDR_START + HEAP_SIZE_MAX)
 #define IO_REMAP_END   (IO_REMAP_START + HEAP_SIZE_MAX)
 
-typedef struct SLab {
-    uint8_t nextfree;
-    uint8_t totalfree;
-    uint8_t bitmap[16];
-} SLAB;
-
-typedef struct SlabInfo {
-    uint64_t area_start_addr;
-    uint16_t size;
-    uint16_t emptynum;
-} SLAB_INFO;
-
-typedef struct SlabMiddle {
-    struct SlabMiddle* next;
-    struct SlabMiddle* past;
-    uint32_t totalfree;
-    uint32_t nextfree;
-    uint32_t id;
-    uint8_t bitmap[32];
-} SLAB_MIDDLE;
+#include "lib/safelist.h"
+
+/// kmalloc的小对象尺寸级: 32,64,...,2048, 每一级独占上面的一个512G窗口
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_NR_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define KMALLOC_MAX_SIZE (1U << KMALLOC_MAX_SHIFT)
+
+/// 单个slab最多占用2^5页, 只有很大的对象(例如pcb)才会用到
+#define KMEM_MAX_ORDER 5
+/// 直接映射的cache最多保留的空slab数量, 多余的空slab归还给页分配器
+#define KMEM_FREE_SLABS_KEEP 2
+#define KMEM_SLAB_MAGIC 0x51ab51ab
+
+/// 每CPU magazine的最大容量, 实际容量按对象大小递减
+#define KMEM_MAG_SIZE 32
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+/// @brief 每CPU的空闲对象栈, 只允许本CPU在关中断时访问
+/// @note 为空时从slab批量取batch个, 满时把最早放入的batch个还给slab
+typedef struct KmemMagazine {
+    /// @brief Number of objects on the stack
+    uint32_t avail;
+    uint32_t limit;
+    uint32_t batch;
+    /* 统计 */
+    uint64_t alloc_hit;
+    uint64_t alloc_miss;
+    uint64_t free_hit;
+    uint64_t free_flush;
+    void *objs[KMEM_MAG_SIZE];
+} KMEM_MAGAZINE;
+
+/// @brief slab描述符, 放在slab的第一个对象之前
+/// @note slab按照其大小自然对齐, 所以对象地址向下对齐即可得到slab
+typedef struct KmemSlab {
+    struct KmemCache *cache;
+    /// @brief node in partial/full/free list of the cache
+    list_head_t list;
+    /// @brief 空闲对象链表, 链表指针嵌在空闲对象的前8个字节
+    void *freelist;
+    /// @brief Number of objects never handed out, carved from the tail lazily
+    uint32_t unused;
+    /// @brief Number of allocated objects
+    uint32_t inuse;
+    uint32_t magic;
+    /// @brief NUMA node of the slab's first page
+    uint32_t node;
+} KMEM_SLAB;
+
+typedef struct KmemCache {
+    const char *name;
+    /// @brief Object stride (size rounded up to align)
+    uint32_t size;
+    uint32_t object_size;
+    uint32_t align;
+    /// @brief Each slab is 2^order pages
+    uint32_t order;
+    uint32_t objs_per_slab;
+    /// @brief Offset of the first object from the slab start
+    uint32_t offset;
+    /// @brief 每次分配时调用, 因为空闲对象的开头被free list占用
+    kmem_ctor_t ctor;
+    /// @brief 0表示slab来自直接映射区, 否则slab从这个虚拟窗口中线性分配
+    uint64_t window_start;
+    uint64_t window_next;
+    /// @brief 部分使用和全空的slab按NUMA节点分开, 分配先找本节点的
+    list_head_t partial[MAX_NUMA_NODES];
+    list_head_t full;
+    list_head_t free[MAX_NUMA_NODES];
+    spinlock_t lock;
+    /// @brief node in the global cache list
+    list_head_t cache_list;
+    /// @brief per-CPU magazines, NULL before init_slab_magazine
+    KMEM_MAGAZINE *mag[MAX_CPU_NUM];
+    /* 统计 */
+    uint64_t nr_slabs;
+    uint64_t nr_free_slabs;
+    uint64_t nr_active;
+    uint64_t nr_alloc;
+    uint64_t nr_free;
+} KMEM_CACHE;
+
+typedef KMEM_CACHE kmem_cache_t;
+
+void init_slab(void);
+void init_slab_magazine(void);
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_alloc_node(kmem_cache_t *cache, uint32_t node);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+uint32_t kmem_cache_show(char *buf, uint32_t size);
 
 #endif
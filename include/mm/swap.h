@@ -0,0 +1,82 @@
+#ifndef OS_SWAP_H
+#define OS_SWAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mm/page_pool.h"
+
+/**
+ * 压缩内存交换
+ * 冷的私有匿名页压缩后放在内核内存里, 表项改成不存在的换出表项:
+ * slot << 12 | 原来的权限位 | PAGE_SWAPPED, slot为0表示正在换出
+ */
+
+/// 换出表项保留的权限位
+#define SWAP_PTE_FLAGS (PAGE_WRITABLE | PAGE_USER_MODE | PAGE_COW)
+/// 压缩后超过半页时kmalloc落在整页上, 不省内存, 直接放弃
+#define SWAP_MAX_COMPRESSED 2048
+/// 每个task一次隔离的页数, 共用一次TLB shootdown
+#define SWAP_BATCH 32
+/// slot描述符按页分块, 块目录是静态的
+#define SWAP_SLOTS_PER_CHUNK (4096 / 16)
+#define SWAP_MAX_CHUNKS 4096
+
+static inline uint64_t swap_pte(uint32_t slot, uint64_t flags)
+{
+    return ((uint64_t)slot << 12) | (flags & SWAP_PTE_FLAGS) | PAGE_SWAPPED;
+}
+
+static inline bool is_swap_pte(uint64_t pte)
+{
+    return !(pte & PAGE_PRESENT) && (pte & PAGE_SWAPPED);
+}
+
+static inline uint32_t swap_pte_slot(uint64_t pte)
+{
+    return (uint32_t)(pte >> 12);
+}
+
+/// @brief 隔离出来等待压缩的页
+typedef struct SwapCandidate {
+    uint64_t addr;
+    uint64_t phy;
+} SWAP_CANDIDATE;
+
+typedef struct SwapStat {
+    /// @brief 当前存着的页数, 其中整页同一个值的不占压缩空间
+    uint64_t stored;
+    uint64_t same_filled;
+    /// @brief 压缩数据的总字节数与kmalloc实际占用的字节数
+    uint64_t compr_bytes;
+    uint64_t pool_bytes;
+    /// @brief slot描述符占用的页数, 分配后不再释放
+    uint64_t chunk_pages;
+    /// @brief 压缩存放的页(不含同值页)的原始大小 / (pool_bytes + 描述符页) x100
+    uint64_t ratio;
+    /* 累计 */
+    uint64_t swap_out;
+    uint64_t swap_in;
+    /// @brief 压缩后超过SWAP_MAX_COMPRESSED放弃的页
+    uint64_t reject;
+    /// @brief 没有slot或者内存不足放弃的页
+    uint64_t fail;
+    /// @brief 换入缺页的耗时(TSC周期)
+    uint64_t in_cycles;
+    uint64_t in_cycles_max;
+} SWAP_STAT;
+
+void init_swap(void);
+uint32_t swap_store(void *page);
+int swap_load(uint32_t slot, void *page);
+void swap_dup(uint32_t slot);
+void swap_free(uint32_t slot);
+void swap_account_in(uint64_t cycles);
+void swap_stat(SWAP_STAT *stat);
+
+/* mm.c: 页表一侧 */
+uint32_t swap_isolate_user_pages(uint64_t ptable_vir, uint64_t *cursor, uint64_t *scan,
+                                 SWAP_CANDIDATE *out, uint32_t n);
+int swap_finish_user_page(uint64_t ptable_vir, SWAP_CANDIDATE *c, uint32_t slot);
+int swap_in_user_page(uint64_t vir_addr, uint64_t ptable_vir);
+
+#endif
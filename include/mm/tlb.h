@@ -0,0 +1,64 @@
+#ifndef OS_TLB_H
+#define OS_TLB_H
+
+#include <stdint.h>
+
+/// 超过这么多页就不再逐页invlpg, 直接整体刷新
+#define TLB_FULL_FLUSH_PAGES 32
+#define TLB_FLUSH_ALL ((uint64_t)-1)
+
+/// 页表本身要被释放: 懒惰地沿用该页表的CPU也必须切走
+#define TLB_FREED_TABLES (1 << 0)
+
+/// @brief 一批待刷新的地址, 攒够之后只发一次IPI
+typedef struct TlbBatch {
+    /// @brief 页表的虚拟地址, 0表示内核映射(所有CPU都可能缓存)
+    uint64_t cr3;
+    /// @brief [start, end), start == end表示空
+    uint64_t start;
+    uint64_t end;
+} TLB_BATCH;
+
+typedef struct TlbStat {
+    /// @brief 发起的刷新次数
+    uint64_t shootdowns;
+    /// @brief 发出的IPI数
+    uint64_t ipis;
+    /// @brief 退化为整体刷新的次数
+    uint64_t full_flushes;
+    /// @brief 因为目标CPU正在懒惰地运行内核线程而省掉的IPI数
+    uint64_t lazy_skipped;
+} TLB_STAT;
+
+void init_tlb_cpu(void);
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end, uint32_t flags);
+void tlb_shootdown_intr(void);
+void tlb_stat(TLB_STAT *stat);
+
+static inline void tlb_batch_init(TLB_BATCH *batch, uint64_t cr3)
+{
+    batch->cr3 = cr3;
+    batch->start = batch->end = 0;
+}
+
+static inline void tlb_batch_add(TLB_BATCH *batch, uint64_t addr, uint64_t size)
+{
+    if (batch->start == batch->end) {
+        batch->start = addr;
+        batch->end = addr + size;
+        return;
+    }
+    if (addr < batch->start)
+        batch->start = addr;
+    if (addr + size > batch->end)
+        batch->end = addr + size;
+}
+
+static inline void tlb_batch_flush(TLB_BATCH *batch)
+{
+    if (batch->start != batch->end)
+        tlb_shootdown(batch->cr3, batch->start, batch->end, 0);
+    batch->start = batch->end = 0;
+}
+
+#endif
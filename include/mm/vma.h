@@ -0,0 +1,52 @@
+#ifndef OS_VMA_H
+#define OS_VMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lib/my_list.h"
+
+struct pcb;
+struct file;
+
+#define VMA_READ (1 << 0)
+#define VMA_WRITE (1 << 1)
+#define VMA_EXEC (1 << 2)
+/// 匿名区域中完整覆盖的2M对齐块用大页填充
+#define VMA_HUGE (1 << 3)
+/// MAP_SHARED: 页在fork后仍然共享, 写不触发复制
+#define VMA_SHARED (1 << 4)
+#define VMA_ACCESS (VMA_READ | VMA_WRITE | VMA_EXEC)
+
+/// 缺页预映射窗口的默认上限和最大值(页), 窗口不超过一张页表覆盖的2M
+#define FAULT_AROUND_DEFAULT 16
+#define FAULT_AROUND_MAX 512
+
+/// @brief 用户地址空间中的一段区域, 缺页时按区域描述填充
+/// @note mmap范围以外且不在任何区域内的缺页仍按匿名页处理(用户栈)
+typedef struct VmArea {
+    /// @brief node in pcb->vma_list, sorted by start
+    list_head_t list;
+    /// @brief [start, end), page aligned
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+    /// @brief backing file, NULL for anonymous memory; the area holds one reference
+    struct file *file;
+    /// @brief [file_start, file_end) is read from file at file_offset, the rest is zero
+    uint64_t file_start;
+    uint64_t file_end;
+    uint64_t file_offset;
+} VM_AREA;
+
+void init_vma(void);
+int vma_add(struct pcb *task, uint64_t start, uint64_t end, uint32_t flags,
+            struct file *file, uint64_t file_offset, uint64_t file_start, uint64_t file_end);
+VM_AREA *vma_find(struct pcb *task, uint64_t addr);
+int vma_copy(struct pcb *dst, struct pcb *src);
+void vma_free_all(struct pcb *task);
+int vma_fault(struct pcb *task, uint64_t addr, bool write, bool intr);
+int vma_unmap(struct pcb *task, uint64_t start, uint64_t end);
+int vma_protect(struct pcb *task, uint64_t start, uint64_t end, uint32_t access);
+uint64_t vma_get_unmapped(struct pcb *task, uint64_t len);
+
+#endif
@@ -2,6 +2,7 @@
 #define OS_PROTECT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct CPUCore {
 
@@ -129,4 +130,11 @@ typedef struct tss {
 #define CR4_SMAP    (1 << 21)  /* SMAP Enable */
 #define CR4_PKE     (1 << 22)  /* Protection Key Enable */
 
+/* CR3 位(CR4.PCIDE=1时) */
+#define CR3_PCID_MASK 0xfffUL           /* 低12位是PCID */
+#define CR3_NOFLUSH   (1UL << 63)       /* 写CR3时保留该PCID的TLB项 */
+
+/// @brief 所有CPU都开启了CR4.PCIDE
+extern bool pcid_enabled;
+
 #endif
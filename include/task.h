@@ -6,10 +6,41 @@
 #include "lib/my_list.h"
 #include "lib/safelist.h"
 #include "lib/wait_queue.h"
+#include "lib/rbtree.h"
+#include "const.h"
 
 #define TASK_MAGIC 0x13973264       // for PCB safety
 #define NR_OPEN_DEFAULT 64
 
+/* 公平调度参数, 时间单位为纳秒 */
+/// 调度周期: 就绪任务在这段时间内都能运行一次, 也是醒来的任务等待的上限
+#define SCHED_LATENCY_NS        6000000ULL
+/// 每次被选中后至少运行这么久才会因为vruntime落后被抢占
+#define SCHED_MIN_GRAN_NS       750000ULL
+/// 醒来的任务vruntime比当前任务小这么多时抢占它
+#define SCHED_WAKEUP_GRAN_NS    1000000ULL
+/// 离上次运行不到这么久的任务缓存还热, 空闲CPU不去偷它
+#define SCHED_MIGRATION_COST_NS 500000ULL
+#define NICE_0_WEIGHT           1024
+#define NICE_MIN                (-20)
+#define NICE_MAX                19
+
+/// enqueue_task的flags
+#define ENQUEUE_WAKEUP          1
+#define ENQUEUE_NEW             2
+
+/// @brief 每个CPU的就绪队列: 按vruntime排序的红黑树, 不含正在运行的任务
+typedef struct cfs_rq {
+    spinlock_t lock;
+    rb_root_t tasks;
+    /// @brief 缓存vruntime最小的节点
+    rb_node_t *leftmost;
+    /// @brief 单调增长, 醒来和新建的任务以它为基准放置
+    uint64_t min_vruntime;
+    /// @brief 树中任务的权重之和
+    uint64_t load;
+} cfs_rq_t;
+
 typedef struct task_manager{
     spin_list_head_t all_list;
     spinlock_t id_lock;
@@ -34,14 +65,22 @@ typedef struct pcb
     int pid;
     bool is_ker;
     uint64_t cr3;
-    int ticks;
     uint32_t cpuid;
     list_head_t all_list;
     /* parent relationship */
     struct pcb *parent;
     spin_list_head_t childs;
     /* scheduler needed */
-    list_head_t ready_list_item;
+    rb_node_t run_node;
+    bool on_rq;
+    int nice;
+    uint32_t weight;
+    /// @brief 按权重折算的运行时间, 只和同一CPU上的任务比较
+    uint64_t vruntime;
+    /// @brief 上次记账的时刻, 累计运行时间, 本次被选中时的累计运行时间
+    uint64_t exec_start;
+    uint64_t sum_exec;
+    uint64_t slice_start;
     list_head_t other_list_item;
     list_head_t child_list_item;
     list_head_t wait_list_item;
@@ -53,6 +92,19 @@ typedef struct pcb
     /* 文件系统 */
     struct file *files[NR_OPEN_DEFAULT];
     struct dentry *cwd;
+    /* 地址空间: 按起始地址排序的VM_AREA */
+    list_head_t vma_list;
+    /// @brief 换出扫描持有它时, exit/exec/fork不能拆掉或复制页表
+    mutex_t mm_mutex;
+    /* 缺页预映射: 窗口上限(页, 0关闭), 当前窗口, 上一次预映射的范围 */
+    uint32_t fault_around_max;
+    uint32_t fault_around;
+    uint64_t fault_around_start;
+    uint64_t fault_around_end;
+    /* 每个CPU上分配给该地址空间的PCID: 代数<<12 | PCID */
+    uint64_t pcid[MAX_CPU_NUM];
+    /// @brief 上次装载cr3的CPU
+    uint32_t pcid_cpu;
     
     enum task_state state;
     int exit_status;
@@ -82,6 +134,7 @@ extern pcb_t *pcb_of_init;
 
 pcb_t *get_current(void);
 void put_to_ready_list_first(pcb_t *task);
+void task_pcid_invalidate(pcb_t *task);
 
 int kernel_thread_default(char *name, void *addr,void *arg);
 int kernel_thread_link_init(char *name, void *addr,void *arg);
@@ -93,6 +146,20 @@ void schedule(void);
 void __schedule_locked(uint8_t intr);
 void __schedule_other_locked(spinlock_t *wq_lock);
 void sys_yield(void);
+int sys_nice(int inc);
+
+/* sched_fair.c, 除init_cfs_rq和sched_fork外调用者持有CPU的rq.lock并关中断 */
+struct cpu_item;
+void init_cfs_rq(cfs_rq_t *rq);
+void sched_fork(pcb_t *task, pcb_t *parent);
+void update_curr(struct cpu_item *cpu);
+void enqueue_task(struct cpu_item *cpu, pcb_t *task, int flags);
+void dequeue_task(struct cpu_item *cpu, pcb_t *task);
+pcb_t *pick_next_task(struct cpu_item *cpu);
+void yield_task(struct cpu_item *cpu);
+bool sched_tick(struct cpu_item *cpu);
+void migrate_task(struct cpu_item *from, struct cpu_item *to, pcb_t *task);
+bool task_cache_hot(pcb_t *task, uint64_t now);
 static inline void preempt_disable(void) {
     pcb_t *current = get_current();
     current->preempt_count++;
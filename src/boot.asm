@@ -15,11 +15,13 @@ global DoubleFault,CoprocessorSegmentOverRun,InvalidTSS,SegmentNotPresent,Genera
 global AlignmentCheck,MachineCheck,SIMDException,VirtualizationException,StackSegmentFault,Divide_Error
 global intr0,intr1,intr2,intr3,intr4,intr5,intr6,intr7,intr8,intr9,intr10,intr11,intr12,intr13,intr14,intr15,intr16,intr17,intr18,intr19,intr20,intr21,intr22,intr23
 global intr2_bsp
+global intr_tlb_shootdown,intr_lapic_timer,intr_reschedule
 global syscall_enter
 global task_switch_unlock,task_switch_double_unlock,asm_task_start,asm_task_start_go_out,asm_execv_out,asm_fork_child_back
 
 extern cstart,exception_handler
 extern intr_handler,timer_intr_soft_bsp
+extern tlb_shootdown_intr,lapic_timer_intr,reschedule_intr
 extern ap_startup_lock
 extern ap_ready_num
 extern ap_start
@@ -440,6 +442,21 @@ section .text64high
         save
         call timer_intr_soft_bsp
         go_out
+    align 16
+    intr_tlb_shootdown :
+        save
+        call tlb_shootdown_intr
+        go_out
+    align 16
+    intr_lapic_timer :
+        save
+        call lapic_timer_intr
+        go_out
+    align 16
+    intr_reschedule :
+        save
+        call reschedule_intr
+        go_out
 
     load_protect:
         lgdt [rdi]
@@ -3,10 +3,17 @@
 #include "mm/mm.h"
 #include "string.h"
 #include "view/view.h"
+#include <stdbool.h>
 
 extern char rootuuid[37];
 
+/// @brief 命令行带nopcid时不开启PCID, 用于对比进程切换开销
+bool cmdline_nopcid;
+/// @brief 命令行带timerbench时启动后测一次时间轮的插入开销
+bool cmdline_timerbench;
+
 static int extract_root_uuid(const char *cmdline, char *uuid_buf, size_t len);
+static int has_option(const char *cmdline, const char *name);
 
 void parse_cmd_line(MULTIBOOT_INFO *info){
     if (info->flags & MULTIBOOT_INFO_CMDLINE){
@@ -17,6 +24,8 @@ void parse_cmd_line(MULTIBOOT_INFO *info){
             wb_printf("[CMDLINE] grub says that no root!!!");
             halt();
         }
+        cmdline_nopcid = has_option(cmdline, "nopcid");
+        cmdline_timerbench = has_option(cmdline, "timerbench");
     }else{
         wb_printf("[CMDLINE] grub give no cmdline!!!");
         halt();
@@ -54,3 +63,17 @@ static int extract_root_uuid(const char *cmdline, char *uuid_buf, size_t len) {
     }
     return 0; // 未找到
 }
+
+// 命令行中是否有名为name的独立参数
+static int has_option(const char *cmdline, const char *name) {
+    const char *p = cmdline;
+    size_t name_len = strlen(name);
+
+    while (*p) {
+        p = skip_spaces(p);
+        if (strncmp(p, name, name_len) == 0 && (p[name_len] == ' ' || p[name_len] == '\0'))
+            return 1;
+        while (*p && *p != ' ') p++;
+    }
+    return 0;
+}
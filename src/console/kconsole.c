@@ -110,6 +110,11 @@ static void sh_runner(void *arg)
 
     while (1) {
         int child_pid = kernel_thread_default("sh",sh_start,slave_name);
+        // 内存不足时过一会儿再试, 不能拿-1去等任意子进程
+        if (child_pid < 0) {
+            sys_yield();
+            continue;
+        }
         sys_waitpid(child_pid,NULL);
     }
 }
@@ -3,10 +3,15 @@
 #include <stdint.h>
 #include "view/view.h"
 #include "machine/cpu.h"
+#include "mm/mm.h"
+#include "mm/reclaim.h"
 
 MULTIBOOT_INFO* global_multiboot_info;
+extern GLOBAL_CPU *cpus;
 
 void init_mm(MULTIBOOT_INFO* info);
+void init_page_pcp(void);
+void init_slab_magazine(void);
 void parse_cmd_line(MULTIBOOT_INFO *info);
 void init_view(MULTIBOOT_INFO* info);
 void init_protect(uint8_t is_bsp);
@@ -15,9 +20,11 @@ void init_apic_ap(void);
 void init_time(void);
 void init_keyboard(void);
 void init_ap(void);
+uint32_t idle_balance(uint32_t id);
 void init_acpi_madt(void);
 void init_task(void);
 void init_fs_mem(void);
+void init_swap(void);
 void enumerate_pcie_devices(void);
 void read_partitions(void);
 void init_fpu_sse(void);
@@ -28,13 +35,15 @@ _Noreturn void cpu_task_start(void);
 bool multi_core_start = false;
 bool tty_ready = false;
 
-void enable_irq(uint64_t irq);
+void init_tick_cpu(void);
+void tick_nohz_idle(uint32_t id);
 _Noreturn void ap_start(void){
+    init_pat();
     init_apic_ap();
     init_protect(0);
     wb_printf("[AP Core] Core %d started!\n",get_logic_cpu_id());
     init_fpu_sse();
-    enable_irq(2);
+    init_tick_cpu();
     cpu_task_start();
 }
 
@@ -46,6 +55,8 @@ _Noreturn void cstart(MULTIBOOT_INFO* info)
     parse_cmd_line(info);
     init_acpi_madt();
     init_apic_bsp();
+    init_page_pcp();
+    init_slab_magazine();
     wb_printf("[SYSTEM ] apic ready\n");
     init_protect(1);
     init_task();
@@ -71,7 +82,9 @@ void ehci_initial_scan(void);
 
 void init(void){
     wb_printf("[SYSTEM ] enter init progress!\n");
-    
+
+    kernel_thread_link_init("kswapd",kswapd_thread,NULL);
+    init_swap();
     init_fs_mem();
     enumerate_pcie_devices();
 
@@ -95,7 +108,17 @@ void init(void){
 }
 
 void idle(void){
+    uint32_t id = get_logic_cpu_id();
+    CPU_ITEM *item = &cpus->items[id];
     while(1){
-        __asm__ __volatile__("hlt");
+        /* 有任务(被叫醒或者偷到)就马上切换, 没有时先从别的CPU偷 */
+        if (item->total_ready_num || idle_balance(id)){
+            schedule();
+            continue;
+        }
+        /* 再预清零一页, 池满了再停掉时钟等中断 */
+        if (page_zero_idle_fill())
+            continue;
+        tick_nohz_idle(id);
     }
 }
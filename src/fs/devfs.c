@@ -51,7 +51,7 @@ static inode_t *devfs_read_root_inode(struct super_block *sb)
 {
     sb->private_data = NULL;
     // 创建根目录 inode
-    inode_t *inode = (inode_t *)kmalloc(sizeof(inode_t));
+    inode_t *inode = (inode_t *)kmem_cache_alloc(inode_cachep);
     if (!inode) return NULL;
     memset(inode, 0, sizeof(inode_t));
     inode->ino = 1;
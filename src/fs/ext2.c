@@ -1564,11 +1564,11 @@ static int ext2_bmap(struct inode *inode, uint32_t logical_block)
 
 static inode_t *ext2_create_VFS_inode(struct super_block *sb, struct ext2_inode *ei,uint64_t ino)
 {
-    inode_t *inode = kmalloc(sizeof(inode_t));
+    inode_t *inode = kmem_cache_alloc(inode_cachep);
     if (!inode) return NULL;
     ext2_inode_t *ext2inode = kmalloc(sizeof(ext2_inode_t));
     if (!ext2inode) {
-        kfree(inode);
+        kmem_cache_free(inode_cachep, inode);
         return NULL;
     }
     memset(inode, 0, sizeof(inode_t));
@@ -7,6 +7,7 @@
 #include "const.h"
 #include "task.h"
 #include "fs/fcntl.h"
+#include "mm/reclaim.h"
 
 #include "fs/ramfs.h"
 #include "fs/devfs.h"
@@ -23,6 +24,7 @@ static int __vfs_mount_locked(partition_t *part, const char *target_path, int fs
 static inline void dentry_free(dentry_t *dentry);
 
 static void dentry_cache_task(void);
+static SHRINKER dentry_shrinker;
 static uint8_t mount_fs(super_block_t *sb);
 
 struct file *vfs_open(const char *path, int flags, int mode);
@@ -33,10 +35,18 @@ int vfs_close(struct file *file);
 vfs_manager_t vfs_mgr;
 char rootuuid[37] = "?";
 
+kmem_cache_t *inode_cachep;
+kmem_cache_t *dentry_cachep;
+kmem_cache_t *file_cachep;
+
 void init_fs_mem(void){
+    inode_cachep = kmem_cache_create("inode", sizeof(inode_t), 8, NULL);
+    dentry_cachep = kmem_cache_create("dentry", sizeof(dentry_t), 8, NULL);
+    file_cachep = kmem_cache_create("file", sizeof(struct file), 8, NULL);
     init_block();
     init_vfs_mgr();
     kernel_thread_link_init("fs_cache",dentry_cache_task,NULL);
+    register_shrinker(&dentry_shrinker);
 }
 
 static inline void init_vfs_mgr(void){
@@ -283,7 +293,7 @@ dentry_t *dentry_create(const char *name,inode_t *inode){
     if (!name)
         return NULL;
 
-    dentry_t *d = kmalloc(sizeof(dentry_t));
+    dentry_t *d = kmem_cache_alloc(dentry_cachep);
     if (!d)
         return NULL;
 
@@ -291,7 +301,7 @@ dentry_t *dentry_create(const char *name,inode_t *inode){
 
     d->name = kmalloc(len);
     if (!d->name) {
-        kfree(d);
+        kmem_cache_free(dentry_cachep, d);
         return NULL;
     }
 
@@ -380,7 +390,7 @@ void inode_put(inode_t *inode){
     if (inode->inode_ops && inode->inode_ops->delete)
         inode->inode_ops->delete(inode);
     
-    kfree(inode);
+    kmem_cache_free(inode_cachep, inode);
 }
 
 static dentry_t *lookup_child(dentry_t *parent, const char *name)
@@ -854,7 +864,7 @@ struct file *vfs_open(const char *path, int flags, int mode)
 
 found:
     // 分配 file 结构
-    file = (struct file *)kmalloc(sizeof(struct file));
+    file = (struct file *)kmem_cache_alloc(file_cachep);
     if (!file) {
         dentry_put(dentry);
         return NULL;
@@ -868,7 +878,7 @@ found:
     atomic_set(&file->refcount, 1);
     file->file_ops = dentry->inode->default_file_ops;
     if (!file->file_ops) {
-        kfree(file);
+        kmem_cache_free(file_cachep, file);
         dentry_put(dentry);
         return NULL;
     }
@@ -876,7 +886,7 @@ found:
     if (file->file_ops->open) {
         ret = file->file_ops->open(dentry->inode, file);
         if (ret < 0) {
-            kfree(file);
+            kmem_cache_free(file_cachep, file);
             dentry_put(dentry);
             return NULL;
         }
@@ -901,6 +911,18 @@ ssize_t vfs_read(struct file *file, char *buf, size_t count)
     return ret;
 }
 
+/// @brief 从指定位置读, 不使用也不修改file->pos
+ssize_t vfs_pread(struct file *file, char *buf, size_t count, uint64_t pos)
+{
+    if (!file || !file->file_ops || !file->file_ops->read)
+        return -1;
+    int64_t off = (int64_t)pos;
+    read_lock(&file->inode->i_meta_lock);
+    ssize_t ret = file->file_ops->read(file, buf, count, &off);
+    read_unlock(&file->inode->i_meta_lock);
+    return ret;
+}
+
 ssize_t vfs_write(struct file *file, const char *buf, size_t count)
 {
     if (!file || !file->file_ops || !file->file_ops->write)
@@ -939,7 +961,7 @@ int vfs_close(struct file *file)
     sb_put(sb);
 
     // 释放 file 结构自身
-    kfree(file);
+    kmem_cache_free(file_cachep, file);
 
     return 0;
 }
@@ -950,62 +972,111 @@ static inline void dentry_free(dentry_t *dentry){
     }
     if (dentry->name)
         kfree(dentry->name);
-    kfree(dentry);
+    kmem_cache_free(dentry_cachep, dentry);
+}
+
+/**
+ * @brief 从缓存队列头取一个dentry尝试释放
+ * @param reclaim 内存回收时调用: 不等待父目录的锁, 也不释放ramfs/devfs的dentry(它们是唯一的副本)
+ * @return 1 已释放, 0 仍在使用或暂时不能释放, 已放回队尾, -1 队列为空
+ */
+static int dentry_cache_evict_first(bool reclaim)
+{
+    dentry_t *dentry;
+    // 从队列取出（已移出）
+    spin_lock(&vfs_mgr.dentry_cache_list.lock);
+    if (list_empty(&vfs_mgr.dentry_cache_list.list)) {
+        spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+        return -1;
+    }
+    dentry = list_first_entry(&vfs_mgr.dentry_cache_list.list, dentry_t, cache_list_item);
+    list_del_init(&dentry->cache_list_item);
+    if (reclaim && (!dentry->in_mnt || dentry->in_mnt->fs_type == FS_TYPE_RAMFS ||
+                    dentry->in_mnt->fs_type == FS_TYPE_DEVFS)) {
+        list_add_tail(&dentry->cache_list_item, &vfs_mgr.dentry_cache_list.list);
+        spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+        return 0;
+    }
+    spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+
+    // 获取父目录锁（若存在）
+    inode_t *parent_inode = dentry->parent ? dentry->parent->inode : NULL;
+    if (parent_inode) {
+        if (!reclaim) {
+            write_lock(&parent_inode->i_meta_lock);
+        } else if (!write_trylock(&parent_inode->i_meta_lock)) {
+            spin_list_add_tail(&dentry->cache_list_item, &vfs_mgr.dentry_cache_list);
+            return 0;
+        }
+    }
+
+    // 循环处理，应对并发释放
+    while (1) {
+        int ref = atomic_read(&dentry->refcount);
+        if (ref == 0) {
+            // 安全释放
+            if (parent_inode) {
+                list_del_init(&dentry->child_list_item);
+                dentry_put(dentry->parent);  // 释放父目录引用
+            }
+            atomic_dec(&vfs_mgr.dentry_cache_num);
+            if (parent_inode)
+                write_unlock(&parent_inode->i_meta_lock);
+            dentry_free(dentry);
+            return 1;
+        } else {
+            // 需要放回队列
+            spin_lock(&vfs_mgr.dentry_cache_list.lock);
+            // 再次检查计数（可能在拿锁期间变化）
+            if (atomic_read(&dentry->refcount) == 0) {
+                spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+                continue;  // 重新检查，走释放路径
+            }
+            // 仍非0，放回队列（标志已为true，无需改）
+            list_add_tail(&dentry->cache_list_item, &vfs_mgr.dentry_cache_list.list);
+            spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+            if (parent_inode)
+                write_unlock(&parent_inode->i_meta_lock);
+            return 0;  // 结束，等待下次处理
+        }
+    }
 }
 
 static void dentry_cache_task(void)
 {
     while (1) {
-        dentry_t *dentry;
-        // 从队列取出（已移出）
-        spin_lock(&vfs_mgr.dentry_cache_list.lock);
         if (atomic_read(&vfs_mgr.dentry_cache_num) <= DENTRY_CACHE_SIZE) {
-            spin_unlock(&vfs_mgr.dentry_cache_list.lock);
             sys_yield();
             continue;
         }
-        dentry = list_first_entry(&vfs_mgr.dentry_cache_list.list, dentry_t, cache_list_item);
-        list_del_init(&dentry->cache_list_item);
-        spin_unlock(&vfs_mgr.dentry_cache_list.lock);
+        dentry_cache_evict_first(false);
+    }
+}
 
-        // 获取父目录锁（若存在）
-        inode_t *parent_inode = dentry->parent ? dentry->parent->inode : NULL;
-        if (parent_inode)
-            write_lock(&parent_inode->i_meta_lock);
+static uint64_t dentry_shrink_count(UNUSED SHRINKER *shrinker)
+{
+    return atomic_read(&vfs_mgr.dentry_cache_num);
+}
 
-        // 循环处理，应对并发释放
-        while (1) {
-            int ref = atomic_read(&dentry->refcount);
-            if (ref == 0) {
-                // 安全释放
-                if (parent_inode) {
-                    list_del_init(&dentry->child_list_item);
-                    dentry_put(dentry->parent);  // 释放父目录引用
-                }
-                atomic_dec(&vfs_mgr.dentry_cache_num);
-                if (parent_inode)
-                    write_unlock(&parent_inode->i_meta_lock);
-                dentry_free(dentry);
-                break;  // 结束
-            } else {
-                // 需要放回队列
-                spin_lock(&vfs_mgr.dentry_cache_list.lock);
-                // 再次检查计数（可能在拿锁期间变化）
-                if (atomic_read(&dentry->refcount) == 0) {
-                    spin_unlock(&vfs_mgr.dentry_cache_list.lock);
-                    continue;  // 重新检查，走释放路径
-                }
-                // 仍非0，放回队列（标志已为true，无需改）
-                list_add_tail(&dentry->cache_list_item, &vfs_mgr.dentry_cache_list.list);
-                spin_unlock(&vfs_mgr.dentry_cache_list.lock);
-                if (parent_inode)
-                    write_unlock(&parent_inode->i_meta_lock);
-                break;  // 结束，等待下次处理
-            }
-        }
+/// @note 最多看nr个缓存项, 用过的和不能释放的转到队尾
+static uint64_t dentry_shrink_scan(UNUSED SHRINKER *shrinker, uint64_t nr)
+{
+    uint64_t freed = 0;
+    while (nr--) {
+        int ret = dentry_cache_evict_first(true);
+        if (ret < 0)
+            break;
+        freed += ret;
     }
+    return freed;
 }
 
+static SHRINKER dentry_shrinker = {
+    .name = "dcache",
+    .count = dentry_shrink_count,
+    .scan = dentry_shrink_scan,
+};
+
 int devfs_block_register(const char *name,int mode, struct file_operations *fops,block_device_t *bdev,uint64_t flags,bool locked)
 {
     int ret = -1;
@@ -1023,7 +1094,7 @@ int devfs_block_register(const char *name,int mode, struct file_operations *fops
         goto out;
     }
 
-    inode_t *new_node = kmalloc(sizeof(inode_t));
+    inode_t *new_node = kmem_cache_alloc(inode_cachep);
     if (!new_node){
         goto out;
     }
@@ -1044,7 +1115,7 @@ int devfs_block_register(const char *name,int mode, struct file_operations *fops
 
     dentry_t *new_dentry = dentry_create(name,new_node);
     if (!new_dentry){
-        kfree(new_node);
+        kmem_cache_free(inode_cachep, new_node);
         goto out;
     }
     new_dentry->in_mnt = devfs_sb;
@@ -1079,7 +1150,7 @@ int devfs_chr_register(const char *name, int mode, struct file_operations *fops,
         goto out;
     }
 
-    inode_t *new_node = kmalloc(sizeof(inode_t));
+    inode_t *new_node = kmem_cache_alloc(inode_cachep);
     if (!new_node){
         goto out;
     }
@@ -1100,7 +1171,7 @@ int devfs_chr_register(const char *name, int mode, struct file_operations *fops,
 
     dentry_t *new_dentry = dentry_create(name, new_node);
     if (!new_dentry){
-        kfree(new_node);
+        kmem_cache_free(inode_cachep, new_node);
         goto out;
     }
     new_dentry->in_mnt = devfs_sb;
@@ -115,7 +115,7 @@ static pipe_t *new_pipe(void){
 static inode_t *pipe_new_inode(pipe_t *pipe){
     if (!pipe)
         return NULL;
-    inode_t *new = kmalloc(sizeof(inode_t));
+    inode_t *new = kmem_cache_alloc(inode_cachep);
     if (!new)
         return NULL;
     
@@ -153,7 +153,7 @@ int sys_pipe(int pipe_buf[2]){
     inode_t *inode = pipe_new_inode(pipe);
     if (!inode)
         goto out_pipe;
-    file_t *file1 = kmalloc(sizeof(file_t));
+    file_t *file1 = kmem_cache_alloc(file_cachep);
     if (!file1)
         goto out_inode;
     file1->dentry = NULL;
@@ -164,7 +164,7 @@ int sys_pipe(int pipe_buf[2]){
     file1->pos = 0;
     file1->private_data = NULL;
     atomic_set(&file1->refcount,1);
-    file_t *file2 = kmalloc(sizeof(file_t));
+    file_t *file2 = kmem_cache_alloc(file_cachep);
     if (!file2)
         goto out_file1;
     file2->dentry = NULL;
@@ -183,9 +183,9 @@ int sys_pipe(int pipe_buf[2]){
     pipe_buf[1] = b;
     return 0;
 out_file1:
-    kfree(file1);
+    kmem_cache_free(file_cachep, file1);
 out_inode:
-    kfree(inode);
+    kmem_cache_free(inode_cachep, inode);
 out_pipe:
     kfree(pipe);
 out_fd:
@@ -43,7 +43,7 @@ static ramfs_node_t *ramfs_find_node(struct super_block *sb, uint64_t ino)
 
 static inode_t *ramfs_new_inode(super_block_t *sb, int mode)
 {
-    inode_t *inode = (inode_t *)kmalloc(sizeof(inode_t));
+    inode_t *inode = (inode_t *)kmem_cache_alloc(inode_cachep);
     if (!inode) return NULL;
     memset(inode, 0, sizeof(inode_t));
     inode->ino = (uint64_t)inode; // 简单用地址，或者使用 sb 分配的序号
@@ -214,7 +214,7 @@ static int ramfs_mkdir(inode_t *dir, dentry_t *dentry, int mode)
     return 0;
 
 fail_free_inode:
-    kfree(inode);
+    kmem_cache_free(inode_cachep, inode);
 fail_free_node:
     // 从超级块列表中移除并释放内部节点
     spin_lock(&sbi->lock);
@@ -180,6 +180,19 @@ void write_lock(rwlock_t *lock)
     }
 }
 
+/* 尝试获取写锁（非阻塞） */
+int write_trylock(rwlock_t *lock)
+{
+    int ret = 0;
+    spin_lock(&lock->lock);
+    if (!lock->writer && lock->readers == 0) {
+        lock->writer = 1;
+        ret = 1;
+    }
+    spin_unlock(&lock->lock);
+    return ret;
+}
+
 /* 释放写锁 */
 void write_unlock(rwlock_t *lock)
 {
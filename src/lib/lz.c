@@ -0,0 +1,152 @@
+#include "lib/lz.h"
+
+#define LZ_MIN_MATCH 4
+/// 最后这些字节总是作为字面量输出, 匹配不会延伸到这里
+#define LZ_LAST_LITERALS 5
+/// 匹配的起点至少离结尾这么远
+#define LZ_MF_LIMIT 12
+#define LZ_MAX_OFFSET 0xffffU
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/// @brief 写出15之后的扩展长度, 空间不够返回NULL
+static uint8_t *put_length(uint8_t *op, uint8_t *end, uint32_t n)
+{
+    while (n >= 255) {
+        if (op >= end)
+            return 0;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= end)
+        return 0;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+/// @brief 写出一个序列, mlen为0时是只有字面量的最后一个序列
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *lit, uint32_t nlit,
+                             uint32_t offset, uint32_t mlen)
+{
+    if (op >= end)
+        return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && !(op = put_length(op, end, nlit - 15)))
+        return 0;
+    if ((uint64_t)(end - op) < nlit)
+        return 0;
+    for (uint32_t i = 0; i < nlit; i++)
+        op[i] = lit[i];
+    op += nlit;
+    if (!mlen)
+        return op;
+    if (end - op < 2)
+        return 0;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && !(op = put_length(op, end, mlen - 15)))
+        return 0;
+    return op;
+}
+
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap, uint16_t *hash)
+{
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    uint8_t *end = op + cap;
+    uint32_t ip = 0;
+    uint32_t anchor = 0;
+    if (len > LZ_MAX_INPUT)
+        return 0;
+
+    if (len > LZ_MF_LIMIT) {
+        uint32_t limit = len - LZ_MF_LIMIT;
+        uint32_t match_end = len - LZ_LAST_LITERALS;
+        while (ip < limit) {
+            uint32_t seq = read32(in + ip);
+            uint32_t h = lz_hash(seq);
+            // 工作区不清零: 上次留下的位置只要在ip之前并且内容相同就是有效的匹配
+            uint32_t ref = hash[h];
+            hash[h] = (uint16_t)ip;
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+                ip++;
+                continue;
+            }
+            uint32_t mlen = LZ_MIN_MATCH;
+            while (ip + mlen < match_end && in[ref + mlen] == in[ip + mlen])
+                mlen++;
+            op = put_sequence(op, end, in + anchor, ip - anchor, ip - ref, mlen);
+            if (!op)
+                return 0;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    op = put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return (uint32_t)(op - (uint8_t *)dst);
+}
+
+/// @brief 读15之后的扩展长度, 越界返回-1
+static int get_length(const uint8_t *in, uint32_t len, uint32_t *ip, uint32_t *n)
+{
+    uint8_t b;
+    do {
+        if (*ip >= len)
+            return -1;
+        b = in[(*ip)++];
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    while (ip < len) {
+        uint8_t token = in[ip++];
+        uint32_t nlit = token >> 4;
+        if (nlit == 15 && get_length(in, len, &ip, &nlit))
+            return -1;
+        if (nlit > len - ip || nlit > cap - op)
+            return -1;
+        for (uint32_t i = 0; i < nlit; i++)
+            out[op + i] = in[ip + i];
+        ip += nlit;
+        op += nlit;
+        if (ip == len)
+            break;
+
+        if (len - ip < 2)
+            return -1;
+        uint32_t offset = in[ip] | ((uint32_t)in[ip + 1] << 8);
+        ip += 2;
+        if (!offset || offset > op)
+            return -1;
+        uint32_t mlen = token & 15;
+        if (mlen == 15 && get_length(in, len, &ip, &mlen))
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (mlen > cap - op)
+            return -1;
+        // 偏移可能小于长度, 必须逐字节复制
+        for (uint32_t i = 0; i < mlen; i++, op++)
+            out[op] = out[op - offset];
+    }
+    return (int)op;
+}
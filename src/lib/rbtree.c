@@ -0,0 +1,233 @@
+#include "lib/rbtree.h"
+
+static inline int is_red(rb_node_t *node)
+{
+    return node && node->color == RB_RED;
+}
+
+/// @brief 用new替换old在父节点(或者根)上的位置
+static inline void replace_child(rb_node_t *old, rb_node_t *new, rb_node_t *parent, rb_root_t *root)
+{
+    if (!parent)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rotate_left(rb_node_t *x, rb_root_t *root)
+{
+    rb_node_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(x, y, x->parent, root);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(rb_node_t *x, rb_root_t *root)
+{
+    rb_node_t *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(x, y, x->parent, root);
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert_color(rb_node_t *node, rb_root_t *root)
+{
+    rb_node_t *parent;
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        // 父节点是红的, 所以一定不是根, 祖父节点存在
+        rb_node_t *gparent = parent->parent;
+        if (parent == gparent->left) {
+            rb_node_t *uncle = gparent->right;
+            if (is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(gparent, root);
+        } else {
+            rb_node_t *uncle = gparent->left;
+            if (is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/// @brief 删除黑节点之后, 从node(可能为NULL)所在的位置向上修复, parent是它的父节点
+static void erase_color(rb_node_t *node, rb_node_t *parent, rb_root_t *root)
+{
+    while (node != root->node && !is_red(node)) {
+        if (node == parent->left) {
+            rb_node_t *sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(sibling, root);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(parent, root);
+            node = root->node;
+            break;
+        } else {
+            rb_node_t *sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (!is_red(sibling->left) && !is_red(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!is_red(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(sibling, root);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(parent, root);
+            node = root->node;
+            break;
+        }
+    }
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(rb_node_t *node, rb_root_t *root)
+{
+    rb_node_t *child;
+    rb_node_t *parent;
+    int color;
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+        if (child)
+            child->parent = parent;
+        replace_child(node, child, parent, root);
+    } else {
+        // 两个孩子: 用后继节点顶替node的位置, 实际摘掉的是后继原来的位置
+        rb_node_t *succ = node->right;
+        while (succ->left)
+            succ = succ->left;
+        child = succ->right;
+        color = succ->color;
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->color = node->color;
+        replace_child(node, succ, node->parent, root);
+    }
+    if (color == RB_BLACK)
+        erase_color(child, parent, root);
+}
+
+rb_node_t *rb_first(rb_root_t *root)
+{
+    rb_node_t *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node_t *rb_last(rb_root_t *root)
+{
+    rb_node_t *node = root->node;
+    if (!node)
+        return NULL;
+    while (node->right)
+        node = node->right;
+    return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    rb_node_t *parent;
+    while ((parent = node->parent) && node == parent->right)
+        node = parent;
+    return parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node)
+{
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return node;
+    }
+    rb_node_t *parent;
+    while ((parent = node->parent) && node == parent->left)
+        node = parent;
+    return parent;
+}
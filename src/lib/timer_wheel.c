@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include "const.h"
+#include "lib/timer.h"
+#include "lib/io.h"
+#include "mm/mm.h"
+#include "view/view.h"
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now)
+{
+    spin_lock_init(&wheel->lock);
+    wheel->clk = now;
+    wheel->nr_timers = 0;
+    for (uint32_t i = 0; i < TVR_SIZE; i++)
+        INIT_LIST_HEAD(&wheel->tv1[i]);
+    for (uint32_t l = 0; l < TVN_LEVELS; l++)
+        for (uint32_t i = 0; i < TVN_SIZE; i++)
+            INIT_LIST_HEAD(&wheel->tvn[l][i]);
+}
+
+/// @brief 按到期时间离clk的距离选级, 按到期时间本身选槽
+static list_head_t *wheel_slot(timer_wheel_t *wheel, uint64_t expires)
+{
+    uint64_t idx = expires - wheel->clk;
+    // 已经过期的放在马上要处理的槽里
+    if ((int64_t)idx < 0)
+        return &wheel->tv1[wheel->clk & TVR_MASK];
+    if (idx < TVR_SIZE)
+        return &wheel->tv1[expires & TVR_MASK];
+    for (uint32_t l = 0; l < TVN_LEVELS; l++) {
+        uint32_t shift = TVR_BITS + l * TVN_BITS;
+        if (idx < (1ULL << (shift + TVN_BITS)))
+            return &wheel->tvn[l][(expires >> shift) & TVN_MASK];
+    }
+    // 超出范围: 放在最后一级最晚转到的槽
+    uint32_t shift = TVR_BITS + (TVN_LEVELS - 1) * TVN_BITS;
+    expires = wheel->clk + (1ULL << (shift + TVN_BITS)) - 1;
+    return &wheel->tvn[TVN_LEVELS - 1][(expires >> shift) & TVN_MASK];
+}
+
+void timer_wheel_add(timer_wheel_t *wheel, timer_t *timer)
+{
+    list_add_tail(&timer->list_item, wheel_slot(wheel, timer->ticks));
+    wheel->nr_timers++;
+}
+
+/// @brief 取消还没有到期的定时器, 已经取走的不做处理
+void timer_wheel_del(timer_wheel_t *wheel, timer_t *timer)
+{
+    if (list_empty(&timer->list_item))
+        return;
+    list_del_init(&timer->list_item);
+    wheel->nr_timers--;
+}
+
+/// @brief 把第level+1级的idx槽重新分配到低级, 返回idx, 为0时上一级也转了一个槽
+static uint32_t cascade(timer_wheel_t *wheel, uint32_t level, uint32_t idx)
+{
+    list_head_t tmp;
+    INIT_LIST_HEAD(&tmp);
+    list_splice_init(&wheel->tvn[level][idx], &tmp);
+    while (!list_empty(&tmp)) {
+        timer_t *timer = list_first_entry(&tmp, timer_t, list_item);
+        list_del(&timer->list_item);
+        list_add_tail(&timer->list_item, wheel_slot(wheel, timer->ticks));
+    }
+    return idx;
+}
+
+/**
+ * @brief 推进到now(含), 到期的定时器移到expired上
+ * @note 没有定时器时直接跳到now之后, 停时钟很久之后醒来也不用一格一格地转
+ */
+void timer_wheel_run(timer_wheel_t *wheel, uint64_t now, list_head_t *expired)
+{
+    while ((int64_t)(now - wheel->clk) >= 0) {
+        if (!wheel->nr_timers) {
+            wheel->clk = now + 1;
+            break;
+        }
+        uint32_t idx = wheel->clk & TVR_MASK;
+        if (!idx) {
+            for (uint32_t l = 0; l < TVN_LEVELS; l++) {
+                uint32_t shift = TVR_BITS + l * TVN_BITS;
+                if (cascade(wheel, l, (wheel->clk >> shift) & TVN_MASK))
+                    break;
+            }
+        }
+        list_head_t *slot = &wheel->tv1[idx];
+        while (!list_empty(slot)) {
+            timer_t *timer = list_first_entry(slot, timer_t, list_item);
+            list_move_tail(&timer->list_item, expired);
+            wheel->nr_timers--;
+        }
+        wheel->clk++;
+    }
+}
+
+/**
+ * @brief 下一次需要处理时间轮的tick, 不晚于limit
+ * @note 第一级的槽是精确的; 高级的槽取它重新分配的时刻, 可能比其中定时器的到期时间早,
+ * 停时钟时早醒一次不影响正确性
+ */
+uint64_t timer_wheel_next(timer_wheel_t *wheel, uint64_t limit)
+{
+    uint64_t next = limit;
+    if (!wheel->nr_timers)
+        return next;
+    for (uint32_t k = 0; k < TVR_SIZE; k++) {
+        uint64_t t = wheel->clk + k;
+        if (t >= next)
+            break;
+        if (!list_empty(&wheel->tv1[t & TVR_MASK])) {
+            next = t;
+            break;
+        }
+    }
+    for (uint32_t l = 0; l < TVN_LEVELS; l++) {
+        uint32_t shift = TVR_BITS + l * TVN_BITS;
+        uint64_t block = (wheel->clk + (1ULL << shift) - 1) >> shift;
+        for (uint32_t m = 0; m < TVN_SIZE; m++, block++) {
+            uint64_t t = block << shift;
+            if (t >= next)
+                break;
+            if (!list_empty(&wheel->tvn[l][block & TVN_MASK])) {
+                next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+#define BENCH_ARMED 10000
+#define BENCH_OPS 1000
+
+static uint64_t bench_seed;
+
+static uint64_t bench_rand(void)
+{
+    bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return bench_seed >> 33;
+}
+
+/// @brief 原来按到期时间排序的链表插入, 只用于对比
+static void bench_sorted_insert(list_head_t *head, timer_t *timer)
+{
+    list_head_t *target = head->prev;
+    list_head_t *pos;
+    list_for_each(pos, head) {
+        timer_t *tmp = container_of(pos, timer_t, list_item);
+        if (tmp->ticks > timer->ticks) {
+            target = tmp->list_item.prev;
+            break;
+        }
+    }
+    list_add(&timer->list_item, target);
+}
+
+/**
+ * @brief 启动参数timerbench: 已有10000个定时器时插入/取消的平均周期数
+ * @note 到期时间在5分钟内随机分布, 同时给出排序链表插入的开销作对比
+ */
+void timer_wheel_bench(void)
+{
+    timer_wheel_t *wheel = kmalloc(sizeof(timer_wheel_t));
+    timer_t *timers = kmalloc(sizeof(timer_t) * (BENCH_ARMED + BENCH_OPS));
+    if (!wheel || !timers) {
+        wb_printf("[ TIMER ] bench: out of memory\n");
+        goto out;
+    }
+    uint64_t range = 300UL * CLOCK_FREQ;
+    uint8_t intr = io_cli();
+
+    bench_seed = 1;
+    timer_wheel_init(wheel, 0);
+    for (uint32_t i = 0; i < BENCH_ARMED + BENCH_OPS; i++) {
+        timers[i].ticks = 1 + bench_rand() % range;
+        INIT_LIST_HEAD(&timers[i].list_item);
+    }
+    for (uint32_t i = 0; i < BENCH_ARMED; i++)
+        timer_wheel_add(wheel, &timers[i]);
+    uint64_t start = rdtsc();
+    for (uint32_t i = BENCH_ARMED; i < BENCH_ARMED + BENCH_OPS; i++)
+        timer_wheel_add(wheel, &timers[i]);
+    uint64_t wheel_add = (rdtsc() - start) / BENCH_OPS;
+    start = rdtsc();
+    for (uint32_t i = BENCH_ARMED; i < BENCH_ARMED + BENCH_OPS; i++)
+        timer_wheel_del(wheel, &timers[i]);
+    uint64_t wheel_del = (rdtsc() - start) / BENCH_OPS;
+
+    list_head_t sorted;
+    INIT_LIST_HEAD(&sorted);
+    for (uint32_t i = 0; i < BENCH_ARMED; i++)
+        bench_sorted_insert(&sorted, &timers[i]);
+    start = rdtsc();
+    for (uint32_t i = BENCH_ARMED; i < BENCH_ARMED + BENCH_OPS; i++)
+        bench_sorted_insert(&sorted, &timers[i]);
+    uint64_t list_add_cost = (rdtsc() - start) / BENCH_OPS;
+
+    io_set_intr(intr);
+    wb_printf("[ TIMER ] %d armed: wheel insert %lu cycles, cancel %lu cycles; sorted list insert %lu cycles\n",
+              BENCH_ARMED, wheel_add, wheel_del, list_add_cost);
+out:
+    if (timers)
+        kfree(timers);
+    if (wheel)
+        kfree(wheel);
+}
@@ -5,9 +5,11 @@
 #include "view/view.h"
 #include "machine/cpu.h"
 #include "mm/mm.h"
+#include "mm/numa.h"
 #include "lib/string.h"
 
 GLOBAL_CPU* cpus;
+extern MM_MANAGER mm;
 // ACPI相关结构
 struct rsdp_descriptor {
     char signature[8];
@@ -65,9 +67,68 @@ struct madt_local_apic {
     uint32_t flags;         // 第0位：启用标志
 } __attribute__((packed));
 
+struct srat {
+    struct acpi_sdt_header header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    // 后面跟着一系列亲和结构
+} __attribute__((packed));
+
+// 处理器Local APIC亲和结构（类型0）
+struct srat_cpu_affinity {
+    uint8_t type;           // 0x00
+    uint8_t length;         // 16
+    uint8_t proximity_lo;
+    uint8_t apic_id;
+    uint32_t flags;         // 第0位：启用标志
+    uint8_t sapic_eid;
+    uint8_t proximity_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+// 内存亲和结构（类型1）
+struct srat_mem_affinity {
+    uint8_t type;           // 0x01
+    uint8_t length;         // 40
+    uint32_t proximity;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;         // 第0位：启用标志
+    uint64_t reserved3;
+} __attribute__((packed));
+
+// 处理器x2APIC亲和结构（类型2）
+struct srat_x2apic_affinity {
+    uint8_t type;           // 0x02
+    uint8_t length;         // 24
+    uint16_t reserved1;
+    uint32_t proximity;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+struct slit {
+    struct acpi_sdt_header header;
+    uint64_t localities;
+    uint8_t entry[];        // localities * localities的距离矩阵
+} __attribute__((packed));
+
 struct madt *madt;
 struct rsdp_descriptor *rsdp;
 
+/* SRAT解析出的邻近域(下标为节点号)和CPU所在的节点 */
+static uint32_t numa_domains[MAX_NUMA_NODES];
+static uint32_t numa_nr_domains;
+static struct {
+    uint32_t apic_id;
+    uint32_t node;
+} numa_cpus[MAX_CPU_NUM];
+static uint32_t numa_nr_cpus;
+
 // 验证ACPI表校验和
 static bool validate_checksum(void *table, size_t length) {
     uint8_t sum = 0;
@@ -105,8 +166,8 @@ static struct rsdp_descriptor *find_rsdp(void) {
     return NULL;
 }
 
-// 查找MADT表
-static struct madt *find_madt(void) {
+// 在RSDT中按签名查找表
+static struct acpi_sdt_header *find_table(const char *signature) {
     if (!rsdp) {
         return NULL;
     }
@@ -121,21 +182,25 @@ static struct madt *find_madt(void) {
     uint32_t entry_count = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
     uint32_t *entries = (uint32_t *)((uintptr_t)rsdt + sizeof(struct acpi_sdt_header));
     
-    // 查找APIC表
     for (uint32_t i = 0; i < entry_count; i++) {
         struct acpi_sdt_header *header = easy_phy2linear(entries[i]);
         
-        if (header->signature[0] == 'A' && header->signature[1] == 'P' &&
-            header->signature[2] == 'I' && header->signature[3] == 'C') {
+        if (header->signature[0] == signature[0] && header->signature[1] == signature[1] &&
+            header->signature[2] == signature[2] && header->signature[3] == signature[3]) {
             
             if (validate_checksum(header, header->length)) {
-                return (struct madt *)header;
+                return header;
             }
         }
     }
     return NULL;
 }
 
+// 查找MADT表
+static struct madt *find_madt(void) {
+    return (struct madt *)find_table("APIC");
+}
+
 extern uint64_t hpet_base;
 // 查找HPET表
 static void init_hpet_from_acpi(void) {
@@ -165,6 +230,99 @@ static void init_hpet_from_acpi(void) {
     wb_printf("[  HPET ] No HPET table found, fallback to 8254\n");
 }
 
+// 邻近域按出现顺序编成节点号, 超出MAX_NUMA_NODES的并入节点0
+static uint32_t numa_domain_node(uint32_t domain) {
+    for (uint32_t i = 0; i < numa_nr_domains; i++) {
+        if (numa_domains[i] == domain)
+            return i;
+    }
+    if (numa_nr_domains == MAX_NUMA_NODES)
+        return 0;
+    numa_domains[numa_nr_domains] = domain;
+    return numa_nr_domains++;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t domain) {
+    if (numa_nr_cpus == MAX_CPU_NUM)
+        return;
+    numa_cpus[numa_nr_cpus].apic_id = apic_id;
+    numa_cpus[numa_nr_cpus].node = numa_domain_node(domain);
+    numa_nr_cpus++;
+}
+
+static void parse_srat(struct srat *srat, NUMA_INFO *info) {
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+    uint8_t *entry = (uint8_t *)srat + sizeof(struct srat);
+    
+    while (entry + 2 <= end) {
+        uint8_t type = entry[0];
+        uint8_t length = entry[1];
+        if (length == 0 || entry + length > end)
+            break;
+        
+        if (type == 0x00 && length >= sizeof(struct srat_cpu_affinity)) {
+            struct srat_cpu_affinity *cpu = (struct srat_cpu_affinity *)entry;
+            if (cpu->flags & 1) {
+                uint32_t domain = cpu->proximity_lo | (cpu->proximity_hi[0] << 8) |
+                                  (cpu->proximity_hi[1] << 16) | ((uint32_t)cpu->proximity_hi[2] << 24);
+                numa_add_cpu(cpu->apic_id, domain);
+            }
+        } else if (type == 0x01 && length >= sizeof(struct srat_mem_affinity)) {
+            struct srat_mem_affinity *mem = (struct srat_mem_affinity *)entry;
+            if ((mem->flags & 1) && mem->length_bytes && info->nr_ranges < NUMA_MAX_RANGES) {
+                NUMA_MEM_RANGE *range = &info->ranges[info->nr_ranges++];
+                range->start = mem->base;
+                range->end = mem->base + mem->length_bytes;
+                range->node = numa_domain_node(mem->proximity);
+            }
+        } else if (type == 0x02 && length >= sizeof(struct srat_x2apic_affinity)) {
+            struct srat_x2apic_affinity *cpu = (struct srat_x2apic_affinity *)entry;
+            if (cpu->flags & 1)
+                numa_add_cpu(cpu->x2apic_id, cpu->proximity);
+        }
+        entry += length;
+    }
+}
+
+// SLIT按邻近域编号索引, 没有SLIT或者缺项时按本地/远端的默认距离
+static void parse_slit(struct slit *slit, NUMA_INFO *info) {
+    for (uint32_t i = 0; i < info->nr_nodes; i++) {
+        for (uint32_t j = 0; j < info->nr_nodes; j++) {
+            info->distance[i][j] = i == j ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+            if (!slit)
+                continue;
+            uint64_t n = slit->localities;
+            if (numa_domains[i] >= n || numa_domains[j] >= n)
+                continue;
+            if (sizeof(struct slit) + n * n > slit->header.length)
+                continue;
+            info->distance[i][j] = slit->entry[numa_domains[i] * n + numa_domains[j]];
+        }
+    }
+}
+
+/**
+ * @brief 解析SRAT和SLIT, 在init_mm里调用, 早于init_acpi_madt
+ * @note 没有SRAT时nr_nodes为0, 所有内存和CPU都算节点0
+ */
+void acpi_numa_init(NUMA_INFO *info) {
+    rsdp = find_rsdp();
+    struct srat *srat = (struct srat *)find_table("SRAT");
+    if (!srat)
+        return;
+    parse_srat(srat, info);
+    info->nr_nodes = numa_nr_domains;
+    parse_slit((struct slit *)find_table("SLIT"), info);
+}
+
+uint32_t acpi_cpu_node(uint32_t apic_id) {
+    for (uint32_t i = 0; i < numa_nr_cpus; i++) {
+        if (numa_cpus[i].apic_id == apic_id)
+            return numa_cpus[i].node;
+    }
+    return 0;
+}
+
 // 通过MADT统计处理器
 static void alloc_logic_cpu_id(void) {
     // 遍历MADT中的条目
@@ -221,7 +379,12 @@ void init_acpi_madt(void){
     // 如果需要在更多核数的情况下快速查找,应当对physic_apic_id排序
     for (size_t i = 0; i < cpus->total_num; i++)
     {
-        wb_printf("[  CPU  ] alloc logic id %d for cpu apic %#x\n",i,cpus->physic_apic_id[i]);
+        cpus->items[i].node = mm.nr_nodes > 1 ? acpi_cpu_node(cpus->physic_apic_id[i]) : 0;
+        wb_printf("[  CPU  ] alloc logic id %d for cpu apic %#x node %d\n",i,cpus->physic_apic_id[i],cpus->items[i].node);
+    }
+    for (uint32_t i = 0; i < mm.nr_nodes && mm.nr_nodes > 1; i++)
+    {
+        wb_printf("[  NUMA ] node %d: %ld pages, %ld free\n",i,mm.node[i].total_pages,mm.node[i].free_pages);
     }
     wb_printf("[  CPU  ] %d CPUs in total\n",cpus->total_num);
     init_hpet_from_acpi();
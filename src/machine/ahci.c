@@ -7,6 +7,7 @@
 #include "fs/block.h"
 #include "view/view.h"
 #include "mm/mm.h"
+#include "mm/slab.h"
 #include "lib/string.h"
 
 static int check_type(hba_port_t *port);
@@ -18,6 +19,7 @@ int find_cmdslot(hba_port_t *port);
 uint64_t ahci_device_uid(ahci_identify_t *data);
 static void ahci_register_block_device(ahci_device_t *adev);
 static ahci_manager_t ahci_mgr;
+static kmem_cache_t *ahci_req_cachep;
 extern uint64_t *vir_ptable4;
 
 static void ahci_register_device(hba_mem_t *hba, int port_no)
@@ -102,11 +104,17 @@ void ahci_kernel_thread(void) {
                 ahci_request_t *req = container_of(first, ahci_request_t, list);
                 dev->active[s] = req;
                 req->slot = s;
-                ahci_send(
+                if (ahci_send(
                     dev->port, req->lba, req->count, req->buffer,
                     req->write ? COMMAND_WRITE_LBA48 : COMMAND_READ_LBA48,
                     s, req->cr3
-                );
+                ) < 0) {
+                    // 缓冲区的页不在内存或者端口忙, 直接结束请求
+                    dev->active[s] = NULL;
+                    req->finished = 1;
+                    req->status = -1;
+                    wake_up_all(&req->wq);
+                }
             }
             spin_unlock(&dev->lock);
         }
@@ -115,7 +123,10 @@ void ahci_kernel_thread(void) {
 }
 
 int ahci_submit(ahci_device_t *dev, uint64_t lba, uint32_t count, void *buf, int write) {
-    ahci_request_t *req = kmalloc(sizeof(*req));
+    // 请求由内核线程发出, 用户缓冲区的页要在这里先补上
+    if (prefault_user_range(buf, (uint64_t)count << 9))
+        return -1;
+    ahci_request_t *req = kmem_cache_alloc(ahci_req_cachep);
     if (!req) return -1;
     memset(req, 0, sizeof(*req));
 
@@ -136,7 +147,7 @@ int ahci_submit(ahci_device_t *dev, uint64_t lba, uint32_t count, void *buf, int
     sleep_on_locked(&req->wq);
 
     int status = req->status;
-    kfree(req);
+    kmem_cache_free(ahci_req_cachep, req);
     return status;
 }
 
@@ -257,6 +268,8 @@ int ahci_send(hba_port_t *port, uint64_t lba48, uint32_t count, void *buf, char
     for (i = 0; i < cmdheader->prdtl - 1; i++)
     {
         tmp_addr = mem_linear2phy_get(addr, pml4_vir);
+        if (!tmp_addr)
+            return -1;
         cmdtbl->prdt_entry[i].dba = (uint32_t)tmp_addr;
         cmdtbl->prdt_entry[i].dbau = (uint32_t)(tmp_addr >> 32);
         // 8K bytes (this value should always be set to 1 less than the actual value)
@@ -267,6 +280,8 @@ int ahci_send(hba_port_t *port, uint64_t lba48, uint32_t count, void *buf, char
     }
     // Last entry
     tmp_addr = mem_linear2phy_get(addr, pml4_vir);
+    if (!tmp_addr)
+        return -1;
     cmdtbl->prdt_entry[i].dba = (uint32_t)tmp_addr;
     cmdtbl->prdt_entry[i].dbau = (uint32_t)(tmp_addr >> 32);
     // 512 bytes per sector
@@ -353,6 +368,7 @@ uint64_t ahci_device_uid(ahci_identify_t *data)
 void init_ahci_mem(void)
 {
     memset(&ahci_mgr, 0, sizeof(ahci_mgr));
+    ahci_req_cachep = kmem_cache_create("ahci_request", sizeof(ahci_request_t), 8, NULL);
 }
 
 static int ahci_block_read(block_device_t *bdev,uint64_t lba,uint32_t count,void *buffer)
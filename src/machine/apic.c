@@ -9,6 +9,8 @@
 extern GLOBAL_CPU *cpus;
 
 volatile uint32_t* LocalAPIC;
+
+void hpet_udelay(uint64_t us);
 IO_APIC IoAPIC;
 
 void make_idt_descriptor(uint64_t* idt_table, uint32_t n, uint64_t addr, uint64_t ist, uint64_t dpl, uint64_t type);
@@ -133,6 +135,34 @@ static inline uint64_t read_io_apic(uint64_t Register)
     return *IoAPIC.Data;
 }
 
+/**
+ * @brief 用HPET测量Local APIC定时器16分频后的频率
+ * @return 每秒的计数, 测不出来时返回0
+ */
+uint64_t lapic_timer_calibrate(void)
+{
+    LocalAPIC[FrequencyDivision] = TIMER_DIVIDE_16;
+    LocalAPIC[LVTTimer] = LVT_MASKED | TIMER_MODE_ONESHOT | INTERRUPT_VECTOR_LAPIC_TIMER;
+    LocalAPIC[InitialCounter] = 0xffffffff;
+    hpet_udelay(10000);
+    uint32_t left = LocalAPIC[NowCounter];
+    LocalAPIC[InitialCounter] = 0;
+    return (uint64_t)(0xffffffff - left) * 100;
+}
+
+/// @brief 本CPU的定时器设为单次模式, 之后由lapic_timer_arm逐次编程
+void lapic_timer_start(void)
+{
+    LocalAPIC[FrequencyDivision] = TIMER_DIVIDE_16;
+    LocalAPIC[LVTTimer] = TIMER_MODE_ONESHOT | INTERRUPT_VECTOR_LAPIC_TIMER;
+}
+
+/// @brief count个计数之后产生一次定时器中断, 写初始计数会取消上一次的编程
+void lapic_timer_arm(uint32_t count)
+{
+    LocalAPIC[InitialCounter] = count ? count : 1;
+}
+
 uint32_t get_apic_id()
 {
     return (LocalAPIC[LocalAPICId] >> 24); /// 这是APIC
@@ -144,6 +174,14 @@ static void lapic_wait_icr(void)
         __asm__ volatile("pause");
 }
 
+/// @brief 向一个CPU发送Fixed模式的IPI, 调用时需关中断
+void send_ipi(uint32_t apic_id, uint8_t vector)
+{
+    lapic_wait_icr();
+    LocalAPIC[ICRbit63to32] = apic_id << 24;
+    LocalAPIC[ICRbit31to0] = 0x4000 | vector;
+}
+
 static void broadcast_ipi_init(void)
 {
     LocalAPIC[ICRbit63to32] = 0;
@@ -13,6 +13,7 @@
 extern uint64_t *vir_ptable4;
 
 static list_head_t ehci_controllers = LIST_HEAD_INIT(ehci_controllers);
+static kmem_cache_t *ehci_req_cachep;
 
 static int ehci_submit_control_request(struct ehci_controller *hc, struct ehci_device *dev,uint8_t *setup, void *data, int len, int dir);
 static int ehci_submit_scsi_command(struct ehci_device *dev, uint8_t *cdb, int cdb_len,void *data, int data_len, int dir,ehci_request_t **tmp);
@@ -138,7 +139,7 @@ static int ehci_hw_init(struct ehci_controller *hc) {
     ehci_write32(hc, op_base + EHCI_USBSTS, 0xFFFFFFFF);
 
     ehci_write32(hc, op_base + EHCI_CONFIGFLAG, 0);
-    mdelay(1);
+    msleep(1);
 
     // 1. 复位主机控制器
     cmd = ehci_read32(hc,op_base + EHCI_USBCMD);
@@ -148,7 +149,7 @@ static int ehci_hw_init(struct ehci_controller *hc) {
     // 等待复位完成（HCRESET 位自动清零）
     timeout = 10000;
     while ((ehci_read32(hc,op_base + EHCI_USBCMD) & EHCI_CMD_HCRESET) && timeout--) {
-        mdelay(1);
+        msleep(1);
     }
     if (timeout <= 0) {
         // 复位超时
@@ -156,7 +157,7 @@ static int ehci_hw_init(struct ehci_controller *hc) {
     }
 
     // 复位后需要延迟（规范建议至少 10ms）
-    mdelay(10);
+    msleep(10);
 
     ehci_write32(hc, hc->cap_length + EHCI_CTRLDSSEGMENT, 0);
 
@@ -181,7 +182,7 @@ static int ehci_hw_init(struct ehci_controller *hc) {
         if (status & (EHCI_STS_HALTED | EHCI_STS_SYSERR)){
             halt();
         }
-        mdelay(1);
+        msleep(1);
     }
     if (timeout <= 0) {
         // 启动失败
@@ -201,6 +202,10 @@ static int ehci_hw_init(struct ehci_controller *hc) {
 }
 
 int init_ehci_controller(uint8_t bus, uint8_t dev, uint8_t func) {
+    if (!ehci_req_cachep) {
+        ehci_req_cachep = kmem_cache_create("ehci_request", sizeof(ehci_request_t), 8, NULL);
+        if (!ehci_req_cachep) return -1;
+    }
     struct ehci_controller *hc = ehci_alloc_controller(bus, dev, func);
     if (!hc) return -1;
 
@@ -229,7 +234,7 @@ static int ehci_port_reset(struct ehci_controller *hc, int port) {
 
     portsc |= EHCI_PORTSC_PR;
     ehci_write32(hc, portsc_addr, portsc);
-    mdelay(50);
+    msleep(50);
     portsc &= ~EHCI_PORTSC_PR;
     ehci_write32(hc, portsc_addr, portsc);
 
@@ -242,7 +247,7 @@ static int ehci_port_reset(struct ehci_controller *hc, int port) {
         if (portsc & EHCI_PORTSC_CSC) {
             break;
         }
-        mdelay(1);
+        msleep(1);
     }
 
     return -1;
@@ -382,7 +387,7 @@ static struct ehci_device *ehci_enumerate_device(struct ehci_controller *hc, int
         hc->next_addr--;
         return NULL;
     }
-    mdelay(2);                              // 等待地址生效
+    msleep(2);                              // 等待地址生效
 
     wb_printf("create qh\n");
     // 5. 为设备创建控制端点 QH（使用新地址，端点0，最大包长）
@@ -613,7 +618,7 @@ void ehci_initial_scan(void) {
 }
 
 static int ehci_submit_control_request(struct ehci_controller *hc, struct ehci_device *dev,uint8_t *setup, void *data, int len, int dir) {
-    ehci_request_t *req = kmalloc(sizeof(ehci_request_t));
+    ehci_request_t *req = kmem_cache_alloc(ehci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(ehci_request_t));
@@ -635,7 +640,7 @@ static int ehci_submit_control_request(struct ehci_controller *hc, struct ehci_d
         req->qh = dev->qh_control;
     }
     if (!req->qh) {
-        kfree(req);
+        kmem_cache_free(ehci_req_cachep, req);
         return -1;
     }
 
@@ -649,13 +654,15 @@ static int ehci_submit_control_request(struct ehci_controller *hc, struct ehci_d
     sleep_on_locked(&req->wq);
 
     int status = req->status;
-    kfree(req);
+    kmem_cache_free(ehci_req_cachep, req);
     return status;
 }
 
 static int ehci_submit_scsi_command(struct ehci_device *dev, uint8_t *cdb, int cdb_len,void *data, int data_len, int dir,ehci_request_t **tmp) {
     struct ehci_controller *hc = dev->hc;
-    ehci_request_t *req = kmalloc(sizeof(ehci_request_t));
+    if (data && prefault_user_range(data, data_len))
+        return -1;
+    ehci_request_t *req = kmem_cache_alloc(ehci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(ehci_request_t));
@@ -702,13 +709,16 @@ static int ehci_submit_scsi_command(struct ehci_device *dev, uint8_t *cdb, int c
     if (tmp)
         *tmp = req;               // 返回请求指针，由调用者负责释放
     else
-        kfree(req);
+        kmem_cache_free(ehci_req_cachep, req);
     return status;
 }
 
 static int ehci_submit_rw_request(struct ehci_device *dev, int write, uint64_t lba, uint32_t count, void *buffer) {
     struct ehci_controller *hc = dev->hc;
-    ehci_request_t *req = kmalloc(sizeof(ehci_request_t));
+    // 请求由内核线程构建, 用户缓冲区的页要在这里先补上
+    if (prefault_user_range(buffer, (uint64_t)count << 9))
+        return -1;
+    ehci_request_t *req = kmem_cache_alloc(ehci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(ehci_request_t));
@@ -781,7 +791,7 @@ static int ehci_submit_rw_request(struct ehci_device *dev, int write, uint64_t l
     sleep_on_locked(&req->wq);
 
     int status = req->status;
-    kfree(req);
+    kmem_cache_free(ehci_req_cachep, req);
     return status;
 }
 
@@ -931,6 +941,10 @@ static int ehci_build_request(ehci_request_t *req) {
             qtd_data->token = EHCI_BUILD_TOKEN(chunk, 0, toggle, pid, 3);
             // 当前数据块的物理地址（假设缓冲区在一个物理页内，若跨页需扩展 buffer[1..4]）
             uint64_t data_pa = mem_linear2phy_get(data_va, req->bulk.cr3);
+            if (!data_pa) {
+                req->qtd_head = qtd_cbw;                    // 由调用者的失败路径释放
+                return -1;
+            }
             clflush_range(easy_phy2linear(data_pa), chunk);
             qtd_data->buffer[0] = (uint32_t)data_pa;
             qtd_data->next_qtd = qtd_data->alt_next_qtd = EHCI_PTR_TERM;                    // 先设终止，后续链接
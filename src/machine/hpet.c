@@ -36,6 +36,8 @@
 
 uint64_t hpet_base = 0;
 uint64_t hpet_frequency_hz;
+/// 主计数器每一计数的飞秒数, 初始化之前为0
+static uint64_t hpet_period_fs;
 
 // --- HPET 读写辅助函数 (假设内存映射) ---
 static inline uint64_t hpet_read(int reg) {
@@ -92,6 +94,7 @@ int init_hpet_timer(void) {
         period_fs = 69841279; // 对应 14.31818 MHz 的周期飞秒值：10^15 / 14318180 ≈ 69841
     }
     
+    hpet_period_fs = period_fs;
     // 计算 HPET 计数器频率（Hz）
     hpet_frequency_hz = 1000000000000000ULL / period_fs;  // 10^15 / period_fs
     
@@ -112,6 +115,16 @@ int init_hpet_timer(void) {
     return 0;
 }
 
+/// @brief 主计数器换算成纳秒, 给调度器记账用, HPET初始化之前返回0
+uint64_t hpet_read_ns(void)
+{
+    if (!hpet_period_fs)
+        return 0;
+    uint64_t cnt = hpet_read(HPET_MAIN_COUNTER);
+    // 分两段乘, 避免计数乘飞秒溢出
+    return cnt / 1000000 * hpet_period_fs + cnt % 1000000 * hpet_period_fs / 1000000;
+}
+
 void hpet_udelay(uint64_t us)
 {
     uint64_t start = hpet_read(HPET_MAIN_COUNTER);
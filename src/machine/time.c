@@ -2,9 +2,11 @@
 #include "const.h"
 #include "lib/timer.h"
 #include "machine/cpu.h"
+#include "machine/apic.h"
 #include "mm/mm.h"
 #include "lib/atomic.h"
 #include "view/view.h"
+#include "lib/io.h"
 
 extern GLOBAL_CPU *cpus;
 
@@ -15,19 +17,80 @@ extern void enable_irq(uint16_t irq);
 extern uint32_t get_logic_cpu_id(void);
 extern void schedule(void);
 extern int init_hpet_timer(void);
+extern uint64_t lapic_timer_calibrate(void);
+extern void lapic_timer_start(void);
+extern void lapic_timer_arm(uint32_t count);
+extern void send_ipi(uint32_t apic_id, uint8_t vector);
 
 static volatile uint64_t ticks;
 extern atomic_64_t unix_time;
 extern uint64_t hpet_base;
+extern uint64_t hpet_read_ns(void);
+extern MM_MANAGER mm;
+extern bool multi_core_start;
+extern bool cmdline_timerbench;
+
+/// 周期负载均衡的间隔(时钟中断数), 平时由空闲CPU偷任务完成均衡, 这里只是兜底
+#define LOAD_BALANCE_INTERVAL   1024
+/// 空闲CPU一次最多偷的任务数
+#define IDLE_STEAL_MAX          4
+/// 一个时钟周期的纳秒数
+#define TICK_NSEC               (1000000000UL / CLOCK_FREQ)
+/// 停掉时钟时最长多久醒一次(时钟中断数)
+#define NOHZ_MAX_TICKS          CLOCK_FREQ
+
+/**
+ * 时钟
+ * 有Local APIC定时器时, 每个CPU用单次模式自己编程下一次时钟中断:
+ * 有任务在排队时每个时钟周期一次; 空闲或者只有一个任务可运行时停掉周期时钟,
+ * 只在下一个定时器到期(忙时还有周期负载均衡)时醒来. 往停了时钟的CPU上放任务时
+ * 用INTERRUPT_VECTOR_RESCHEDULE把它叫醒.
+ * ticks与unix_time由HPET主计数器换算, 不依赖收到了多少次时钟中断, 停时钟期间也是准的.
+ * 测不出Local APIC定时器频率时退回HPET周期中断广播到所有CPU.
+ */
+
+/// 一个时钟周期对应的Local APIC定时器计数, 0表示使用HPET广播
+static uint64_t lapic_count_per_tick;
+static uint64_t tick_base_ns;
+/// 停了时钟的空闲CPU, 别的CPU有任务排队时叫醒其中一个来偷
+static volatile uint32_t nohz_idle_mask;
 
 void timer_intr_soft(void);
+void init_tick_cpu(void);
 static inline uint32_t local_timer_timeout(CPU_ITEM *cpu);
 static void add_timer(enum timer_type_enum timer_type,uint64_t first_ticks,uint32_t delta_ticks,pcb_t *task,uint32_t signal);
 static void load_balance(uint32_t id);
+static void hrtimer_run(CPU_ITEM *cpu);
+
+kmem_cache_t *timer_cachep;
+
+/// @brief 按HPET主计数器推进ticks与unix_time, 多个CPU同时调用时只有一个推进
+static void update_jiffies(void)
+{
+    uint64_t now = (hpet_read_ns() - tick_base_ns) / TICK_NSEC;
+    uint64_t old = ticks;
+    while (now > old) {
+        if (__sync_bool_compare_and_swap(&ticks, old, now)) {
+            uint64_t sec = now / CLOCK_FREQ - old / CLOCK_FREQ;
+            if (sec)
+                atomic_64_add(&unix_time, sec);
+            break;
+        }
+        old = ticks;
+    }
+}
+
+/// @brief 当前的ticks, 所有CPU都停着时钟时也是最新的
+static uint64_t get_ticks(void)
+{
+    update_jiffies();
+    return ticks;
+}
 
 void init_time(void)
 {
     ticks = 0;
+    timer_cachep = kmem_cache_create("timer", sizeof(timer_t), 8, NULL);
     if (!hpet_base){
         wb_printf("[ ERROR ] hpet not found!!\n");
         halt();
@@ -37,16 +100,175 @@ void init_time(void)
         halt();
     }
 
+    tick_base_ns = hpet_read_ns();
+    nohz_idle_mask = 0;
+
     for (uint32_t i = 0; i < cpus->total_num; i++)
     {
         CPU_ITEM* cpu = &cpus->items[i];
         cpu->time_intr_reenter = 0;
-        spin_list_init(&cpu->timer_list);
+        cpu->nr_steal = cpu->nr_balance = 0;
+        cpu->tick_stopped = false;
+        cpu->next_balance = LOAD_BALANCE_INTERVAL + i;
+        cpu->wheel = kmalloc(sizeof(timer_wheel_t));
+        if (!cpu->wheel){
+            wb_printf("[ ERROR ] no memory for timer wheel!!\n");
+            halt();
+        }
+        timer_wheel_init(cpu->wheel, 0);
+        spin_list_init(&cpu->hrtimers);
     }
     
     /* 设置AP核对中断的处理程序 */
     set_handler(2, (uint64_t)timer_intr_soft);
-    enable_irq(2);
+    lapic_count_per_tick = lapic_timer_calibrate() / CLOCK_FREQ;
+    if (lapic_count_per_tick)
+        wb_printf("[ TIME  ] local apic timer: %lu counts per tick, tickless\n", lapic_count_per_tick);
+    init_tick_cpu();
+    if (cmdline_timerbench)
+        timer_wheel_bench();
+}
+
+/**
+ * @brief 编程本CPU的Local APIC定时器, 不晚于最早的高精度定时器
+ * @param count 按tick算出的计数, 关中断调用
+ */
+static void cpu_timer_arm(CPU_ITEM *cpu, uint64_t count)
+{
+    spin_lock(&cpu->hrtimers.lock);
+    if (!list_empty(&cpu->hrtimers.list)) {
+        hrtimer_t *t = list_first_entry(&cpu->hrtimers.list, hrtimer_t, list_item);
+        int64_t ns = (int64_t)(t->expires - hpet_read_ns());
+        if (ns > (int64_t)(NOHZ_MAX_TICKS * TICK_NSEC))
+            ns = NOHZ_MAX_TICKS * TICK_NSEC;
+        uint64_t hr = ns > 0 ? (uint64_t)ns * lapic_count_per_tick / TICK_NSEC : 0;
+        if (hr < count)
+            count = hr;
+    }
+    spin_unlock(&cpu->hrtimers.lock);
+    if (count == 0)
+        count = 1;
+    lapic_timer_arm(count > 0xffffffff ? 0xffffffff : count);
+}
+
+/// @brief 启动本CPU的时钟, BSP在init_time中调用, AP在启动时调用
+void init_tick_cpu(void)
+{
+    if (!lapic_count_per_tick) {
+        enable_irq(2);
+        return;
+    }
+    lapic_timer_start();
+    lapic_timer_arm(lapic_count_per_tick);
+}
+
+/// @brief 本CPU下一次必须醒来的时刻(ticks): 最早的定时器, 忙时还有周期负载均衡
+static uint64_t tick_nohz_next(CPU_ITEM *cpu, uint64_t now)
+{
+    uint64_t next = now + NOHZ_MAX_TICKS;
+    spin_lock(&cpu->wheel->lock);
+    next = timer_wheel_next(cpu->wheel, next);
+    spin_unlock(&cpu->wheel->lock);
+    if (cpu->now_running != cpu->idle && cpu->next_balance < next)
+        next = cpu->next_balance;
+    return next;
+}
+
+/**
+ * @brief 编程本CPU的下一次时钟中断, 关中断调用
+ * @note 先置tick_stopped再检查就绪数, 和enqueue_task先加就绪数再检查tick_stopped配对,
+ * 两边之间都有全屏障, 不会出现任务放进来了却没有人叫醒这个CPU
+ */
+static void tick_rearm(CPU_ITEM *cpu)
+{
+    cpu->tick_stopped = true;
+    __sync_synchronize();
+    if (cpu->total_ready_num || cpu->need_resched) {
+        cpu->tick_stopped = false;
+        cpu_timer_arm(cpu, lapic_count_per_tick);
+        return;
+    }
+    uint64_t now = get_ticks();
+    uint64_t next = tick_nohz_next(cpu, now);
+    uint64_t delta = next > now ? next - now : 1;
+    cpu_timer_arm(cpu, delta * lapic_count_per_tick);
+}
+
+/// @brief Local APIC定时器中断
+void lapic_timer_intr(void)
+{
+    CPU_ITEM *cpu = &cpus->items[get_logic_cpu_id()];
+    update_jiffies();
+    hrtimer_run(cpu);
+    tick_rearm(cpu);
+    timer_intr_soft();
+}
+
+/// @brief 别的CPU放了任务进来, 恢复时钟; 空闲CPU从hlt中醒来后自己去调度
+void reschedule_intr(void)
+{
+    set_EOI();
+    cpu_timer_arm(&cpus->items[get_logic_cpu_id()], lapic_count_per_tick);
+}
+
+/**
+ * @brief 任务放进cpu的就绪树之后调用, 持有cpu->rq.lock
+ * @note cpu停着时钟就叫醒它; cpu忙且有任务排队时, 叫醒一个停了时钟的空闲CPU来偷, 优先同一节点的
+ */
+void sched_kick(CPU_ITEM *cpu)
+{
+    if (!lapic_count_per_tick)
+        return;
+    uint32_t id = cpu - cpus->items;
+    uint32_t self = get_logic_cpu_id();
+    __sync_synchronize();
+    if (cpu->tick_stopped) {
+        if (id == self)
+            cpu_timer_arm(cpu, lapic_count_per_tick);
+        else
+            send_ipi(cpus->physic_apic_id[id], INTERRUPT_VECTOR_RESCHEDULE);
+    }
+    if (cpu->now_running == cpu->idle || !cpu->total_ready_num)
+        return;
+    uint32_t mask = nohz_idle_mask & ~(1U << id);
+    if (!mask)
+        return;
+    uint32_t target = __builtin_ctz(mask);
+    for (uint32_t m = mask; m; m &= m - 1) {
+        uint32_t i = __builtin_ctz(m);
+        if (cpus->items[i].node == cpu->node) {
+            target = i;
+            break;
+        }
+    }
+    // 清掉位的CPU负责去偷, 避免一次排队叫醒所有空闲CPU
+    if (__sync_fetch_and_and(&nohz_idle_mask, ~(1U << target)) & (1U << target)) {
+        if (target == self)
+            return;
+        send_ipi(cpus->physic_apic_id[target], INTERRUPT_VECTOR_RESCHEDULE);
+    }
+}
+
+/**
+ * @brief 空闲循环中停掉时钟等待中断
+ * @note 醒来的原因可能是定时器, 外部中断或者别的CPU的叫醒, 返回后由空闲循环重新检查就绪队列
+ */
+void tick_nohz_idle(uint32_t id)
+{
+    CPU_ITEM *cpu = &cpus->items[id];
+    io_cli();
+    if (!lapic_count_per_tick) {
+        __asm__ __volatile__("sti; hlt");
+        return;
+    }
+    __sync_fetch_and_or(&nohz_idle_mask, 1U << id);
+    tick_rearm(cpu);
+    // sti的下一条指令执行完才响应中断, 检查就绪数之后放进来的任务一定会在hlt之后叫醒它
+    if (!cpu->total_ready_num)
+        __asm__ __volatile__("sti; hlt");
+    io_cli();
+    __sync_fetch_and_and(&nohz_idle_mask, ~(1U << id));
+    io_sti();
 }
 
 void timer_intr_soft(void){
@@ -54,8 +276,9 @@ void timer_intr_soft(void){
     uint32_t id = get_logic_cpu_id();
     CPU_ITEM *cpu = &cpus->items[id];
     set_EOI();
+    if (!lapic_count_per_tick)
+        hrtimer_run(cpu);
     pcb_t *current = cpu->now_running;
-    current->ticks--;
     if (cpu->time_intr_reenter){
         return;
     }
@@ -68,132 +291,167 @@ void timer_intr_soft(void){
         current->preempt_count = 0;
     }
 
-    /* 调度请求标志 */
-    bool need_schedule = true;
     /* step 1 处理本地时钟 */ 
     UNUSED uint32_t signal = local_timer_timeout(cpu);
-    /* step 2 分析负载均衡 */
-    if ((ticks + id) & 64){
+    /* step 2 分析负载均衡, 各CPU错开 */
+    if (ticks >= cpu->next_balance){
+        cpu->next_balance = ticks + LOAD_BALANCE_INTERVAL;
         load_balance(id);
     }
-    /* step 3 考虑是否需要调度 */
-    if (current->ticks > 0)
-        need_schedule = false;
     /* 这里保留作以后处理 */
     __asm__ __volatile__("sti");
     /* 下半段 */
     __asm__ __volatile__("cli");
     /* 结束段 */
     cpu->time_intr_reenter--;
-    if (need_schedule){
-        current->ticks = DEFUALT_TICKS;
+    /* step 3 给当前任务记账, 考虑是否需要调度 */
+    spin_lock(&cpu->rq.lock);
+    if (sched_tick(cpu)){
         if (current != cpu->idle){
             current->state = TASK_STATE_READY;
-            spin_lock(&cpu->ready_list.lock);
-            list_add_tail(&current->ready_list_item,&cpu->ready_list.list);
-            cpu->total_ready_num++;
-            __schedule_locked(0);
-        }else{
-            schedule();
+            enqueue_task(cpu, current, 0);
         }
+        __schedule_locked(0);
+    }else{
+        spin_unlock(&cpu->rq.lock);
     }
     /* 判断信号递送 */
 
 }
 
-static uint64_t j = 0;
+/// @brief HPET广播的时钟中断在BSP上的入口
 void timer_intr_soft_bsp(void){
-    ticks++;
-    j++;
-    if (j == CLOCK_FREQ){
-        j = 0;
-        atomic_64_inc(&unix_time);
-    }
+    update_jiffies();
     timer_intr_soft();
 }
 
-static void append_to_task_timer_list(spin_list_head_t *timer_list,timer_t *timer);
-static void append_to_cpu_timer_list(spin_list_head_t *timer_list,timer_t *timer);
-
 /**
  * @note 返回值的约定需要看include/lib/timer.h
  */
 static inline uint32_t local_timer_timeout(CPU_ITEM *cpu){
     uint32_t flags = 0;
-    spin_lock(&cpu->ready_list.lock);
-    spin_lock(&cpu->timer_list.lock);
-    while (!list_empty(&cpu->timer_list.list))
+    list_head_t expired;
+    INIT_LIST_HEAD(&expired);
+    spin_lock(&cpu->rq.lock);
+    spin_lock(&cpu->wheel->lock);
+    timer_wheel_run(cpu->wheel, ticks, &expired);
+    while (!list_empty(&expired))
     {
-        list_head_t *next_list_item = cpu->timer_list.list.next;
-        timer_t *timer = container_of(next_list_item,timer_t,list_item);
-        if (timer->ticks > ticks){
-            break;
-        }
-        list_del(next_list_item);
-        list_del(&timer->in_task_item);
+        timer_t *timer = list_first_entry(&expired,timer_t,list_item);
+        list_del_init(&timer->list_item);
         if (timer->timer_type == TIMER_TASK_PERIODIC){
             timer->task->signal |= timer->signal;
             timer->ticks += timer->delta_ticks;
-            append_to_cpu_timer_list(&cpu->timer_list,timer);
-            append_to_task_timer_list(&timer->task->timers,timer);
+            timer_wheel_add(cpu->wheel,timer);
         }else if (timer->timer_type == TIMER_TASK_SING)
         {
             timer->task->signal |= timer->signal;
-            kfree(timer);
+            list_del(&timer->in_task_item);
+            kmem_cache_free(timer_cachep, timer);
         }else if (timer->timer_type == TIMER_SYS_SING)
         {
             flags |= timer->signal;
-            kfree(timer);
+            kmem_cache_free(timer_cachep, timer);
         }else{
             flags |= timer->signal;
             timer->ticks += timer->delta_ticks;
-            append_to_cpu_timer_list(&cpu->timer_list,timer);
+            timer_wheel_add(cpu->wheel,timer);
         }
     }
-    spin_unlock(&cpu->ready_list.lock);
-    spin_unlock(&cpu->timer_list.lock);
+    spin_unlock(&cpu->rq.lock);
+    spin_unlock(&cpu->wheel->lock);
     return flags;
 }
 
-static void append_to_task_timer_list(spin_list_head_t *timer_list,timer_t *timer){
-    list_head_t *target = timer_list->list.prev;
-    list_head_t *pos;
-    list_for_each(pos,&timer_list->list){
-        timer_t *tmp = container_of(pos,timer_t,in_task_item);
-        if (tmp->ticks > timer->ticks){
-            target = tmp->in_task_item.prev;
-            break;
-        }
+UNUSED static void add_timer(enum timer_type_enum timer_type,uint64_t first_ticks,uint32_t delta_ticks,pcb_t *task,uint32_t signal){
+    timer_t *timer = kmem_cache_alloc(timer_cachep);
+    timer->timer_type = timer_type;
+    timer->ticks = first_ticks + get_ticks();
+    timer->delta_ticks = delta_ticks;
+    timer->task = task;
+    timer->signal = signal;
+    INIT_LIST_HEAD(&timer->list_item);
+    INIT_LIST_HEAD(&timer->in_task_item);
+    uint8_t intr = io_cli();
+    uint32_t id = get_logic_cpu_id();
+    CPU_ITEM *cpu = &cpus->items[id];
+    spin_lock(&cpu->wheel->lock);
+    if (timer_type == TIMER_TASK_PERIODIC || timer_type == TIMER_TASK_SING){
+        list_add_tail(&timer->in_task_item,&task->timers.list);
     }
-    list_add(&timer->in_task_item,target);
+    timer_wheel_add(cpu->wheel,timer);
+    spin_unlock(&cpu->wheel->lock);
+    /* 时钟停着时按新的定时器重新编程 */
+    if (cpu->tick_stopped && lapic_count_per_tick)
+        cpu_timer_arm(cpu, lapic_count_per_tick);
+    io_set_intr(intr);
 }
 
-static void append_to_cpu_timer_list(spin_list_head_t *timer_list,timer_t *timer){
-    list_head_t *target = timer_list->list.prev;
+/**
+ * @brief 把t按到期时刻插入本CPU的高精度定时器列表, 关中断调用
+ * @note 成为最早的一个时重新编程Local APIC定时器, 最多一个tick后还会按时钟重新编程
+ */
+static void hrtimer_start(CPU_ITEM *cpu, hrtimer_t *t)
+{
     list_head_t *pos;
-    list_for_each(pos,&timer_list->list){
-        timer_t *tmp = container_of(pos,timer_t,list_item);
-        if (tmp->ticks > timer->ticks){
-            target = tmp->list_item.prev;
+    t->pending = true;
+    spin_lock(&cpu->hrtimers.lock);
+    list_for_each(pos, &cpu->hrtimers.list) {
+        hrtimer_t *now = container_of(pos, hrtimer_t, list_item);
+        if ((int64_t)(t->expires - now->expires) < 0)
             break;
+    }
+    list_add_tail(&t->list_item, pos);
+    bool first = cpu->hrtimers.list.next == &t->list_item;
+    spin_unlock(&cpu->hrtimers.lock);
+    if (first && lapic_count_per_tick)
+        cpu_timer_arm(cpu, lapic_count_per_tick);
+}
+
+/// @brief 取下本CPU上到期的高精度定时器并唤醒等待者, 在时钟中断中调用
+static void hrtimer_run(CPU_ITEM *cpu)
+{
+    uint64_t now = hpet_read_ns();
+    while (1) {
+        spin_lock(&cpu->hrtimers.lock);
+        if (list_empty(&cpu->hrtimers.list)) {
+            spin_unlock(&cpu->hrtimers.lock);
+            return;
+        }
+        hrtimer_t *t = list_first_entry(&cpu->hrtimers.list, hrtimer_t, list_item);
+        if ((int64_t)(t->expires - now) > 0) {
+            spin_unlock(&cpu->hrtimers.lock);
+            return;
         }
+        list_del_init(&t->list_item);
+        spin_unlock(&cpu->hrtimers.lock);
+        t->pending = false;
+        // 这之后等待者随时可能返回, wake_up_all放开wq.lock后不能再碰t
+        wake_up_all(&t->wq);
     }
-    list_add(&timer->list_item,target);
 }
 
-UNUSED static void add_timer(enum timer_type_enum timer_type,uint64_t first_ticks,uint32_t delta_ticks,pcb_t *task,uint32_t signal){
-    timer_t *timer = kmalloc(sizeof(timer_t));
-    timer->timer_type = timer_type;
-    timer->ticks = first_ticks + ticks;
-    timer->delta_ticks = delta_ticks;
-    timer->task = task;
-    timer->signal = signal;
-    if (timer_type == TIMER_TASK_PERIODIC || timer_type == TIMER_TASK_SING){
-        append_to_task_timer_list(&task->timers,timer);
+/**
+ * @brief 当前任务睡到expires(hpet_read_ns时间)
+ * @note 定时器放在栈上, 只有本CPU的时钟中断会取下它, 从设置到睡下都关着中断.
+ * 醒来后重新拿一次wq.lock, 等唤醒者放开锁后才返回.
+ */
+void hrtimer_sleep_until(uint64_t expires)
+{
+    hrtimer_t t;
+    t.expires = expires;
+    INIT_LIST_HEAD(&t.list_item);
+    wait_queue_init(&t.wq);
+    uint8_t intr = io_cli();
+    CPU_ITEM *cpu = &cpus->items[get_logic_cpu_id()];
+    spin_lock(&t.wq.lock);
+    hrtimer_start(cpu, &t);
+    while (t.pending) {
+        sleep_on_locked(&t.wq);
+        spin_lock(&t.wq.lock);
     }
-    uint32_t id = get_logic_cpu_id();
-    CPU_ITEM *cpu = &cpus->items[id];
-    append_to_cpu_timer_list(&cpu->timer_list,timer);
+    spin_unlock(&t.wq.lock);
+    io_set_intr(intr);
 }
 
 /**
@@ -202,45 +460,41 @@ UNUSED static void add_timer(enum timer_type_enum timer_type,uint64_t first_tick
  * @warning 必须要关中断执行,而且需要持有两个CPU的进程列表锁和定时器列表锁
  */
 static void task_timer_travel(pcb_t *task,CPU_ITEM *from_cpu,CPU_ITEM *to_cpu,uint32_t to_id){
-    spin_list_head_t *to_cpu_timer_list = &to_cpu->timer_list;
     list_head_t *pos;
     list_for_each(pos,&task->timers.list){
         timer_t *now_timer = container_of(pos,timer_t,in_task_item);
-        list_del_init(&now_timer->list_item);
-        append_to_cpu_timer_list(to_cpu_timer_list,now_timer);
+        timer_wheel_del(from_cpu->wheel,now_timer);
+        timer_wheel_add(to_cpu->wheel,now_timer);
     }
     task->cpuid = to_id;
-    list_del_init(&task->ready_list_item);
-    list_add_tail(&task->ready_list_item,&to_cpu->ready_list.list);
-    from_cpu->total_ready_num--;
-    to_cpu->total_ready_num++;
+    migrate_task(from_cpu, to_cpu, task);
 }
 
 static inline void alloc_load_balance_lock(CPU_ITEM *cpu1,CPU_ITEM *cpu2){
     if ((uint64_t)cpu1 < (uint64_t)cpu2){
-        spin_lock(&cpu1->ready_list.lock);
-        spin_lock(&cpu1->timer_list.lock);
-        spin_lock(&cpu2->ready_list.lock);
-        spin_lock(&cpu2->timer_list.lock);
+        spin_lock(&cpu1->rq.lock);
+        spin_lock(&cpu1->wheel->lock);
+        spin_lock(&cpu2->rq.lock);
+        spin_lock(&cpu2->wheel->lock);
     }else{
-        spin_lock(&cpu2->ready_list.lock);
-        spin_lock(&cpu2->timer_list.lock);
-        spin_lock(&cpu1->ready_list.lock);
-        spin_lock(&cpu1->timer_list.lock);
+        spin_lock(&cpu2->rq.lock);
+        spin_lock(&cpu2->wheel->lock);
+        spin_lock(&cpu1->rq.lock);
+        spin_lock(&cpu1->wheel->lock);
     }
 }
 
 static inline void unlock_load_balance_lock(CPU_ITEM *cpu1,CPU_ITEM *cpu2){
     if ((uint64_t)cpu1 < (uint64_t)cpu2){
-        spin_unlock(&cpu1->ready_list.lock);
-        spin_unlock(&cpu1->timer_list.lock);
-        spin_unlock(&cpu2->ready_list.lock);
-        spin_unlock(&cpu2->timer_list.lock);
+        spin_unlock(&cpu1->rq.lock);
+        spin_unlock(&cpu1->wheel->lock);
+        spin_unlock(&cpu2->rq.lock);
+        spin_unlock(&cpu2->wheel->lock);
     }else{
-        spin_unlock(&cpu2->ready_list.lock);
-        spin_unlock(&cpu2->timer_list.lock);
-        spin_unlock(&cpu1->ready_list.lock);
-        spin_unlock(&cpu1->timer_list.lock);
+        spin_unlock(&cpu2->rq.lock);
+        spin_unlock(&cpu2->wheel->lock);
+        spin_unlock(&cpu1->rq.lock);
+        spin_unlock(&cpu1->wheel->lock);
     }
 }
 
@@ -255,12 +509,13 @@ static void tasks_travel(uint32_t from_id,uint32_t to_id){
         /* 这里直接将粒度设为 MULTI_CORE_BALANCE_DELTA,认为差异小于它将没有迁移必要 */
         goto end;
     }
-    list_head_t *cpu_task_list = &from_cpu->ready_list.list;
+    /* vruntime最大的任务最晚才会运行, 迁走它对from影响最小 */
     for (uint32_t i = 0; i < MULTI_CORE_BALANCE_DELTA; i++)
     {
-        pcb_t *task = container_of(cpu_task_list->prev,pcb_t,ready_list_item);
+        pcb_t *task = rb_entry(rb_last(&from_cpu->rq.tasks),pcb_t,run_node);
         task_timer_travel(task,from_cpu,to_cpu,to_id);
     }
+    to_cpu->nr_balance += MULTI_CORE_BALANCE_DELTA;
 end:
     unlock_load_balance_lock(from_cpu,to_cpu);
 }
@@ -294,7 +549,81 @@ static void load_balance(uint32_t id){
     }
 }
 
+/**
+ * @brief 从victim偷就绪任务到id
+ * @note 从vruntime最大的一端开始找, 跳过缓存还热的任务; 最多偷走victim一半的就绪任务
+ * @return 偷到的任务数
+ */
+static uint32_t steal_tasks(uint32_t id, uint32_t victim_id)
+{
+    CPU_ITEM *this_cpu = &cpus->items[id];
+    CPU_ITEM *victim = &cpus->items[victim_id];
+    uint32_t stolen = 0;
+    uint8_t intr = io_cli();
+    alloc_load_balance_lock(this_cpu, victim);
+    uint32_t nr = victim->total_ready_num;
+    uint32_t max = (nr + 1) >> 1;
+    if (max > IDLE_STEAL_MAX)
+        max = IDLE_STEAL_MAX;
+    uint64_t now = hpet_read_ns();
+    rb_node_t *node = rb_last(&victim->rq.tasks);
+    while (node && stolen < max) {
+        pcb_t *task = rb_entry(node, pcb_t, run_node);
+        node = rb_prev(node);
+        if (task_cache_hot(task, now))
+            continue;
+        task_timer_travel(task, victim, this_cpu, id);
+        stolen++;
+    }
+    this_cpu->nr_steal += stolen;
+    unlock_load_balance_lock(this_cpu, victim);
+    io_set_intr(intr);
+    return stolen;
+}
+
+/// @brief node上就绪任务不少于min_ready且最多的CPU, 没有时返回-1
+static uint32_t busiest_cpu_on_node(uint32_t id, uint32_t node, uint32_t min_ready)
+{
+    uint32_t busiest = -1;
+    uint32_t max_load = min_ready - 1;
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        CPU_ITEM *cpu = &cpus->items[i];
+        if (i == id || cpu->node != node)
+            continue;
+        uint32_t nr = cpu->total_ready_num;
+        if (nr > max_load) {
+            max_load = nr;
+            busiest = i;
+        }
+    }
+    return busiest;
+}
+
+/**
+ * @brief CPU将要空闲时从别的CPU偷任务
+ * @note 按NUMA距离从近到远找有任务在排队的CPU, 本节点有可偷的就不看远端;
+ * 远端节点至少要排着两个任务才值得跨节点迁移. 不加锁地读total_ready_num, 选中后再加锁确认.
+ * @return 偷到的任务数
+ */
+uint32_t idle_balance(uint32_t id)
+{
+    if (!multi_core_start)
+        return 0;
+    uint32_t node = cpus->items[id].node;
+    for (uint32_t k = 0; k < mm.nr_nodes; k++) {
+        uint32_t n = mm.node[node].fallback[k];
+        uint32_t victim = busiest_cpu_on_node(id, n, n == node ? 1 : 2);
+        if (victim == (uint32_t)-1)
+            continue;
+        uint32_t stolen = steal_tasks(id, victim);
+        if (stolen)
+            return stolen;
+    }
+    return 0;
+}
+
 uint64_t sys_time(void){
+    update_jiffies();
     return atomic_64_read(&unix_time);
 }
 
@@ -303,17 +632,119 @@ typedef struct utimespec {
     uint64_t   tv_nsec; // 纳秒
 } utimespec_t;
 
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+/// clock_nanosleep的flags, req是绝对时刻
+#define TIMER_ABSTIME   1
+/// 一次睡眠的上限(约146年), 更长的请求按它算
+#define SLEEP_MAX_NS    ((uint64_t)INT64_MAX / 2)
+
 void sys_clock_gettime(void *addr){
     utimespec_t time;
+    update_jiffies();
     time.tv_sec = atomic_64_read(&unix_time);
-    time.tv_nsec = j * (1000000000UL / CLOCK_FREQ);
+    time.tv_nsec = (hpet_read_ns() - tick_base_ns) % 1000000000UL;
     copy_to_user(addr,&time,sizeof(utimespec_t));
 }
 
+/// @brief 单调时钟, 从init_time开始的纳秒数
+static inline uint64_t monotonic_ns(void)
+{
+    return hpet_read_ns() - tick_base_ns;
+}
+
+/// @brief 与sys_clock_gettime一致的墙上时间
+static uint64_t realtime_ns(void)
+{
+    update_jiffies();
+    return atomic_64_read(&unix_time) * 1000000000UL + monotonic_ns() % 1000000000UL;
+}
+
+/**
+ * @brief 睡到单调时钟的deadline, 写回剩余时间
+ * @note 睡眠不会被信号打断, 醒来时剩余时间总是0
+ */
+static int do_nanosleep(uint64_t deadline, utimespec_t *rem)
+{
+    if ((int64_t)(deadline - monotonic_ns()) > 0)
+        hrtimer_sleep_until(deadline + tick_base_ns);
+    if (rem) {
+        utimespec_t left = {0, 0};
+        copy_to_user(rem, &left, sizeof(utimespec_t));
+    }
+    return 0;
+}
+
+/**
+ * @brief 检查用户给的时间并换算成纳秒
+ * @note 按有符号数看是负数的字段不合法; 超过SLEEP_MAX_NS的按SLEEP_MAX_NS算,
+ * 保证加上当前时刻后按有符号差值比较仍然正确
+ * @return 0 成功, -1 不合法
+ */
+static int timespec_to_ns(const utimespec_t *req, uint64_t *ns)
+{
+    if (!req)
+        return -1;
+    uint64_t sec = req->tv_sec;
+    uint64_t nsec = req->tv_nsec;
+    if ((int64_t)sec < 0 || nsec >= 1000000000UL)
+        return -1;
+    if (sec >= SLEEP_MAX_NS / 1000000000UL)
+        *ns = SLEEP_MAX_NS;
+    else
+        *ns = sec * 1000000000UL + nsec;
+    return 0;
+}
+
+int sys_nanosleep(const utimespec_t *req, utimespec_t *rem)
+{
+    uint64_t ns;
+    if (timespec_to_ns(req, &ns))
+        return -1;
+    return do_nanosleep(monotonic_ns() + ns, rem);
+}
+
+/**
+ * @param clock CLOCK_REALTIME或CLOCK_MONOTONIC
+ * @param flags TIMER_ABSTIME时req是绝对时刻, 墙上时间按当前的差值换算到单调时钟
+ */
+int sys_clock_nanosleep(int clock, int flags, const utimespec_t *req, utimespec_t *rem)
+{
+    uint64_t ns;
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+        return -1;
+    if (timespec_to_ns(req, &ns))
+        return -1;
+    uint64_t now = monotonic_ns();
+    if (!(flags & TIMER_ABSTIME))
+        return do_nanosleep(now + ns, rem);
+    if (clock == CLOCK_REALTIME) {
+        int64_t delta = (int64_t)(ns - realtime_ns());
+        return do_nanosleep(delta > 0 ? now + delta : now, NULL);
+    }
+    return do_nanosleep(ns, NULL);
+}
+
+/**
+ * @brief 睡眠ms毫秒, 给驱动初始化这类在进程上下文里的等待用
+ * @note 关着中断或者在idle中时没法睡, 退回mdelay
+ */
+void msleep(uint64_t ms){
+    uint8_t intr = io_cli();
+    CPU_ITEM *cpu = &cpus->items[get_logic_cpu_id()];
+    bool can_sleep = intr && cpu->now_running != cpu->idle && multi_core_start;
+    io_set_intr(intr);
+    if (!can_sleep) {
+        mdelay(ms);
+        return;
+    }
+    hrtimer_sleep_until(hpet_read_ns() + ms * 1000000UL);
+}
+
 void mdelay(uint64_t ms){
-    uint64_t start_ticks = ticks;
+    uint64_t start_ticks = get_ticks();
     uint64_t delta = ms * CLOCK_FREQ / 1000;
-    while (ticks - start_ticks < delta)
+    while (get_ticks() - start_ticks < delta)
     {
         sys_yield();
     }
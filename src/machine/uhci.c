@@ -13,6 +13,7 @@
 extern uint64_t *vir_ptable4;
 
 static list_head_t uhci_controllers = LIST_HEAD_INIT(uhci_controllers);
+static kmem_cache_t *uhci_req_cachep;
 
 static int uhci_submit_control_request(struct uhci_controller *hc, uint8_t dev_addr,uint8_t *setup, void *data, int len, int dir);
 static int uhci_submit_scsi_command(struct usb_device *dev, uint8_t *cdb, int cdb_len,void *data, int data_len, int dir,uhci_request_t **tmp);
@@ -61,11 +62,11 @@ static void uhci_port_init(uint16_t io_base, int port)
         return;
 
     uhci_port_write(io_base, port, v | PORT_PR);
-    mdelay(50);
+    msleep(50);
 
     v = uhci_port_read(io_base, port);
     uhci_port_write(io_base, port, v & ~PORT_PR);
-    mdelay(10);
+    msleep(10);
 
     v = uhci_port_read(io_base, port);
     uhci_port_write(io_base, port, v | PORT_PED);
@@ -84,7 +85,7 @@ static int uhci_hw_init(struct uhci_controller *hc) {
     // 等待复位完成
     timeout = 10;
     while ((io_inword(io + UHCI_USBCMD) & CMD_HCRESET) && timeout--) {
-        mdelay(1);
+        msleep(1);
     }
     if (timeout <= 0) {
         return -1;
@@ -204,7 +205,7 @@ static struct usb_device *uhci_enumerate_device(struct uhci_controller *hc, int
         return NULL;
     }
     // 等待地址生效（USB规范要求至少2ms）
-    mdelay(2);
+    msleep(2);
     dev_addr = dev->address; // 后续使用新地址
 
     // 5. 获取完整设备描述符（18字节）
@@ -350,6 +351,10 @@ static struct usb_device *uhci_enumerate_device(struct uhci_controller *hc, int
 }
 
 int init_uhci_controller(uint8_t bus, uint8_t dev, uint8_t func) {
+    if (!uhci_req_cachep) {
+        uhci_req_cachep = kmem_cache_create("uhci_request", sizeof(uhci_request_t), 8, NULL);
+        if (!uhci_req_cachep) return -1;
+    }
     struct uhci_controller *hc = uhci_alloc_controller(bus, dev, func);
     if (!hc) return -1;
 
@@ -407,7 +412,7 @@ void uhci_initial_scan(void) {
 }
 
 static int uhci_submit_control_request(struct uhci_controller *hc, uint8_t dev_addr,uint8_t *setup, void *data, int len, int dir) {
-    uhci_request_t *req = kmalloc(sizeof(uhci_request_t));
+    uhci_request_t *req = kmem_cache_alloc(uhci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(uhci_request_t));
@@ -429,13 +434,16 @@ static int uhci_submit_control_request(struct uhci_controller *hc, uint8_t dev_a
     sleep_on_locked(&req->wq);
 
     int status = req->status;
-    kfree(req);
+    kmem_cache_free(uhci_req_cachep, req);
     return status;
 }
 
 static int uhci_submit_rw_request(struct usb_device *dev, int write, uint64_t lba, uint32_t count, void *buffer) {
     struct uhci_controller *hc = dev->hc;
-    uhci_request_t *req = kmalloc(sizeof(uhci_request_t));
+    // 请求由内核线程构建, 用户缓冲区的页要在这里先补上
+    if (prefault_user_range(buffer, (uint64_t)count << 9))
+        return -1;
+    uhci_request_t *req = kmem_cache_alloc(uhci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(uhci_request_t));
@@ -512,14 +520,16 @@ static int uhci_submit_rw_request(struct usb_device *dev, int write, uint64_t lb
     sleep_on_locked(&req->wq);      // 等待请求完成
 
     int status = req->status;
-    kfree(req);
+    kmem_cache_free(uhci_req_cachep, req);
     return status;
 }
 
 static int uhci_submit_scsi_command(struct usb_device *dev, uint8_t *cdb, int cdb_len,void *data, int data_len, int dir,uhci_request_t **tmp)  // dir: 1=IN, 0=OUT
 {
     struct uhci_controller *hc = dev->hc;
-    uhci_request_t *req = kmalloc(sizeof(uhci_request_t));
+    if (data && prefault_user_range(data, data_len))
+        return -1;
+    uhci_request_t *req = kmem_cache_alloc(uhci_req_cachep);
     if (!req) return -1;
 
     memset(req, 0, sizeof(uhci_request_t));
@@ -573,7 +583,7 @@ static int uhci_submit_scsi_command(struct usb_device *dev, uint8_t *cdb, int cd
     if (tmp)
         *tmp = req;
     else
-        kfree(req);
+        kmem_cache_free(uhci_req_cachep, req);
     return status;
 }
 
@@ -685,7 +695,12 @@ static int uhci_build_request(uhci_request_t *req) {
             td_data->ctrl_status = TD_CTL_NORMAL_BULK_USE;
             td_data->packed_header = TD_PH(chunk,toggle,bulk_ep,pid,dev_addr);
             uint64_t data_va = (uint64_t)req->bulk.buffer + (data_len - remaining);
-            td_data->buffer = (uint32_t)mem_linear2phy_get(data_va, req->bulk.cr3);
+            uint64_t data_pa = mem_linear2phy_get(data_va, req->bulk.cr3);
+            if (!data_pa) {
+                free_n_pages_4k(req->page_num, phy_mem);
+                return -1;
+            }
+            td_data->buffer = (uint32_t)data_pa;
             clflush_range(easy_phy2linear(td_data->buffer),chunk);
             prev_td->link = (uint32_t)(uintptr_t)easy_linear2phy(td_data);
             
@@ -0,0 +1,291 @@
+#include "mm/page_pool.h"
+#include "mm/mm.h"
+#include "lib/string.h"
+#include "lib/io.h"
+
+/**
+ * 物理页的buddy分配器
+ * 每个物理区域(pais)各自维护0..BUDDY_MAX_ORDER阶的空闲链表, 块按物理页号自然对齐,
+ * 合并时不会越过区域边界. 区域不跨NUMA节点, 分配时按首选节点的距离顺序找区域.
+ * 调用者需持有mm.page_lock.
+ * 引用计数(mem_map)由调用者维护, 这里只关心块的空闲状态, 记在page_t.order上.
+ */
+
+extern PHYSIC_AREA_ITEM pais[];
+extern MM_MANAGER mm;
+
+static inline list_head_t *pfn_node(uint64_t pfn)
+{
+    return easy_phy2linear(pfn << 12);
+}
+
+static inline uint64_t node_pfn(list_head_t *node)
+{
+    return (uint64_t)easy_linear2phy(node) >> 12;
+}
+
+static inline void buddy_add(PHYSIC_AREA_ITEM *pai, uint64_t pfn, uint32_t order)
+{
+    list_add(pfn_node(pfn), &pai->free_area[order].free_list);
+    pai->free_area[order].nr_free++;
+    mem_map[pfn].order = order;
+}
+
+static inline void buddy_del(PHYSIC_AREA_ITEM *pai, uint64_t pfn, uint32_t order)
+{
+    list_del(pfn_node(pfn));
+    pai->free_area[order].nr_free--;
+    mem_map[pfn].order = BUDDY_ORDER_NONE;
+}
+
+static PHYSIC_AREA_ITEM *pfn_to_area(uint64_t pfn)
+{
+    if (pfn >= mm.tpp || (mem_map[pfn].flags & PG_RESERVED))
+        halt();
+    return &pais[mem_map[pfn].area];
+}
+
+static void __buddy_free_area_locked(PHYSIC_AREA_ITEM *pai, uint64_t pfn, uint32_t order)
+{
+    uint64_t spfn = pai->spa >> 12;
+    uint64_t epfn = pai->epa >> 12;
+    if (mem_map[pfn].order != BUDDY_ORDER_NONE)
+        halt();
+    pai->fpp += 1UL << order;
+    mm.tfpp += 1UL << order;
+    mm.node[pai->node].free_pages += 1UL << order;
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if (buddy < spfn || buddy + (1UL << order) > epfn || mem_map[buddy].order != order)
+            break;
+        buddy_del(pai, buddy, order);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+    buddy_add(pai, pfn, order);
+}
+
+/// @brief 把[addr,end)拆成尽量大的对齐块放回, 块数为O(log n)
+static void __buddy_free_range_area_locked(PHYSIC_AREA_ITEM *pai, uint64_t pfn, uint64_t epfn)
+{
+    while (pfn < epfn) {
+        uint32_t order = 0;
+        while (order < BUDDY_MAX_ORDER && !(pfn & (1UL << order)) && pfn + (2UL << order) <= epfn)
+            order++;
+        __buddy_free_area_locked(pai, pfn, order);
+        pfn += 1UL << order;
+    }
+}
+
+void init_buddy(void)
+{
+    mm.tfpp = 0;
+    // 在init_numa之前所有内存都算节点0
+    mm.nr_nodes = 1;
+    memset(mm.node, 0, sizeof(mm.node));
+    for (uint32_t i = 0; i < mm.npai; i++) {
+        uint64_t usable = pais[i].fpp;
+        pais[i].fpp = 0;
+        pais[i].node = 0;
+        mm.node[0].total_pages += (pais[i].epa - pais[i].spa) >> 12;
+        for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++) {
+            INIT_LIST_HEAD(&pais[i].free_area[j].free_list);
+            pais[i].free_area[j].nr_free = 0;
+        }
+        if (usable)
+            __buddy_free_range_area_locked(&pais[i], pais[i].spa >> 12, pais[i].epa >> 12);
+    }
+}
+
+/// @brief 摘下来待重新放回的空闲块, 放在块的首页里
+typedef struct FreeChunk {
+    uint64_t next;
+    uint32_t order;
+} FREE_CHUNK;
+
+/// @brief 找到pfn所在的节点和同一节点延续到的位置(不超过epfn)
+static uint64_t range_split(NUMA_MEM_RANGE *ranges, uint32_t nr, uint64_t pfn, uint64_t epfn, uint32_t *node)
+{
+    *node = 0;
+    for (uint32_t i = 0; i < nr; i++) {
+        uint64_t s = (ranges[i].start + 0xfff) >> 12;
+        uint64_t e = ranges[i].end >> 12;
+        if (s <= pfn && pfn < e) {
+            *node = ranges[i].node;
+            if (e < epfn)
+                epfn = e;
+        } else if (s > pfn && s < epfn) {
+            epfn = s;
+        }
+    }
+    return epfn;
+}
+
+/**
+ * @brief 按SRAT的内存范围把物理区域切到单个节点内, 再把空闲块放回新的区域
+ * @note 启动时单核调用, 这时页缓存还没有启用, 所有空闲页都在buddy里;
+ *       区域表满了之后剩下的部分不再切分, 算作它开头所在的节点
+ */
+void buddy_split_areas(NUMA_MEM_RANGE *ranges, uint32_t nr)
+{
+    static PHYSIC_AREA_ITEM old[DEFAULT_PAI_NUMBER];
+    uint64_t chain = (uint64_t)-1;
+    uint32_t old_npai = mm.npai;
+    for (uint32_t i = 0; i < old_npai; i++) {
+        for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++) {
+            while (pais[i].free_area[j].nr_free) {
+                uint64_t pfn = node_pfn(pais[i].free_area[j].free_list.next);
+                buddy_del(&pais[i], pfn, j);
+                FREE_CHUNK *chunk = (FREE_CHUNK *)pfn_node(pfn);
+                chunk->next = chain;
+                chunk->order = j;
+                chain = pfn;
+            }
+        }
+        old[i] = pais[i];
+    }
+
+    mm.npai = 0;
+    mm.tfpp = 0;
+    memset(mm.node, 0, sizeof(mm.node));
+    for (uint32_t i = 0; i < old_npai; i++) {
+        uint64_t pfn = old[i].spa >> 12;
+        uint64_t epfn = old[i].epa >> 12;
+        while (pfn < epfn) {
+            uint32_t node;
+            uint64_t end = range_split(ranges, nr, pfn, epfn, &node);
+            // 后面的每个旧区域至少还要占一项
+            if (mm.npai + (old_npai - i) + 1 > DEFAULT_PAI_NUMBER)
+                end = epfn;
+            PHYSIC_AREA_ITEM *pai = &pais[mm.npai];
+            pai->spa = pfn << 12;
+            pai->epa = end << 12;
+            pai->fpp = 0;
+            pai->node = node;
+            for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++) {
+                INIT_LIST_HEAD(&pai->free_area[j].free_list);
+                pai->free_area[j].nr_free = 0;
+            }
+            for (uint64_t p = pfn; p < end; p++)
+                mem_map[p].area = mm.npai;
+            mm.node[node].total_pages += end - pfn;
+            mm.npai++;
+            pfn = end;
+        }
+    }
+
+    while (chain != (uint64_t)-1) {
+        FREE_CHUNK *chunk = (FREE_CHUNK *)pfn_node(chain);
+        uint64_t pfn = chain;
+        uint64_t end = pfn + (1UL << chunk->order);
+        chain = chunk->next;
+        // 跨节点边界的块拆开放回各自的区域
+        while (pfn < end) {
+            PHYSIC_AREA_ITEM *pai = &pais[mem_map[pfn].area];
+            uint64_t e = end < (pai->epa >> 12) ? end : (pai->epa >> 12);
+            __buddy_free_range_area_locked(pai, pfn, e);
+            pfn = e;
+        }
+    }
+}
+
+/// @brief 从一个区域取2^order页, 区域里没有足够大的块返回0
+static uint64_t __buddy_alloc_area_locked(PHYSIC_AREA_ITEM *pai, uint32_t order)
+{
+    if (pai->fpp < (1UL << order))
+        return 0;
+    for (uint32_t j = order; j <= BUDDY_MAX_ORDER; j++) {
+        if (!pai->free_area[j].nr_free)
+            continue;
+        uint64_t pfn = node_pfn(pai->free_area[j].free_list.next);
+        buddy_del(pai, pfn, j);
+        /* 拆分: 高半部分依次放回低一阶 */
+        while (j > order) {
+            j--;
+            buddy_add(pai, pfn + (1UL << j), j);
+        }
+        pai->fpp -= 1UL << order;
+        mm.tfpp -= 1UL << order;
+        mm.node[pai->node].free_pages -= 1UL << order;
+        return pfn << 12;
+    }
+    return 0;
+}
+
+/**
+ * @brief 优先从node取2^order页, 不够时按SLIT距离从近到远退到别的节点
+ * @return 物理地址, 所有节点都没有足够大的块返回0
+ */
+uint64_t __buddy_alloc_node_locked(uint32_t order, uint32_t node)
+{
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
+    if (node >= mm.nr_nodes)
+        node = 0;
+    for (uint32_t k = 0; k < mm.nr_nodes; k++) {
+        uint32_t n = mm.node[node].fallback[k];
+        for (uint32_t i = 0; i < mm.npai; i++) {
+            if (pais[i].node != n)
+                continue;
+            uint64_t ret = __buddy_alloc_area_locked(&pais[i], order);
+            if (!ret)
+                continue;
+            if (n == node)
+                mm.node[n].alloc_local += 1UL << order;
+            else
+                mm.node[n].alloc_remote += 1UL << order;
+            return ret;
+        }
+    }
+    mm.buddy_fail[order]++;
+    return 0;
+}
+
+/// @return 2^order页的物理地址, 优先取当前CPU所在的节点, 没有足够大的块返回0
+uint64_t __buddy_alloc_locked(uint32_t order)
+{
+    return __buddy_alloc_node_locked(order, numa_node_id());
+}
+
+void __buddy_free_locked(uint64_t addr, uint32_t order)
+{
+    uint64_t pfn = addr >> 12;
+    if ((addr & 0xfff) || (pfn & ((1UL << order) - 1)))
+        halt();
+    __buddy_free_area_locked(pfn_to_area(pfn), pfn, order);
+}
+
+void __buddy_free_range_locked(uint64_t addr, uint64_t end)
+{
+    if (addr >= end)
+        return;
+    PHYSIC_AREA_ITEM *pai = pfn_to_area(addr >> 12);
+    if (end > pai->epa)
+        halt();
+    __buddy_free_range_area_locked(pai, addr >> 12, end >> 12);
+}
+
+void buddy_stat(BUDDY_STAT *stat)
+{
+    memset(stat, 0, sizeof(BUDDY_STAT));
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    for (uint32_t i = 0; i < mm.npai; i++) {
+        for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++)
+            stat->nr_free[j] += pais[i].free_area[j].nr_free;
+    }
+    for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++)
+        stat->alloc_fail[j] = mm.buddy_fail[j];
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
+
+    for (uint32_t j = 0; j <= BUDDY_MAX_ORDER; j++)
+        stat->free_pages += stat->nr_free[j] << j;
+    if (!stat->free_pages)
+        return;
+    /* 从高阶往低阶累计: suitable为能满足该阶分配的空闲页数 */
+    uint64_t suitable = 0;
+    for (int j = BUDDY_MAX_ORDER; j >= 0; j--) {
+        suitable += stat->nr_free[j] << j;
+        stat->unusable_index[j] = (stat->free_pages - suitable) * 1000 / stat->free_pages;
+    }
+}
@@ -2,140 +2,268 @@
 #include "mm/mm.h"
 #include "mm/page_pool.h"
 #include "mm/slab.h"
+#include "mm/reclaim.h"
+#include "mm/tlb.h"
+#include "task.h"
+
+/**
+ * 内核堆: kmalloc超过一页的分配
+ * 所有块按地址放在heap_addr上, 释放时O(log n)找到块, 通过next/last与相邻的空闲块合并;
+ * 空闲块另外按(大小, 地址)放在heap_free上, 分配取最小的够用的块, 同样大小取地址低的.
+ * 空闲块的页先留着映射, 下次分配可以直接用, 内存紧张时由shrinker解除映射还给伙伴系统.
+ */
 
 extern MM_MANAGER mm;
 extern uint64_t *vir_ptable4;
+extern bool multi_core_start;
 
-void init_heap()
+/// 回收时每批解除映射的页数, 共用一次TLB shootdown
+#define HEAP_SHRINK_BATCH 64
+
+/// HEAP节点在mm.lock下分配, 不能使用需要mm.lock来扩展窗口的kmalloc
+static kmem_cache_t *heap_node_cachep;
+
+static void addr_insert(HEAP *heap)
+{
+    rb_node_t **link = &mm.heap_addr.node;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        HEAP *entry = rb_entry(parent, HEAP, addr_node);
+        link = heap->start_addr < entry->start_addr ? &parent->left : &parent->right;
+    }
+    rb_link_node(&heap->addr_node, parent, link);
+    rb_insert_color(&heap->addr_node, &mm.heap_addr);
+}
+
+static void free_insert(HEAP *heap)
+{
+    rb_node_t **link = &mm.heap_free.node;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        HEAP *entry = rb_entry(parent, HEAP, free_node);
+        if (heap->size < entry->size ||
+            (heap->size == entry->size && heap->start_addr < entry->start_addr))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_link_node(&heap->free_node, parent, link);
+    rb_insert_color(&heap->free_node, &mm.heap_free);
+}
+
+/// @brief 把next并进heap, 两块都已经不在heap_free上
+static void absorb_next(HEAP *heap, HEAP *next)
+{
+    heap->size += next->size;
+    heap->mapped |= next->mapped;
+    heap->next = next->next;
+    if (next->next)
+        next->next->last = heap;
+    rb_erase(&next->addr_node, &mm.heap_addr);
+    kmem_cache_free(heap_node_cachep, next);
+}
+
+/// @brief 空闲块和前后的空闲块合并之后放回heap_free
+static void free_merge_insert(HEAP *heap)
 {
-    mm.nfhp = mm.shp = kmalloc(sizeof(HEAP));
-    mm.nfhp->last = mm.nfhp->next = mm.nfhp->nextf = mm.nfhp->lastf = (void*)0;
-    mm.nfhp->used = 0;
-    mm.he = mm.nfhp->start_addr = HEAP_ADDR_START;
-    mm.nfhp->size = HEAP_SIZE_MAX;
+    HEAP *last = heap->last;
+    if (last && !last->used && !last->busy) {
+        rb_erase(&last->free_node, &mm.heap_free);
+        absorb_next(last, heap);
+        heap = last;
+    }
+    HEAP *next = heap->next;
+    if (next && !next->used && !next->busy) {
+        rb_erase(&next->free_node, &mm.heap_free);
+        absorb_next(heap, next);
+    }
+    free_insert(heap);
 }
 
-void *slab_alloc(uint32_t size);
+/// @brief 映射[start, end)内还没有映射的页, 失败时已经映射的页留给以后使用
+static int heap_map_range(uint64_t start, uint64_t end)
+{
+    for (uint64_t addr = start; addr < end; addr += 4096) {
+        if (exist_page_4k(addr, (uint64_t)vir_ptable4))
+            continue;
+        uint64_t phy_addr = alloc_page_4k();
+        if (!phy_addr)
+            return -1;
+        if (__put_page_4k_locked(phy_addr, addr, (uint64_t)vir_ptable4, 0, 0)) {
+            decrease_reference_page_4k(phy_addr);
+            return -1;
+        }
+        phys_to_page(phy_addr)->flags |= PG_HEAP;
+        mm.heap_mapped++;
+        if (addr + 4096 > mm.heap_top)
+            mm.heap_top = addr + 4096;
+    }
+    return 0;
+}
 
+/// @return 地址, 窗口用完或者没有物理页时返回0
 uint64_t heap_alloc(uint32_t size)
 {
-    HEAP* heap = mm.nfhp;
-    uint32_t aligned_size = (size + 0xfff) & 0xfffff000;
-    while (heap) {
-        if (heap->size >= aligned_size) {
-            uint64_t ret = heap->start_addr;
-            heap->size -= aligned_size;
-            if (heap->size) {
-                heap->start_addr += aligned_size;
-                HEAP* new = slab_alloc(sizeof(HEAP));
-                new->used = 1;
-                new->size = aligned_size;
-                new->start_addr = ret;
-                new->lastf = new->nextf = (void*)0;
-                new->next = heap;
-                if (heap->last) {
-                    heap->last->next = new;
-                    new->last = heap->last;
-                    heap->last = new;
-                } else {
-                    heap->last = new;
-                    new->last = (void*)0;
-                    mm.shp = new;
-                }
-            } else {
-                heap->size = aligned_size;
-                heap->used = 1;
-                if (heap->lastf) {
-                    heap->lastf->nextf = heap->nextf;
-                    if (heap->nextf)
-                        heap->nextf->lastf = heap->lastf;
-                } else {
-                    if (heap->nextf) {
-                        heap->nextf->lastf = (void*)0;
-                        mm.nfhp = heap->nextf;
-                    } else {
-                        halt();
-                    }
-                }
-            }
-            if (ret + aligned_size > mm.he) {
-                for (uint64_t addr = mm.he; addr < ret + aligned_size; addr += 4096) {
-                    uint64_t phy_addr = alloc_page_4k();
-                    __put_page_4k_locked(phy_addr, addr, (uint64_t)vir_ptable4, 0, 0);
-                }
-                mm.he = ret + aligned_size;
-            }
-            return ret;
-        } else
-            heap = heap->nextf;
+    uint64_t aligned_size = ((uint64_t)size + 0xfff) & ~0xfffUL;
+    HEAP *best = NULL;
+    rb_node_t *node = mm.heap_free.node;
+    while (node) {
+        HEAP *entry = rb_entry(node, HEAP, free_node);
+        if (entry->size >= aligned_size) {
+            best = entry;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    if (!best)
+        return 0;
+
+    HEAP *tail = NULL;
+    if (best->size > aligned_size) {
+        tail = kmem_cache_alloc(heap_node_cachep);
+        if (!tail)
+            return 0;
+    }
+    uint64_t ret = best->start_addr;
+    if (heap_map_range(ret, ret + aligned_size)) {
+        best->mapped = 1;
+        if (tail)
+            kmem_cache_free(heap_node_cachep, tail);
+        return 0;
     }
-    halt();
+    rb_erase(&best->free_node, &mm.heap_free);
+    // 前面一段分出去, 剩下的仍是空闲块, best在heap_addr中的位置不变
+    if (tail) {
+        tail->start_addr = ret + aligned_size;
+        tail->size = best->size - aligned_size;
+        tail->used = 0;
+        tail->mapped = best->mapped;
+        tail->busy = 0;
+        tail->last = best;
+        tail->next = best->next;
+        if (best->next)
+            best->next->last = tail;
+        best->next = tail;
+        best->size = aligned_size;
+        addr_insert(tail);
+        free_insert(tail);
+    }
+    best->used = 1;
+    mm.heap_used += aligned_size >> 12;
+    return ret;
 }
 
-uint8_t slab_free(void *vir_addr);
 void heap_free(uint64_t addr)
 {
-    HEAP* heap = mm.shp;
-    while (heap) {
-        if (heap->used && heap->start_addr == addr) {
-            heap->used = 0;
-            if (heap->last && heap->next && !heap->last->used && !heap->next->used) {
-                heap->last->size += heap->size + heap->next->size;
-                heap->last->next = heap->next->next;
-                heap->last->nextf = heap->next->nextf;
-                if (heap->last->next)
-                    heap->last->next->last = heap->last;
-                if (heap->last->nextf)
-                    heap->last->nextf->lastf = heap->last;
-                slab_free(heap->next);
-                slab_free(heap);
-                return;
-            } else if (heap->last && !heap->last->used) {
-                heap->last->size += heap->size;
-                heap->last->next = heap->next;
-                if (heap->last->next)
-                    heap->last->next->last = heap->last;
-                slab_free(heap);
-                return;
-            } else if (heap->next && !heap->next->used) {
-                heap->next->size += heap->size;
-                heap->next->start_addr -= heap->size;
-                heap->next->last = heap->last;
-                if (heap->next->last)
-                    heap->last->next = heap->next;
-                else
-                    mm.shp = heap->next;
-                slab_free(heap);
-                return;
-            } else {
-                /// tem不能是(void*)0,有heep_alloc保证
-                HEAP* tem = mm.nfhp;
-                HEAP* last = tem;
-                if (tem->start_addr > heap->start_addr) {
-                    tem->lastf = heap;
-                    heap->nextf = tem;
-                    heap->lastf = (void*)0;
-                    mm.nfhp = heap;
-                    return;
-                }
-                while (tem) {
-                    if (last->start_addr < heap->start_addr && tem->start_addr > heap->start_addr) {
-                        last->nextf = heap;
-                        tem->lastf = heap;
-                        heap->lastf = last;
-                        heap->nextf = tem;
-                        return;
-                    }
-                    last = tem;
-                    tem = tem->nextf;
-                }
-                last->nextf = heap;
-                heap->lastf = last;
-                heap->nextf = (void*)0;
-                return;
+    HEAP *heap = NULL;
+    rb_node_t *node = mm.heap_addr.node;
+    while (node) {
+        HEAP *entry = rb_entry(node, HEAP, addr_node);
+        if (addr < entry->start_addr) {
+            node = node->left;
+        } else if (addr > entry->start_addr) {
+            node = node->right;
+        } else {
+            heap = entry;
+            break;
+        }
+    }
+    if (!heap || !heap->used)
+        halt();
+    heap->used = 0;
+    heap->mapped = 1;
+    mm.heap_used -= heap->size >> 12;
+    free_merge_insert(heap);
+}
+
+static uint64_t heap_shrink_count(SHRINKER *shrinker)
+{
+    (void)shrinker;
+    return mm.heap_mapped - mm.heap_used;
+}
+
+/// @brief 从最大的空闲块开始解除映射, 返回还给伙伴系统的页数
+static uint64_t heap_shrink_scan(SHRINKER *shrinker, uint64_t nr)
+{
+    (void)shrinker;
+    uint64_t pages[HEAP_SHRINK_BATCH];
+    uint64_t freed = 0;
+    while (freed < nr) {
+        if (!spin_trylock(&mm.lock))
+            break;
+        if (multi_core_start)
+            preempt_disable();
+        HEAP *heap = NULL;
+        for (rb_node_t *node = rb_last(&mm.heap_free); node; node = rb_prev(node)) {
+            heap = rb_entry(node, HEAP, free_node);
+            if (heap->mapped)
+                break;
+            heap = NULL;
+        }
+        if (!heap) {
+            spin_unlock(&mm.lock);
+            break;
+        }
+        // 摘下来标成busy, 解除映射期间不会被分配出去, 相邻块释放时也不会并进来
+        rb_erase(&heap->free_node, &mm.heap_free);
+        heap->busy = 1;
+        uint64_t addr = heap->start_addr;
+        uint64_t end = heap->start_addr + heap->size;
+        if (end > mm.heap_top)
+            end = mm.heap_top;
+        spin_unlock(&mm.lock);
+
+        while (addr < end && freed < nr) {
+            // 回收不会在持有自旋锁时进行, 这里可以等mm.lock
+            spin_lock(&mm.lock);
+            uint64_t start = addr;
+            uint32_t cnt = 0;
+            for (; addr < end && cnt < HEAP_SHRINK_BATCH; addr += 4096) {
+                uint64_t phy = __unmap_kernel_page_locked(addr);
+                if (phy)
+                    pages[cnt++] = phy;
             }
-        } else
-            heap = heap->next;
+            mm.heap_mapped -= cnt;
+            spin_unlock(&mm.lock);
+            if (!cnt)
+                continue;
+            tlb_shootdown(0, start, addr, 0);
+            for (uint32_t i = 0; i < cnt; i++)
+                decrease_reference_page_4k(pages[i]);
+            freed += cnt;
+        }
+
+        spin_lock(&mm.lock);
+        if (addr >= end)
+            heap->mapped = 0;
+        heap->busy = 0;
+        free_merge_insert(heap);
+        spin_unlock(&mm.lock);
     }
-    halt();
+    return freed;
+}
+
+static SHRINKER heap_shrinker = {
+    .name = "heap",
+    .count = heap_shrink_count,
+    .scan = heap_shrink_scan,
+};
+
+void init_heap()
+{
+    heap_node_cachep = kmem_cache_create("heap_node", sizeof(HEAP), 8, NULL);
+    HEAP *heap = kmem_cache_alloc(heap_node_cachep);
+    heap->last = heap->next = (void*)0;
+    heap->start_addr = HEAP_ADDR_START;
+    heap->size = HEAP_SIZE_MAX;
+    heap->used = heap->mapped = heap->busy = 0;
+    mm.heap_addr = mm.heap_free = RB_ROOT;
+    mm.heap_top = HEAP_ADDR_START;
+    mm.heap_mapped = mm.heap_used = 0;
+    addr_insert(heap);
+    free_insert(heap);
+    register_shrinker(&heap_shrinker);
 }
@@ -0,0 +1,108 @@
+#include "const.h"
+#include "mm/mm.h"
+#include "mm/page_pool.h"
+#include "mm/numa.h"
+#include "mm/reclaim.h"
+#include "mm/slab.h"
+#include "mm/swap.h"
+#include "mm/tlb.h"
+#include "view/view.h"
+
+/**
+ * 内存统计
+ * 各个内存子系统的计数在这里汇总成文本, 由sys_memstat交给用户程序memstat打印,
+ * 用来观察页缓存, buddy碎片, 回收与slab magazine的效果并据此调整参数
+ */
+
+extern MM_MANAGER mm;
+
+/// 内核一侧的文本缓冲区, 放得下所有cache各占一行
+#define MEMSTAT_BUF_SIZE 8192
+
+#define MEMSTAT_PRINT(fmt, ...) \
+    (pos += sprintf(buf + pos, fmt, MEMSTAT_BUF_SIZE - pos, ##__VA_ARGS__))
+
+/// @return 写入buf的字节数, 不含结尾的0
+static uint32_t memstat_show(char *buf)
+{
+    uint32_t pos = 0;
+
+    MEMSTAT_PRINT("pages: total %lu free %lu wmark %lu/%lu\n", mm.tpp, mm.tfpp, mm.wmark_low, mm.wmark_high);
+
+    PCP_STAT pcp;
+    page_pcp_stat(&pcp);
+    MEMSTAT_PRINT("pcp: cached %lu alloc_hit %lu alloc_miss %lu refill %lu drain %lu free_hot %lu\n",
+                  pcp.cached, pcp.alloc_hit, pcp.alloc_miss, pcp.refill, pcp.drain, pcp.free_hot);
+    MEMSTAT_PRINT("zeroed: cached %lu hit %lu miss %lu filled %lu\n",
+                  pcp.zeroed, pcp.zero_hit, pcp.zero_miss, pcp.zero_filled);
+
+    BUDDY_STAT buddy;
+    buddy_stat(&buddy);
+    MEMSTAT_PRINT("buddy: free %lu\n", buddy.free_pages);
+    for (uint32_t i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        MEMSTAT_PRINT("  order %d: blocks %lu fail %lu unusable %d/1000\n",
+                      i, buddy.nr_free[i], buddy.alloc_fail[i], buddy.unusable_index[i]);
+    }
+
+    NUMA_STAT numa;
+    numa_stat(&numa);
+    for (uint32_t i = 0; i < numa.nr_nodes; i++) {
+        MEMSTAT_PRINT("node %d: total %lu free %lu used %lu alloc_local %lu alloc_remote %lu\n",
+                      i, numa.node[i].total_pages, numa.node[i].free_pages, numa.node[i].used_pages,
+                      numa.node[i].alloc_local, numa.node[i].alloc_remote);
+    }
+
+    MEMSTAT_PRINT("cow: shared %lu copied %lu reused %lu\n", mm.cow_shared, mm.cow_copied, mm.cow_reused);
+    MEMSTAT_PRINT("huge: alloc %lu fallback %lu split %lu\n", mm.huge_alloc, mm.huge_fallback, mm.huge_split);
+    uint64_t zero_refs = __atomic_load_n(&mm.zero_page_refs, __ATOMIC_RELAXED);
+    MEMSTAT_PRINT("zero_page: mapped %lu cow %lu in_use %lu saved %luK\n",
+                  __atomic_load_n(&mm.zero_page_map, __ATOMIC_RELAXED),
+                  __atomic_load_n(&mm.zero_page_cow, __ATOMIC_RELAXED),
+                  zero_refs, zero_refs * 4);
+    MEMSTAT_PRINT("fault_around: mapped %lu\n", mm.fault_around_map);
+
+    TLB_STAT tlb;
+    tlb_stat(&tlb);
+    MEMSTAT_PRINT("tlb: shootdowns %lu ipis %lu full_flushes %lu lazy_skipped %lu\n",
+                  tlb.shootdowns, tlb.ipis, tlb.full_flushes, tlb.lazy_skipped);
+
+    SWAP_STAT swap;
+    swap_stat(&swap);
+    MEMSTAT_PRINT("swap: stored %lu same_filled %lu compr %lu pool %lu chunks %lu ratio %lu.%d%d\n",
+                  swap.stored, swap.same_filled, swap.compr_bytes, swap.pool_bytes, swap.chunk_pages,
+                  swap.ratio / 100, (int)(swap.ratio / 10 % 10), (int)(swap.ratio % 10));
+    MEMSTAT_PRINT("  out %lu in %lu reject %lu fail %lu in_cycles avg %lu max %lu\n",
+                  swap.swap_out, swap.swap_in, swap.reject, swap.fail,
+                  swap.swap_in ? swap.in_cycles / swap.swap_in : 0, swap.in_cycles_max);
+
+    RECLAIM_STAT reclaim;
+    reclaim_stat(&reclaim);
+    MEMSTAT_PRINT("reclaim: kswapd %lu/%lu direct %lu/%lu alloc_fail %lu\n",
+                  reclaim.kswapd_wakeups, reclaim.kswapd_reclaimed,
+                  reclaim.direct_runs, reclaim.direct_reclaimed, reclaim.alloc_fail);
+    pos += shrinker_show(buf + pos, MEMSTAT_BUF_SIZE - pos);
+
+    MEMSTAT_PRINT("slab:\n");
+    pos += kmem_cache_show(buf + pos, MEMSTAT_BUF_SIZE - pos);
+    return pos;
+}
+
+/**
+ * @brief 把内存统计写到用户缓冲区, 放不下时截断
+ * @return 写入的字节数(不含结尾的0), 失败返回-1
+ */
+int sys_memstat(char *buf, size_t size)
+{
+    if (!buf || !size)
+        return -1;
+    char *text = kmalloc(MEMSTAT_BUF_SIZE);
+    if (!text)
+        return -1;
+    uint32_t len = memstat_show(text);
+    if (len >= size)
+        len = size - 1;
+    text[len] = '\0';
+    copy_to_user(buf, text, len + 1);
+    kfree(text);
+    return len;
+}
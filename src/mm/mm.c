@@ -2,23 +2,35 @@
 #include "lib/string.h"
 #include "mm/page_pool.h"
 #include "multiboot.h"
+#include "machine/cpu.h"
+#include "lib/io.h"
+#include "mm/tlb.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
 
 /// @brief memory reference table：定义在加载部分的尾部
+/// @note 引用计数表之后紧跟buddy的page_order表, 每页各占一个字节
 extern uint8_t _mrt_start[];
+/// @brief 物理页描述符表, 放在内核映像之后
+page_t *mem_map;
 
 PHYSIC_AREA_ITEM pais[DEFAULT_PAI_NUMBER];
 
 MM_MANAGER mm;
 
+extern GLOBAL_CPU *cpus;
+
 static void flush_tlb(void);
 static void invlpg_tlb(uint64_t addr);
 
 static void get_total_memory(MULTIBOOT_INFO* info);
 static void set_mrt_table(void);
 static void set_kernel_area(void);
+static void init_zero_page(void);
 
 extern void init_slab(void);
 extern void init_heap();
+extern void init_vma(void);
 
 extern uint32_t ptable4[];
 uint64_t *vir_ptable4;
@@ -28,12 +40,20 @@ void init_mm(MULTIBOOT_INFO* info)
     uint64_t a;
     __asm__("movq $ptable4, %0" : "=r"(a));
     vir_ptable4 = easy_phy2linear(a);
+    spin_lock_init(&mm.page_lock);
+    mm.pcp_enabled = false;
 
     get_total_memory(info);
     set_mrt_table();
+    init_buddy();
+    init_watermarks();
     set_kernel_area();
+    init_pat();
+    init_numa();
+    init_zero_page();
     init_slab();
     init_heap();
+    init_vma();
 }
 
 static void get_total_memory(MULTIBOOT_INFO* info)
@@ -48,7 +68,7 @@ static void get_total_memory(MULTIBOOT_INFO* info)
     mm.hpa = 0x100000000UL;
     while ((uint32_t)(uint64_t)entry < mmap_end) {
         if (entry->type == MULTIBOOT_MEMORY_AVAILABLE) {
-            pais[i].nfpa = pais[i].spa = (entry->addr + 0xfff) & 0xfffffffffffff000;
+            pais[i].spa = (entry->addr + 0xfff) & 0xfffffffffffff000;
             pais[i].epa = (entry->addr + entry->len) & 0xfffffffffffff000;
             if (pais[i].spa < pais[i].epa) {
                 pais[i].fpp = (pais[i].epa - pais[i].spa) >> 12;
@@ -64,21 +84,29 @@ static void get_total_memory(MULTIBOOT_INFO* info)
 
 static void set_mrt_table(void)
 {
-    uint64_t addr = ((uint64_t)easy_linear2phy(_mrt_start) + mm.tpp + 0xfff) & 0xfffffffffffff000;
-    memset(_mrt_start, (uint8_t)0xff, (addr >> 12));
-    uint64_t last_addr = addr;
+    mem_map = (page_t *)_mrt_start;
+    uint64_t addr = ((uint64_t)easy_linear2phy(mem_map) + mm.tpp * sizeof(page_t) + 0xfff) & 0xfffffffffffff000;
+    for (uint64_t pfn = 0; pfn < mm.tpp; pfn++) {
+        page_t *page = &mem_map[pfn];
+        page->refcount = PAGE_REF_RESERVED;
+        page->flags = PG_RESERVED;
+        page->order = BUDDY_ORDER_NONE;
+        page->area = 0;
+        page->private = 0;
+    }
     for (uint32_t i = 0; i < mm.npai; i++) {
         if (pais[i].epa <= addr) {
             pais[i].fpp = 0;
-        } else if (pais[i].spa < addr) {
-            pais[i].spa = pais[i].nfpa = addr;
+            continue;
+        }
+        if (pais[i].spa < addr) {
+            pais[i].spa = addr;
             pais[i].fpp = (pais[i].epa - addr) >> 12;
-            last_addr = pais[i].epa;
-            memset(&_mrt_start[addr >> 12], 0, pais[i].fpp);
-        } else {
-            memset(&_mrt_start[last_addr >> 12], 0xff, (pais[i].spa - last_addr) >> 12);
-            memset(&_mrt_start[pais[i].spa >> 12], 0, pais[i].fpp);
-            last_addr = pais[i].epa;
+        }
+        for (uint64_t pfn = pais[i].spa >> 12; pfn < pais[i].epa >> 12; pfn++) {
+            mem_map[pfn].refcount = 0;
+            mem_map[pfn].flags = 0;
+            mem_map[pfn].area = i;
         }
         mm.tfpp += pais[i].fpp;
     }
@@ -99,122 +127,447 @@ static void set_kernel_area(void)
     flush_tlb();
 }
 
-uint64_t alloc_page_4k(void)
+/// @brief 取一页作页表
+/// @return 物理地址, 回收之后仍然没有空闲页返回0, 由调用者把失败传上去
+static uint64_t alloc_table_page(void)
 {
-    for (uint32_t i = 0; i < mm.npai; i++) {
-        if (pais[i].fpp) {
-            uint64_t ret = pais[i].nfpa;
-            _mrt_start[ret >> 12]++;
-            pais[i].fpp--;
-            if (pais[i].fpp) {
-                for (uint64_t j = ret >> 12; j < pais[i].epa >> 12; j++) {
-                    if (!_mrt_start[j]) {
-                        pais[i].nfpa = j << 12;
-                        return ret;
-                    }
-                }
-                halt();
-            } else
-                return ret;
-        }
+    return alloc_zeroed_page_4k();
+}
+
+/// @brief 零页的引用计数固定为1, 映射和解除映射都不改动它
+static void init_zero_page(void)
+{
+    mm.zero_page = alloc_page_4k();
+    memset(easy_phy2linear(mm.zero_page), 0, 4096);
+}
+
+/// @return 从buddy中取一页,并置引用计数为1,没有空闲页返回0
+static uint64_t __alloc_page_4k_locked(void)
+{
+    uint64_t ret = __buddy_alloc_locked(0);
+    if (ret)
+        phys_to_page(ret)->refcount = 1;
+    return ret;
+}
+
+/// @brief 把引用计数已经归零的页放回buddy
+static void __free_page_4k_locked(uint64_t addr)
+{
+    phys_to_page(addr)->refcount = 0;
+    __buddy_free_locked(addr, 0);
+}
+
+/**
+ * @brief 启用每CPU页缓存
+ * @note 依赖cpus与Local APIC(get_logic_cpu_id),因此在init_apic_bsp之后调用
+ */
+void init_page_pcp(void)
+{
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        PER_CPU_PAGES *pcp = &cpus->items[i].pcp;
+        memset(pcp, 0, sizeof(PER_CPU_PAGES));
+        INIT_LIST_HEAD(&pcp->list);
+        INIT_LIST_HEAD(&pcp->zero_list);
+        pcp->batch = PCP_DEFAULT_BATCH;
+        pcp->high = PCP_DEFAULT_HIGH;
+        pcp->zero_high = PCP_ZERO_HIGH;
     }
-    halt();
+    mm.pcp_enabled = true;
 }
 
-/// @return 正常的话返回获取到的地址，没有找到就返回0
-static uint64_t __alloc_n_pages_4k_locked(uint32_t n)
+/// @warning 调用时必须关中断
+static inline PER_CPU_PAGES *this_cpu_pcp(void)
 {
-    if (n == 0)
-        return 0;
-    for (uint32_t i = 0; i < mm.npai; i++) {
-        if (pais[i].fpp >= n) {
-            uint64_t ret;
-            uint32_t m = 0;
-            for (uint64_t j = pais[i].nfpa >> 12; j < pais[i].epa >> 12; j++) {
-                if (!_mrt_start[j]) {
-                    if (!m)
-                        ret = j;
-                    if (++m == n) {
-                        for (uint32_t k = 0; k < n; k++)
-                            _mrt_start[ret + k] = 1;
-                        pais[i].fpp -= n;
-                        if (pais[i].fpp) {
-                            for (uint64_t k = pais[i].nfpa >> 12; k < pais[i].epa >> 12; k++) {
-                                if (!_mrt_start[k]) {
-                                    pais[i].nfpa = k << 12;
-                                    return ret << 12;
-                                }
-                            }
-                            halt();
-                        }
-                        return ret << 12;
-                    }
-                } else
-                    m = 0;
+    return &cpus->items[get_logic_cpu_id()].pcp;
+}
+
+/// @brief 从全局池批量取页放到cold端
+static void pcp_refill(PER_CPU_PAGES *pcp)
+{
+    spin_lock(&mm.page_lock);
+    for (uint32_t i = 0; i < pcp->batch; i++) {
+        uint64_t addr = __alloc_page_4k_locked();
+        if (!addr)
+            break;
+        list_add_tail((list_head_t *)easy_phy2linear(addr), &pcp->list);
+        pcp->count++;
+    }
+    spin_unlock(&mm.page_lock);
+    pcp->refill++;
+}
+
+/// @brief 从cold端批量归还n页到全局池
+static void pcp_drain(PER_CPU_PAGES *pcp, uint32_t n)
+{
+    spin_lock(&mm.page_lock);
+    while (n-- && pcp->count) {
+        list_head_t *node = pcp->list.prev;
+        list_del(node);
+        pcp->count--;
+        __free_page_4k_locked((uint64_t)easy_linear2phy(node));
+    }
+    spin_unlock(&mm.page_lock);
+    pcp->drain++;
+}
+
+/// @brief 引用计数为1的页交给本CPU缓存,缓存持有这一次引用
+/// @note 刚释放的页还在cache里, 放在hot端先被分配出去
+static void pcp_free_page(uint64_t addr)
+{
+    uint8_t intr = io_cli();
+    PER_CPU_PAGES *pcp = this_cpu_pcp();
+    list_add(easy_phy2linear(addr), &pcp->list);
+    pcp->free_hot++;
+    pcp->count++;
+    if (pcp->count > pcp->high)
+        pcp_drain(pcp, pcp->batch);
+    io_set_intr(intr);
+}
+
+/// @return 一页, 本CPU缓存和全局池都空了返回0
+static uint64_t __alloc_page_4k(void)
+{
+    uint64_t ret;
+    if (!mm.pcp_enabled) {
+        uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+        ret = __alloc_page_4k_locked();
+        spin_unlock(&mm.page_lock);
+        io_set_intr(intr);
+        return ret;
+    }
+    uint8_t intr = io_cli();
+    PER_CPU_PAGES *pcp = this_cpu_pcp();
+    list_head_t *node;
+    if (list_empty(&pcp->list)) {
+        pcp->alloc_miss++;
+        pcp_refill(pcp);
+        if (list_empty(&pcp->list)) {
+            // 最后动用预清零的页
+            if (list_empty(&pcp->zero_list)) {
+                io_set_intr(intr);
+                return 0;
             }
+            node = pcp->zero_list.next;
+            list_del(node);
+            pcp->zero_count--;
+            io_set_intr(intr);
+            return (uint64_t)easy_linear2phy(node);
         }
+    } else {
+        pcp->alloc_hit++;
     }
-    return 0;
+    node = pcp->list.next;
+    list_del(node);
+    pcp->count--;
+    io_set_intr(intr);
+    return (uint64_t)easy_linear2phy(node);
 }
 
-uint64_t alloc_n_pages_4k(uint32_t n){
-    spin_lock(&mm.lock);
-    uint64_t phy_addr = __alloc_n_pages_4k_locked(n);
-    spin_unlock(&mm.lock);
-    return phy_addr;
+/**
+ * @brief 取一页, 空闲页不足时唤醒kswapd, 取不到时先直接回收再重试
+ * @return 物理地址, 回收之后仍然没有空闲页返回0
+ */
+uint64_t alloc_page_4k(void)
+{
+    uint64_t ret = __alloc_page_4k();
+    if (mm.tfpp < mm.wmark_low)
+        wakeup_kswapd();
+    for (int i = 0; !ret && i < RECLAIM_DIRECT_RETRIES && reclaim_direct(); i++)
+        ret = __alloc_page_4k();
+    if (!ret)
+        reclaim_alloc_failed();
+    return ret;
 }
 
-void free_n_pages_4k(uint32_t n, uint64_t addr)
+/// @brief 只从本CPU的预清零池取页, 池空时返回0而不是现场清零
+uint64_t try_alloc_zeroed_page_4k(void)
 {
-    if (addr & 0xfff) {
-        halt();
+    if (!mm.pcp_enabled)
+        return 0;
+    uint8_t intr = io_cli();
+    PER_CPU_PAGES *pcp = this_cpu_pcp();
+    if (list_empty(&pcp->zero_list)) {
+        io_set_intr(intr);
+        return 0;
+    }
+    list_head_t *node = pcp->zero_list.next;
+    list_del(node);
+    pcp->zero_count--;
+    pcp->zero_hit++;
+    io_set_intr(intr);
+    memset(node, 0, sizeof(list_head_t));
+    return (uint64_t)easy_linear2phy(node);
+}
+
+/// @brief 取一个内容全为0的页, 优先用idle预先清零的页
+uint64_t alloc_zeroed_page_4k(void)
+{
+    uint64_t ret = try_alloc_zeroed_page_4k();
+    if (ret)
+        return ret;
+    if (mm.pcp_enabled) {
+        uint8_t intr = io_cli();
+        this_cpu_pcp()->zero_miss++;
+        io_set_intr(intr);
     }
+    ret = alloc_page_4k();
+    if (ret)
+        memset(easy_phy2linear(ret), 0, 4096);
+    return ret;
+}
+
+/**
+ * @brief 在idle中清零一页放入本CPU的预清零池
+ * @note 清零时开中断, 不影响调度延迟
+ * @return 池未满且拿到了空闲页时返回true
+ */
+bool page_zero_idle_fill(void)
+{
+    if (!mm.pcp_enabled)
+        return false;
+    uint8_t intr = io_cli();
+    PER_CPU_PAGES *pcp = this_cpu_pcp();
+    if (pcp->zero_count >= pcp->zero_high) {
+        io_set_intr(intr);
+        return false;
+    }
+    if (list_empty(&pcp->list))
+        pcp_refill(pcp);
+    if (list_empty(&pcp->list)) {
+        io_set_intr(intr);
+        return false;
+    }
+    list_head_t *node = pcp->list.prev;     // 用cold页, hot页留给普通分配
+    list_del(node);
+    pcp->count--;
+    io_set_intr(intr);
+
+    memset(node, 0, 4096);
+
+    intr = io_cli();
+    pcp = this_cpu_pcp();
+    list_add(node, &pcp->zero_list);
+    pcp->zero_count++;
+    pcp->zero_filled++;
+    io_set_intr(intr);
+    return true;
+}
+
+/**
+ * @brief 取n个物理连续的页, 每页引用计数为1
+ * @note 从buddy取2^order的块, 多出的尾部立即按对齐块放回
+ * @return 正常的话返回获取到的地址，没有找到就返回0
+ */
+static uint64_t __alloc_n_pages_4k_locked(uint32_t n, uint32_t node)
+{
     if (n == 0)
-        return;
-    spin_lock(&mm.lock);
+        return 0;
+    uint32_t order = 0;
+    while ((1U << order) < n)
+        order++;
+    uint64_t ret = __buddy_alloc_node_locked(order, node);
+    if (!ret)
+        return 0;
+    __buddy_free_range_locked(ret + ((uint64_t)n << 12), ret + ((uint64_t)1 << (order + 12)));
     for (uint32_t i = 0; i < n; i++)
-        decrease_reference_page_4k(addr + (i << 12));
-    spin_unlock(&mm.lock);
+        phys_to_page(ret)[i].refcount = 1;
+    return ret;
+}
+
+/// @brief 优先从node取n个物理连续的页, 不够时按距离退到别的节点
+uint64_t alloc_n_pages_4k_node(uint32_t n, uint32_t node)
+{
+    uint64_t phy_addr;
+    for (int i = 0; ; i++) {
+        uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+        phy_addr = __alloc_n_pages_4k_locked(n, node);
+        spin_unlock(&mm.page_lock);
+        io_set_intr(intr);
+        if (phy_addr || i >= RECLAIM_DIRECT_RETRIES || !reclaim_direct())
+            break;
+    }
+    if (mm.tfpp < mm.wmark_low)
+        wakeup_kswapd();
+    if (!phy_addr)
+        reclaim_alloc_failed();
+    return phy_addr;
+}
+
+uint64_t alloc_n_pages_4k(uint32_t n){
+    return alloc_n_pages_4k_node(n, numa_node_id());
 }
 
-uint8_t decrease_reference_page_4k(uint64_t addr)
+uint32_t decrease_reference_page_4k(uint64_t addr)
 {
     if (addr >= mm.hpa)
         halt();
-    uint64_t index = addr >> 12;
-    if (_mrt_start[index] == 0xff || !_mrt_start[index])
+    if (addr == mm.zero_page) {
+        __atomic_sub_fetch(&mm.zero_page_refs, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    page_t *page = phys_to_page(addr);
+    uint32_t old = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    while (1) {
+        if (old == PAGE_REF_RESERVED || !old)
+            halt();
+        if (old == 1)
+            break;
+        if (__atomic_compare_exchange_n(&page->refcount, &old, old - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return old - 1;
+    }
+    page->flags = 0;
+    page->private = 0;
+    /* 最后一个引用: 计数保持为1,由页缓存接管; 别的节点的页直接还给buddy, 不在本地循环使用 */
+    if (mm.pcp_enabled && page_to_node(addr) == numa_node_id()) {
+        pcp_free_page(addr);
+    } else {
+        uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+        __free_page_4k_locked(addr);
+        spin_unlock(&mm.page_lock);
+        io_set_intr(intr);
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放alloc_n_pages_4k取得的n个连续页
+ * @note 整段按对齐的块直接还给buddy, 与分配时放回的尾部重新合并成高阶块, 不经过页缓存;
+ * 还被别人引用的页只减引用, 把整段分成前后两段
+ */
+void free_n_pages_4k(uint32_t n, uint64_t addr)
+{
+    if ((addr & 0xfff) || addr + ((uint64_t)n << 12) > mm.hpa) {
         halt();
-    if (--_mrt_start[index] == 0) {
-        for (uint32_t i = 0; i < mm.npai; i++) {
-            if (addr >= pais[i].spa && addr < pais[i].epa) {
-                if (pais[i].fpp)
-                    pais[i].nfpa = (pais[i].nfpa < addr) ? pais[i].nfpa : addr;
-                else
-                    pais[i].nfpa = addr;
-                pais[i].fpp++;
-                return 0;
-            }
+    }
+    page_t *page = phys_to_page(addr);
+    uint64_t start = addr;
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t cur = addr + ((uint64_t)i << 12);
+        uint32_t old = __atomic_load_n(&page[i].refcount, __ATOMIC_RELAXED);
+        while (1) {
+            if (old == PAGE_REF_RESERVED || !old)
+                halt();
+            if (old == 1)
+                break;
+            if (__atomic_compare_exchange_n(&page[i].refcount, &old, old - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
         }
-        halt();
-    } else
-        return _mrt_start[index];
+        if (old == 1) {
+            page[i].refcount = 0;
+            page[i].flags = 0;
+            page[i].private = 0;
+            continue;
+        }
+        __buddy_free_range_locked(start, cur);
+        start = cur + 4096;
+    }
+    __buddy_free_range_locked(start, addr + ((uint64_t)n << 12));
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
 }
 
 uint8_t add_reference_page_4k(uint64_t addr)
 {
-    uint64_t index = addr >> 12;
-    if (_mrt_start[index] == 0xff || !_mrt_start[index]) {
-        halt();
-    } else if (_mrt_start[index] == 0xfe)
-        return 1;
-    else {
-        _mrt_start[index]++;
+    if (addr == mm.zero_page) {
+        __atomic_add_fetch(&mm.zero_page_refs, 1, __ATOMIC_RELAXED);
         return 0;
     }
+    page_t *page = phys_to_page(addr);
+    uint32_t old = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    while (1) {
+        if (old == PAGE_REF_RESERVED || !old)
+            halt();
+        if (old == PAGE_REF_MAX)
+            return 1;
+        if (__atomic_compare_exchange_n(&page->refcount, &old, old + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return 0;
+    }
+}
+
+/**
+ * @brief 取一个2M对齐的大页
+ * @note 512页的引用计数都置为1以免被当作空闲页, 共享计数只用首页
+ * @return 物理地址, 没有足够的连续内存时返回0
+ */
+uint64_t alloc_huge_page_2m(void)
+{
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    uint64_t ret = __buddy_alloc_locked(HUGE_PAGE_ORDER);
+    if (ret) {
+        page_t *page = phys_to_page(ret);
+        for (uint32_t i = 0; i < (1U << HUGE_PAGE_ORDER); i++)
+            page[i].refcount = 1;
+        page->flags = PG_HUGE;
+        mm.huge_alloc++;
+    }
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
+    // 失败时调用者会退回4K页, 这里只唤醒kswapd
+    if (mm.tfpp < mm.wmark_low)
+        wakeup_kswapd();
+    return ret;
+}
+
+/// @brief 减少大页的引用, 最后一个引用时整块还给buddy
+void put_huge_page_2m(uint64_t addr)
+{
+    if ((addr & (HUGE_PAGE_SIZE - 1)) || addr >= mm.hpa)
+        halt();
+    page_t *page = phys_to_page(addr);
+    uint32_t old = __atomic_load_n(&page->refcount, __ATOMIC_RELAXED);
+    while (1) {
+        if (old == PAGE_REF_RESERVED || !old)
+            halt();
+        if (old == 1)
+            break;
+        if (__atomic_compare_exchange_n(&page->refcount, &old, old - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return;
+    }
+    page->flags = 0;
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    for (uint32_t i = 0; i < (1U << HUGE_PAGE_ORDER); i++)
+        page[i].refcount = 0;
+    __buddy_free_locked(addr, HUGE_PAGE_ORDER);
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
+}
+
+/// @brief 汇总所有CPU的页缓存计数,用于调整batch/high
+void page_pcp_stat(PCP_STAT *stat)
+{
+    memset(stat, 0, sizeof(PCP_STAT));
+    if (!mm.pcp_enabled)
+        return;
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        PER_CPU_PAGES *pcp = &cpus->items[i].pcp;
+        stat->alloc_hit += pcp->alloc_hit;
+        stat->alloc_miss += pcp->alloc_miss;
+        stat->refill += pcp->refill;
+        stat->drain += pcp->drain;
+        stat->free_hot += pcp->free_hot;
+        stat->cached += pcp->count;
+        stat->zero_hit += pcp->zero_hit;
+        stat->zero_miss += pcp->zero_miss;
+        stat->zero_filled += pcp->zero_filled;
+        stat->zeroed += pcp->zero_count;
+    }
+}
+
+/// @brief 调整所有CPU页缓存的批量与水位, 超出的页在下一次释放时归还
+void page_pcp_tune(uint32_t batch, uint32_t high)
+{
+    if (!batch || high < batch)
+        return;
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        cpus->items[i].pcp.batch = batch;
+        cpus->items[i].pcp.high = high;
+    }
 }
 
-/// @param type: 0 for kernel 1 for user4k other for out difined
-void __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type, uint64_t usr_define)
+/// @param type: 0 for kernel 1 for user4k 2 for user cow 3 for user shared 4 for user readonly other for out difined
+/// @return 0 成功, -1 取不到中间级页表, 此时没有建立映射
+int __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type, uint64_t usr_define)
 {
     if (vir_addr & 0xfff) {
         halt();
@@ -230,6 +583,12 @@ void __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_
     } else if (type == 2){
         dir_type = PAGE_USER_DIR;
         item_type = PAGE_USER_4K_COPY_ON_WRITE;
+    } else if (type == 3){
+        dir_type = PAGE_USER_DIR;
+        item_type = PAGE_USER_4K_SHARED;
+    } else if (type == 4){
+        dir_type = PAGE_USER_DIR;
+        item_type = PAGE_USER_4K_READONLY;
     } else{
         item_type = (uint16_t)usr_define;
         dir_type = PAGE_KERNEL_DIR;
@@ -250,10 +609,11 @@ void __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_
             }
             ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
         } else {
-            uint64_t temp = alloc_page_4k();
+            uint64_t temp = alloc_table_page();
+            if (!temp)
+                return -1;
             ptable[layer[i]] = temp | dir_type;
             ptable = easy_phy2linear(temp);
-            memset((void*)ptable, 0, 4096);
         }
     }
     if (ptable[layer[3]] & PAGE_PRESENT) {
@@ -261,12 +621,29 @@ void __put_page_4k_locked(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_
     }
     ptable[layer[3]] = phy_addr | item_type;
     invlpg_tlb(vir_addr);
+    return 0;
 }
 
-void put_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type){
+/// @return 0 成功, -1 内存不足, 页仍归调用者所有
+int put_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type){
     spin_lock(&mm.lock);
-    __put_page_4k_locked(phy_addr,vir_addr,ptable_vir,type,0);
+    int ret = __put_page_4k_locked(phy_addr,vir_addr,ptable_vir,type,0);
     spin_unlock(&mm.lock);
+    return ret;
+}
+
+/// @brief 把零页以写时复制方式映射到用户地址, 写缺页时再换成私有页
+/// @return 0 成功, -1 内存不足
+int put_zero_page_4k(uint64_t vir_addr, uint64_t ptable_vir)
+{
+    spin_lock(&mm.lock);
+    int ret = __put_page_4k_locked(mm.zero_page, vir_addr, ptable_vir, 2, 0);
+    if (!ret) {
+        __atomic_add_fetch(&mm.zero_page_map, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mm.zero_page_refs, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&mm.lock);
+    return ret;
 }
 
 int exist_page_4k(uint64_t vir_addr, uint64_t ptable_vir) {
@@ -327,6 +704,30 @@ void rm_page_4k(uint64_t vir_addr, uint64_t ptable_vir)
     invlpg_tlb(vir_addr);
 }
 
+/**
+ * @brief 清掉内核地址的4K映射, 不刷TLB, 由调用者批量shootdown之后再释放页
+ * @return 原来映射的物理地址, 没有映射时返回0
+ */
+uint64_t __unmap_kernel_page_locked(uint64_t vir_addr)
+{
+    uint64_t *ptable = vir_ptable4;
+    uint32_t layer[4];
+    layer[0] = ((uint64_t)easy_linear2phy(vir_addr) >> TABLE_LEVEL_1_BITS) + 256;
+    layer[1] = (vir_addr >> TABLE_LEVEL_2_BITS) & 0x1FF;
+    layer[2] = (vir_addr >> TABLE_LEVEL_3_BITS) & 0x1FF;
+    layer[3] = (vir_addr >> TABLE_LEVEL_4_BITS) & 0x1FF;
+    for (int i = 0; i < 3; i++) {
+        if (!(ptable[layer[i]] & PAGE_PRESENT) || (ptable[layer[i]] & PAGE_BIG_ENTRY))
+            return 0;
+        ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
+    }
+    uint64_t entry = ptable[layer[3]];
+    if (!(entry & PAGE_PRESENT))
+        return 0;
+    ptable[layer[3]] = 0;
+    return entry & 0x000ffffffffff000;
+}
+
 void put_page_2M(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir)
 {
     if ((vir_addr & 0x1fffff) || (phy_addr & 0x1fffff)) {
@@ -347,8 +748,10 @@ void put_page_2M(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir)
             }
             ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
         } else {
-            uint64_t temp = alloc_page_4k();
-            memset((void*)easy_phy2linear(temp), 0, 4096);
+            // 只在启动时建立直接映射, 这时没有内存就无法继续
+            uint64_t temp = alloc_table_page();
+            if (!temp)
+                halt();
             ptable[layer[i]] = temp | PAGE_KERNEL_DIR;
             ptable = easy_phy2linear(temp);
         }
@@ -357,6 +760,45 @@ void put_page_2M(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir)
     invlpg_tlb(vir_addr);
 }
 
+/**
+ * @brief 在用户页表中映射一个可写的2M大页
+ * @return 0 成功, -1 该2M范围内已经有4K页表或者取不到页表
+ */
+int put_user_page_2m(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir)
+{
+    if ((vir_addr & (HUGE_PAGE_SIZE - 1)) || (phy_addr & (HUGE_PAGE_SIZE - 1)) || vir_addr >= VIRTUAL_ADDR_0)
+        halt();
+    spin_lock(&mm.lock);
+    uint64_t *ptable = (void *)ptable_vir;
+    uint32_t layer[3];
+    layer[0] = vir_addr >> TABLE_LEVEL_1_BITS;
+    layer[1] = (vir_addr >> TABLE_LEVEL_2_BITS) & 0x1FF;
+    layer[2] = (vir_addr >> TABLE_LEVEL_3_BITS) & 0x1FF;
+    for (int i = 0; i < 2; i++) {
+        if (ptable[layer[i]] & PAGE_PRESENT) {
+            if (ptable[layer[i]] & PAGE_BIG_ENTRY)
+                halt();
+            ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
+        } else {
+            uint64_t temp = alloc_zeroed_page_4k();
+            if (!temp) {
+                spin_unlock(&mm.lock);
+                return -1;
+            }
+            ptable[layer[i]] = temp | PAGE_USER_DIR;
+            ptable = easy_phy2linear(temp);
+        }
+    }
+    if (ptable[layer[2]] & PAGE_PRESENT) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    ptable[layer[2]] = phy_addr | PAGE_USER_2M;
+    spin_unlock(&mm.lock);
+    invlpg_tlb(vir_addr);
+    return 0;
+}
+
 static void free_pagetable_level(uint64_t table_vir, int level) {
     uint64_t* table = (uint64_t*)table_vir;
     for (int i = 0; i < 512; i++) {
@@ -364,12 +806,16 @@ static void free_pagetable_level(uint64_t table_vir, int level) {
             uint64_t next_phy = table[i] & 0xfffffffffffff000;
             uint64_t next_vir = (uint64_t)easy_phy2linear(next_phy);
 
-            if (level < 3) {
+            if (level == 2 && (table[i] & PAGE_BIG_ENTRY)) {
+                put_huge_page_2m(table[i] & 0x000fffffffe00000);
+            } else if (level < 3) {
                 free_pagetable_level(next_vir, level + 1);
                 kfree((void*)next_vir);
             } else {
                 kfree((void*)next_vir);
             }
+        } else if (level == 3 && is_swap_pte(table[i]) && swap_pte_slot(table[i])) {
+            swap_free(swap_pte_slot(table[i]));
         }
     }
 }
@@ -379,6 +825,8 @@ void free_ptable_and_mem(uint64_t pml4_vir) {
         halt();
     if (pml4_vir == (uint64_t)vir_ptable4)
         return;
+    // 还装载着这张页表的CPU(懒惰运行内核线程的)先切走
+    tlb_shootdown(pml4_vir, 0, TLB_FLUSH_ALL, TLB_FREED_TABLES);
     uint64_t* pml4 = (uint64_t*)pml4_vir;
     for (int i = 0; i < 256; i++) {
         if (pml4[i] & PAGE_PRESENT) {
@@ -392,51 +840,139 @@ void free_ptable_and_mem(uint64_t pml4_vir) {
     kfree((void *)pml4_vir);
 }
 
-static void copy_user_pagetable(uint64_t *src_pt, uint64_t *dst_pt, int level) {
+/**
+ * @brief 把2M大页复制成512个私有的4K页
+ * @return 新的最后一级页表的物理地址, 内存不足时返回0
+ */
+static uint64_t copy_huge_to_4k(uint64_t src_phy, uint64_t flags)
+{
+    uint64_t pt_phy = alloc_zeroed_page_4k();
+    if (!pt_phy)
+        return 0;
+    uint64_t *pt = easy_phy2linear(pt_phy);
+    for (int i = 0; i < PAGE_ENTRY_NUMBER; i++) {
+        uint64_t phy = alloc_page_4k();
+        if (!phy) {
+            for (int j = 0; j < i; j++)
+                decrease_reference_page_4k(pt[j] & 0xfffffffffffff000);
+            decrease_reference_page_4k(pt_phy);
+            return 0;
+        }
+        memcpy(easy_phy2linear(phy), easy_phy2linear(src_phy + ((uint64_t)i << 12)), 4096);
+        pt[i] = phy | flags;
+    }
+    mm.huge_split++;
+    return pt_phy;
+}
+
+/**
+ * @brief fork时共享大页, 可写的大页在双方都改为写时复制
+ * @note 引用计数饱和时复制一份, 没有连续内存时退回512个4K页
+ * @return 0 成功, -1 连4K页也取不到
+ */
+static int copy_user_huge_pde(uint64_t *src_pde, uint64_t *dst_pde)
+{
+    uint64_t src = *src_pde;
+    uint64_t src_phy = src & 0x000fffffffe00000;
+    if (!add_reference_page_4k(src_phy)) {
+        if (src & PAGE_WRITABLE) {
+            src = (src & ~PAGE_WRITABLE) | PAGE_COW;
+            *src_pde = src;
+        }
+        *dst_pde = src;
+        mm.cow_shared++;
+        return 0;
+    }
+    // 引用计数饱和, 退回到复制
+    uint64_t new_phy = alloc_huge_page_2m();
+    if (new_phy) {
+        memcpy(easy_phy2linear(new_phy), easy_phy2linear(src_phy), HUGE_PAGE_SIZE);
+        *dst_pde = new_phy | (src & 0xfff);
+        return 0;
+    }
+    uint64_t pt_phy = copy_huge_to_4k(src_phy, (src & (PAGE_WRITABLE | PAGE_COW)) ? PAGE_USER_4K : PAGE_USER_4K_READONLY);
+    if (!pt_phy)
+        return -1;
+    *dst_pde = pt_phy | PAGE_USER_DIR;
+    return 0;
+}
+
+/**
+ * @note 失败时已经复制的表项保持完整, 目标页表可以直接交给free_ptable_and_mem
+ * @return 0 成功, -1 内存不足
+ */
+static int copy_user_pagetable(uint64_t *src_pt, uint64_t *dst_pt, int level) {
     // level: 1=PDPT, 2=PD, 3=PT
     for (int i = 0; i < 512; i++) {
         uint64_t src_pte = src_pt[i];
         if (!(src_pte & PAGE_PRESENT)){
-            dst_pt[i] = 0;
+            // 换出的页父子共用同一个slot
+            if (level == 3 && is_swap_pte(src_pte) && swap_pte_slot(src_pte)) {
+                swap_dup(swap_pte_slot(src_pte));
+                dst_pt[i] = src_pte;
+            } else {
+                dst_pt[i] = 0;
+            }
             continue;
         }
 
-        // 检查是否为大页（仅当 level < 3 时可能）
+        // 用户大页只出现在PD一级
         if (src_pte & PAGE_BIG_ENTRY) {
-            // 系统假设只使用4K页，遇到大页则停机
-            halt();
+            if (level != 2)
+                halt();
+            if (copy_user_huge_pde(&src_pt[i], &dst_pt[i]))
+                return -1;
+            continue;
         }
 
         if (level == 3) {
-            // 最后一级页表：复制物理页
+            // 最后一级页表：父子共享物理页, 可写页在双方都改为只读的写时复制页
             uint64_t src_phy = src_pte & 0xfffffffffffff000;
-            void *src_vir = easy_phy2linear(src_phy);
-            void *new_page = kmalloc(4096);
-            uint64_t new_phy = (uint64_t)easy_linear2phy(new_page);
-            memcpy(new_page, src_vir, 4096);
-            uint64_t flags = src_pte & 0xfff;          // 保留原权限位
-            dst_pt[i] = new_phy | flags;
+            if (add_reference_page_4k(src_phy)) {
+                // 引用计数饱和, 退回到直接复制
+                uint64_t new_phy = alloc_page_4k();
+                if (!new_phy)
+                    return -1;
+                memcpy(easy_phy2linear(new_phy), easy_phy2linear(src_phy), 4096);
+                uint64_t flags = src_pte & 0xfff;          // 保留原权限位
+                dst_pt[i] = new_phy | flags;
+                continue;
+            }
+            // 共享映射的页父子双方都继续可写
+            if ((src_pte & PAGE_WRITABLE) && !(src_pte & PAGE_SHARED_MAP)) {
+                src_pte = (src_pte & ~PAGE_WRITABLE) | PAGE_COW;
+                src_pt[i] = src_pte;
+            }
+            dst_pt[i] = src_pte;
+            mm.cow_shared++;
         } else {
             // 中间级页表：确保目标项存在，并递归下一级
             uint64_t src_next_phy = src_pte & 0xfffffffffffff000;
             void *src_next_vir = easy_phy2linear(src_next_phy);
 
             if (!(dst_pt[i] & PAGE_PRESENT)) {
-                void *new_table = kmalloc(4096);
-                uint64_t new_table_phy = (uint64_t)easy_linear2phy(new_table);
-                memset(new_table, 0, 4096);
+                uint64_t new_table_phy = alloc_table_page();
+                if (!new_table_phy)
+                    return -1;
                 uint64_t flags = src_pte & 0xfff;      // 保留原权限位
                 dst_pt[i] = new_table_phy | flags;
             }
 
             uint64_t dst_next_phy = dst_pt[i] & 0xfffffffffffff000;
             void *dst_next_vir = easy_phy2linear(dst_next_phy);
-            copy_user_pagetable((uint64_t*)src_next_vir, (uint64_t*)dst_next_vir, level + 1);
+            if (copy_user_pagetable((uint64_t*)src_next_vir, (uint64_t*)dst_next_vir, level + 1))
+                return -1;
         }
     }
+    return 0;
 }
 
-void copy_pagetable_and_mem(uint64_t dest, uint64_t source) {
+/**
+ * @brief fork时复制用户页表, 私有页改为父子共享的写时复制页
+ * @return 0 成功, -1 内存不足, 已经复制的部分留在dest里由调用者用free_ptable_and_mem释放
+ */
+int copy_pagetable_and_mem(uint64_t dest, uint64_t source) {
+    int ret = 0;
     // 1. 直接复制内核部分（后256项）
     memcpy((void*)(dest + 256 * 8), (void*)(source + 256 * 8), 256 * 8);
 
@@ -460,17 +996,454 @@ void copy_pagetable_and_mem(uint64_t dest, uint64_t source) {
 
         // 确保目标PML4项存在
         if (!(dst_pml4[i] & PAGE_PRESENT)) {
-            void *new_table = kmalloc(4096);
-            uint64_t new_table_phy = (uint64_t)easy_linear2phy(new_table);
-            memset(new_table, 0, 4096);
+            uint64_t new_table_phy = alloc_table_page();
+            if (!new_table_phy) {
+                ret = -1;
+                break;
+            }
             uint64_t flags = src_pte & 0xfff;          // 保留原权限位
             dst_pml4[i] = new_table_phy | flags;
         }
 
         uint64_t dst_next_phy = dst_pml4[i] & 0xfffffffffffff000;
         void *dst_next_vir = easy_phy2linear(dst_next_phy);
-        copy_user_pagetable((uint64_t*)src_next_vir, (uint64_t*)dst_next_vir, 1);
+        if (copy_user_pagetable((uint64_t*)src_next_vir, (uint64_t*)dst_next_vir, 1)) {
+            ret = -1;
+            break;
+        }
+    }
+    // 父进程的可写页已改为只读, 父进程就是当前进程; 失败时改过的也要刷掉
+    flush_tlb();
+    return ret;
+}
+
+/// @brief 找到用户地址的最后一级页表项, 中间级不存在时返回NULL
+/// @note 地址落在2M大页内时返回的是PD表项, 调用者需检查PAGE_BIG_ENTRY
+static uint64_t *__get_user_pte_locked(uint64_t vir_addr, uint64_t ptable_vir)
+{
+    uint64_t *ptable = (uint64_t *)ptable_vir;
+    uint32_t layer[4];
+    layer[0] = (vir_addr >> TABLE_LEVEL_1_BITS) & 0x1FF;
+    layer[1] = (vir_addr >> TABLE_LEVEL_2_BITS) & 0x1FF;
+    layer[2] = (vir_addr >> TABLE_LEVEL_3_BITS) & 0x1FF;
+    layer[3] = (vir_addr >> TABLE_LEVEL_4_BITS) & 0x1FF;
+    for (int i = 0; i < 3; i++) {
+        if (!(ptable[layer[i]] & PAGE_PRESENT))
+            return NULL;
+        if (ptable[layer[i]] & PAGE_BIG_ENTRY)
+            return i == 2 ? &ptable[layer[i]] : NULL;
+        ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
+    }
+    return &ptable[layer[3]];
+}
+
+/**
+ * @brief 用户地址的表项为空时才映射, 缺页预映射用
+ * @note 已经映射的、换出的和落在大页里的位置都不动, 映射零页时按写时复制映射
+ * @return 0 已映射, -1 位置已被占用或者取不到页表
+ */
+int try_put_user_page_4k(uint64_t phy_addr, uint64_t vir_addr, uint64_t ptable_vir, uint8_t type)
+{
+    spin_lock(&mm.lock);
+    uint64_t *pte = __get_user_pte_locked(vir_addr, ptable_vir);
+    if (pte && *pte) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    if (phy_addr == mm.zero_page)
+        type = 2;
+    if (__put_page_4k_locked(phy_addr, vir_addr, ptable_vir, type, 0)) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    if (phy_addr == mm.zero_page) {
+        __atomic_add_fetch(&mm.zero_page_map, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mm.zero_page_refs, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&mm.lock);
+    return 0;
+}
+
+typedef void (*user_entry_fn)(uint64_t *entry, bool huge, void *arg);
+
+/**
+ * @brief 把部分覆盖的大页拆成4K页, 保留原来的权限位
+ * @note 只有本进程在用的大页直接把自己的512个页框填进一张新页表, 不复制;
+ * fork后与别的进程共享的大页只能复制一份私有的
+ * @return 0 成功, -1 内存不足
+ */
+static int __split_huge_pde_locked(uint64_t *pde)
+{
+    uint64_t old_phy = *pde & 0x000fffffffe00000;
+    uint64_t flags = *pde & 0xfff & ~PAGE_BIG_ENTRY;
+    page_t *page = phys_to_page(old_phy);
+    if (__atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) != 1) {
+        uint64_t pt_phy = copy_huge_to_4k(old_phy, flags);
+        if (!pt_phy)
+            return -1;
+        *pde = pt_phy | PAGE_USER_DIR;
+        put_huge_page_2m(old_phy);
+        return 0;
+    }
+    uint64_t pt_phy = alloc_zeroed_page_4k();
+    if (!pt_phy)
+        return -1;
+    uint64_t *pt = easy_phy2linear(pt_phy);
+    for (int i = 0; i < PAGE_ENTRY_NUMBER; i++)
+        pt[i] = (old_phy + ((uint64_t)i << 12)) | flags;
+    // 每页的引用计数在分配大页时都已置1, 去掉大页标记后就是512个独立的4K页, 可以逐页释放
+    page->flags = 0;
+    *pde = pt_phy | PAGE_USER_DIR;
+    mm.huge_split++;
+    return 0;
+}
+
+/**
+ * @brief 对用户地址[start, end)内已映射的每个表项调用fn
+ * @note 整个落在范围内的大页按一个表项处理, 部分覆盖的先拆开; 换出的4K表项也会交给fn
+ * @return 0 成功, -1 拆大页时内存不足, 这之前的表项已经处理过
+ */
+static int __walk_user_range_locked(uint64_t ptable_vir, uint64_t start, uint64_t end,
+                                     user_entry_fn fn, void *arg)
+{
+    uint64_t addr = start;
+    while (addr < end) {
+        uint64_t *ptable = (uint64_t *)ptable_vir;
+        uint64_t entry = ptable[(addr >> TABLE_LEVEL_1_BITS) & 0x1FF];
+        if (!(entry & PAGE_PRESENT)) {
+            addr = (addr | ((1UL << TABLE_LEVEL_1_BITS) - 1)) + 1;
+            continue;
+        }
+        ptable = easy_phy2linear(entry & 0x000ffffffffff000);
+        entry = ptable[(addr >> TABLE_LEVEL_2_BITS) & 0x1FF];
+        if (!(entry & PAGE_PRESENT)) {
+            addr = (addr | ((1UL << TABLE_LEVEL_2_BITS) - 1)) + 1;
+            continue;
+        }
+        ptable = easy_phy2linear(entry & 0x000ffffffffff000);
+        uint64_t *pde = &ptable[(addr >> TABLE_LEVEL_3_BITS) & 0x1FF];
+        uint64_t next = (addr | (HUGE_PAGE_SIZE - 1)) + 1;
+        if (!(*pde & PAGE_PRESENT)) {
+            addr = next;
+            continue;
+        }
+        if (*pde & PAGE_BIG_ENTRY) {
+            if (!(addr & (HUGE_PAGE_SIZE - 1)) && next <= end) {
+                fn(pde, true, arg);
+                addr = next;
+                continue;
+            }
+            if (__split_huge_pde_locked(pde))
+                return -1;
+        }
+        uint64_t *pt = easy_phy2linear(*pde & 0x000ffffffffff000);
+        uint64_t stop = next < end ? next : end;
+        for (; addr < stop; addr += 4096) {
+            uint64_t *pte = &pt[(addr >> TABLE_LEVEL_4_BITS) & 0x1FF];
+            if ((*pte & PAGE_PRESENT) || is_swap_pte(*pte))
+                fn(pte, false, arg);
+        }
+    }
+    return 0;
+}
+
+static void unmap_entry(uint64_t *entry, bool huge, void *arg)
+{
+    (void)arg;
+    if (huge)
+        put_huge_page_2m(*entry & 0x000fffffffe00000);
+    else if (!is_swap_pte(*entry))
+        decrease_reference_page_4k(*entry & 0x000ffffffffff000);
+    else if (swap_pte_slot(*entry))
+        swap_free(swap_pte_slot(*entry));
+    // slot为0的页还在换出的一方手里, 由它释放
+    *entry = 0;
+}
+
+/// @brief 拆开addr所在且只有一部分落在[start, end)内的大页
+static int __split_edge_huge_locked(uint64_t ptable_vir, uint64_t addr, uint64_t start, uint64_t end)
+{
+    uint64_t *pde = __get_user_pte_locked(addr, ptable_vir);
+    if (!pde || !(*pde & PAGE_PRESENT) || !(*pde & PAGE_BIG_ENTRY))
+        return 0;
+    uint64_t base = addr & ~(HUGE_PAGE_SIZE - 1);
+    if (base >= start && base + HUGE_PAGE_SIZE <= end)
+        return 0;
+    return __split_huge_pde_locked(pde);
+}
+
+/**
+ * @brief 解除用户地址[start, end)的映射并释放其中的页
+ * @note 部分覆盖的大页只会在两端, 先拆开它们再释放, 失败时范围内的页都没动过
+ * @return 0 成功, -1 内存不足, 没法拆开部分覆盖的大页
+ */
+int unmap_user_range(uint64_t ptable_vir, uint64_t start, uint64_t end)
+{
+    if (start >= end)
+        return 0;
+    spin_lock(&mm.lock);
+    if (__split_edge_huge_locked(ptable_vir, start, start, end) ||
+        __split_edge_huge_locked(ptable_vir, end - 1, start, end)) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    int ret = __walk_user_range_locked(ptable_vir, start, end, unmap_entry, NULL);
+    spin_unlock(&mm.lock);
+    tlb_shootdown(ptable_vir, start, end, 0);
+    return ret;
+}
+
+static void protect_entry(uint64_t *entry, bool huge, void *arg)
+{
+    (void)huge;
+    uint32_t prot = *(uint32_t *)arg;
+    uint64_t e = *entry;
+    if (prot & USER_PROT_ACCESS)
+        e |= PAGE_USER_MODE;
+    else
+        e &= ~PAGE_USER_MODE;
+    if (!(prot & USER_PROT_WRITE)) {
+        e &= ~(PAGE_WRITABLE | PAGE_COW);
+    } else if (!(e & PAGE_WRITABLE)) {
+        // 私有页交给写时复制判断: 只剩一个引用时直接恢复可写
+        if (e & PAGE_SHARED_MAP)
+            e |= PAGE_WRITABLE;
+        else
+            e |= PAGE_COW;
     }
+    *entry = e;
+}
+
+/**
+ * @brief 修改用户地址[start, end)内已映射页的权限
+ * @param prot USER_PROT_ACCESS与USER_PROT_WRITE的组合
+ * @return 0 成功, -1 内存不足, 没法拆开部分覆盖的大页
+ */
+int protect_user_range(uint64_t ptable_vir, uint64_t start, uint64_t end, uint32_t prot)
+{
+    spin_lock(&mm.lock);
+    int ret = __walk_user_range_locked(ptable_vir, start, end, protect_entry, &prot);
+    spin_unlock(&mm.lock);
+    tlb_shootdown(ptable_vir, start, end, 0);
+    return ret;
+}
+
+/**
+ * @brief 处理对写时复制大页的写缺页
+ * @note 没有连续的2M时拆成512个私有4K页
+ */
+static int __do_huge_cow_fault_locked(uint64_t *pde)
+{
+    uint64_t old_phy = *pde & 0x000fffffffe00000;
+    uint64_t flags = ((*pde & 0xfff) & ~PAGE_COW) | PAGE_WRITABLE;
+    if (__atomic_load_n(&phys_to_page(old_phy)->refcount, __ATOMIC_ACQUIRE) == 1) {
+        *pde = old_phy | flags;
+        mm.cow_reused++;
+        return 0;
+    }
+    uint64_t new_phy = alloc_huge_page_2m();
+    if (new_phy) {
+        memcpy(easy_phy2linear(new_phy), easy_phy2linear(old_phy), HUGE_PAGE_SIZE);
+        *pde = new_phy | flags;
+    } else {
+        uint64_t pt_phy = copy_huge_to_4k(old_phy, PAGE_USER_4K);
+        if (!pt_phy)
+            return -1;
+        *pde = pt_phy | PAGE_USER_DIR;
+        mm.huge_fallback++;
+    }
+    put_huge_page_2m(old_phy);
+    mm.cow_copied++;
+    return 0;
+}
+
+/**
+ * @brief 处理对写时复制页的写缺页
+ * @note 页只剩一个引用时直接恢复可写, 否则复制一份私有页
+ * @return 0 已处理, -1 不是写时复制页
+ */
+int do_cow_fault(uint64_t vir_addr, uint64_t ptable_vir)
+{
+    vir_addr &= 0xfffffffffffff000;
+    if (vir_addr >= VIRTUAL_ADDR_0)
+        return -1;
+    spin_lock(&mm.lock);
+    uint64_t *pte = __get_user_pte_locked(vir_addr, ptable_vir);
+    // 用户位被mprotect(PROT_NONE)清掉的页不能写
+    if (!pte || !(*pte & PAGE_PRESENT) || !(*pte & PAGE_USER_MODE)) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    if (*pte & PAGE_WRITABLE) {
+        // 已经被处理过, 只是TLB里还是旧的只读表项
+        spin_unlock(&mm.lock);
+        invlpg_tlb(vir_addr);
+        return 0;
+    }
+    if (!(*pte & PAGE_COW)) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    if (*pte & PAGE_BIG_ENTRY) {
+        int ret = __do_huge_cow_fault_locked(pte);
+        spin_unlock(&mm.lock);
+        if (ret)
+            return -1;
+        invlpg_tlb(vir_addr);
+        return 0;
+    }
+    uint64_t old_phy = *pte & 0xfffffffffffff000;
+    uint64_t flags = ((*pte & 0xfff) & ~PAGE_COW) | PAGE_WRITABLE;
+    if (old_phy == mm.zero_page) {
+        uint64_t new_phy = alloc_zeroed_page_4k();
+        if (!new_phy) {
+            spin_unlock(&mm.lock);
+            return -1;
+        }
+        *pte = new_phy | flags;
+        __atomic_add_fetch(&mm.zero_page_cow, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mm.zero_page_refs, 1, __ATOMIC_RELAXED);
+    } else if (__atomic_load_n(&phys_to_page(old_phy)->refcount, __ATOMIC_ACQUIRE) == 1) {
+        *pte = old_phy | flags;
+        mm.cow_reused++;
+    } else {
+        uint64_t new_phy = alloc_page_4k();
+        if (!new_phy) {
+            spin_unlock(&mm.lock);
+            return -1;
+        }
+        memcpy(easy_phy2linear(new_phy), easy_phy2linear(old_phy), 4096);
+        *pte = new_phy | flags;
+        decrease_reference_page_4k(old_phy);
+        mm.cow_copied++;
+    }
+    spin_unlock(&mm.lock);
+    invlpg_tlb(vir_addr);
+    return 0;
+}
+
+/**
+ * @brief 从*cursor开始找冷的私有匿名4K页, 把表项改成slot为0的换出表项
+ * @note 访问位置位的页清掉访问位放过这一轮; 大页, 共享页, 零页和还有其它引用的页不换出
+ * @param scan 每检查一个已映射的表项减一
+ * @return 隔离出来的页数, 调用者刷掉TLB之后才能读页的内容
+ */
+uint32_t swap_isolate_user_pages(uint64_t ptable_vir, uint64_t *cursor, uint64_t *scan,
+                                 SWAP_CANDIDATE *out, uint32_t n)
+{
+    uint32_t nr = 0;
+    uint64_t addr = *cursor;
+    spin_lock(&mm.lock);
+    while (addr < VIRTUAL_ADDR_USER_HIGHEST && nr < n && *scan) {
+        uint64_t *ptable = (uint64_t *)ptable_vir;
+        uint64_t entry = ptable[(addr >> TABLE_LEVEL_1_BITS) & 0x1FF];
+        if (!(entry & PAGE_PRESENT)) {
+            addr = (addr | ((1UL << TABLE_LEVEL_1_BITS) - 1)) + 1;
+            continue;
+        }
+        ptable = easy_phy2linear(entry & 0x000ffffffffff000);
+        entry = ptable[(addr >> TABLE_LEVEL_2_BITS) & 0x1FF];
+        if (!(entry & PAGE_PRESENT)) {
+            addr = (addr | ((1UL << TABLE_LEVEL_2_BITS) - 1)) + 1;
+            continue;
+        }
+        ptable = easy_phy2linear(entry & 0x000ffffffffff000);
+        entry = ptable[(addr >> TABLE_LEVEL_3_BITS) & 0x1FF];
+        uint64_t next = (addr | (HUGE_PAGE_SIZE - 1)) + 1;
+        if (!(entry & PAGE_PRESENT) || (entry & PAGE_BIG_ENTRY)) {
+            addr = next;
+            continue;
+        }
+        uint64_t *pt = easy_phy2linear(entry & 0x000ffffffffff000);
+        for (; addr < next && nr < n && *scan; addr += 4096) {
+            uint64_t *pte = &pt[(addr >> TABLE_LEVEL_4_BITS) & 0x1FF];
+            uint64_t e = *pte;
+            if (!(e & PAGE_PRESENT))
+                continue;
+            (*scan)--;
+            uint64_t phy = e & 0x000ffffffffff000;
+            if ((e & PAGE_SHARED_MAP) || phy == mm.zero_page || phy >= mm.hpa)
+                continue;
+            page_t *page = phys_to_page(phy);
+            if (page->flags || __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) != 1)
+                continue;
+            if (e & PAGE_ACCESSED) {
+                *pte = e & ~PAGE_ACCESSED;
+                continue;
+            }
+            *pte = swap_pte(0, e);
+            out[nr].addr = addr;
+            out[nr].phy = phy;
+            nr++;
+        }
+    }
+    spin_unlock(&mm.lock);
+    *cursor = addr;
+    return nr;
+}
+
+/**
+ * @brief 结束一页的换出: slot非0时填进表项, 为0时恢复原来的映射
+ * @return 0 完成, -1 表项在换出期间被清掉了, 页和slot都要由调用者释放
+ */
+int swap_finish_user_page(uint64_t ptable_vir, SWAP_CANDIDATE *c, uint32_t slot)
+{
+    int ret = -1;
+    spin_lock(&mm.lock);
+    uint64_t *pte = __get_user_pte_locked(c->addr, ptable_vir);
+    if (pte && is_swap_pte(*pte) && !swap_pte_slot(*pte)) {
+        // 换出期间mprotect改过的权限位以表项里的为准
+        if (slot)
+            *pte = swap_pte(slot, *pte);
+        else
+            *pte = c->phy | (*pte & SWAP_PTE_FLAGS) | PAGE_PRESENT;
+        ret = 0;
+    }
+    spin_unlock(&mm.lock);
+    return ret;
+}
+
+/**
+ * @brief 处理对换出页的缺页: 解压到新页并恢复映射
+ * @return 0 已处理(页还在换出中时直接返回, 重新访问时再看), 1 不是换出表项, -1 内存不足或者数据损坏
+ */
+int swap_in_user_page(uint64_t vir_addr, uint64_t ptable_vir)
+{
+    uint64_t start = rdtsc();
+    vir_addr &= 0xfffffffffffff000;
+    if (vir_addr >= VIRTUAL_ADDR_USER_HIGHEST)
+        return 1;
+    spin_lock(&mm.lock);
+    uint64_t *pte = __get_user_pte_locked(vir_addr, ptable_vir);
+    if (!pte || !is_swap_pte(*pte)) {
+        spin_unlock(&mm.lock);
+        return 1;
+    }
+    uint32_t slot = swap_pte_slot(*pte);
+    if (!slot) {
+        spin_unlock(&mm.lock);
+        return 0;
+    }
+    uint64_t phy = alloc_page_4k();
+    if (!phy) {
+        spin_unlock(&mm.lock);
+        return -1;
+    }
+    if (swap_load(slot, easy_phy2linear(phy))) {
+        spin_unlock(&mm.lock);
+        decrease_reference_page_4k(phy);
+        return -1;
+    }
+    // 换入的是私有页, 写时复制标记直接恢复成可写
+    uint64_t flags = *pte & SWAP_PTE_FLAGS;
+    if (flags & PAGE_COW)
+        flags = (flags & ~PAGE_COW) | PAGE_WRITABLE;
+    *pte = phy | flags | PAGE_PRESENT;
+    swap_free(slot);
+    spin_unlock(&mm.lock);
+    invlpg_tlb(vir_addr);
+    swap_account_in(rdtsc() - start);
+    return 0;
 }
 
 static inline void flush_tlb(void)
@@ -496,56 +1469,156 @@ int put_user(char num,char *buf){
 
 #include <stdbool.h>
 
-uint64_t io_remap(uint64_t phy_addr, size_t size){
-    uint64_t offset = phy_addr & 0xfff;
-    uint64_t aligned_start = phy_addr & (~0xffful);
+/**
+ * @brief 把PAT第4项(PAT=1, PCD=0, PWT=0)改成写合并, 其余保持上电默认值
+ * @note 每个CPU都要设置且必须一致; 第4项默认是WB, 此前没有表项选到它, 不需要刷缓存
+ */
+void init_pat(void)
+{
+    uint64_t rax, rbx, rcx, rdx;
+    cpuid(1, &rax, &rbx, &rcx, &rdx);
+    if (!(rdx & (1 << 16)))
+        return;
+    uint64_t pat = rdmsr(MSR_IA32_PAT);
+    pat = (pat & ~(0xffUL << 32)) | ((uint64_t)PAT_TYPE_WC << 32);
+    wrmsr(MSR_IA32_PAT, pat);
+    mm.pat_wc = true;
+}
+
+/// @brief 找到内核地址的PD表项, 中间级不存在时分配, 分配不到返回NULL
+static uint64_t *__kernel_pde_locked(uint64_t vir_addr)
+{
+    uint64_t *ptable = vir_ptable4;
+    uint32_t layer[3];
+    layer[0] = ((uint64_t)easy_linear2phy(vir_addr) >> TABLE_LEVEL_1_BITS) + 256;
+    layer[1] = (vir_addr >> TABLE_LEVEL_2_BITS) & 0x1FF;
+    layer[2] = (vir_addr >> TABLE_LEVEL_3_BITS) & 0x1FF;
+    for (int i = 0; i < 2; i++) {
+        if (!(ptable[layer[i]] & PAGE_PRESENT)) {
+            uint64_t temp = alloc_table_page();
+            if (!temp)
+                return NULL;
+            ptable[layer[i]] = temp | PAGE_KERNEL_DIR;
+        }
+        ptable = easy_phy2linear(ptable[layer[i]] & 0xfffffffffffff000);
+    }
+    return &ptable[layer[2]];
+}
+
+static uint64_t __io_unmap_page_locked(uint64_t addr);
+
+/**
+ * @brief 在IO_REMAP窗口里找一段空闲地址映射[phy_addr, phy_addr + size)
+ * @note 范围覆盖完整的2M块时, 虚拟地址取和物理地址相同的2M内偏移, 这些块用2M页映射
+ */
+static uint64_t __io_remap(uint64_t phy_addr, size_t size, uint64_t flags_4k, uint64_t flags_2m)
+{
+    uint64_t start = phy_addr & ~0xfffUL;
+    uint64_t end = (phy_addr + size + 0xfff) & ~0xfffUL;
+    uint64_t len = end - start;
+    uint64_t off = start & (HUGE_PAGE_SIZE - 1);
+    bool huge = ((start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) + HUGE_PAGE_SIZE <= end;
+
     spin_lock(&mm.lock);
-    size_t page_num = (size + offset + 4095) / 4096;
-    size_t free_page_num = 0;
-    uint64_t page = IO_REMAP_START;
-    uint64_t start_page = page;
-    bool found = false;
-    while(page < IO_REMAP_END){
-        if (!exist_page_4k(page,(uint64_t)vir_ptable4)){
-            if (!free_page_num){
-                start_page = page;
-            }
-            free_page_num++;
-            if (free_page_num == page_num){
-                found = true;
-                for (size_t i = 0;i < page_num;i++){
-                    __put_page_4k_locked(aligned_start + i * 4096,
-                        start_page + i * 4096,
-                        (uint64_t)vir_ptable4,
-                        3,
-                        PAGE_PRESENT | PAGE_GLOBAL | PAGE_WRITE_THROUGH | PAGE_LEVEL_CACHE_DISABLE | PAGE_SYSTEM_MODE
-                    );
-                    asm volatile("invlpg (%0)" : : "r"(start_page + i * 4096) : "memory");
-                }
-                break;
+    uint64_t vir = IO_REMAP_START + (huge ? off : 0);
+    uint64_t addr = vir;
+    while (addr < vir + len) {
+        if (vir + len > IO_REMAP_END) {
+            spin_unlock(&mm.lock);
+            return 0;
+        }
+        if (!exist_page_4k(addr, (uint64_t)vir_ptable4)) {
+            addr += 4096;
+            continue;
+        }
+        // 从冲突的页之后重新找, 2M映射要保持和物理地址相同的偏移
+        if (huge)
+            vir = ((addr + HUGE_PAGE_SIZE - off) & ~(HUGE_PAGE_SIZE - 1)) + off;
+        else
+            vir = addr + 4096;
+        addr = vir;
+    }
+
+    uint64_t phy = start;
+    addr = vir;
+    while (phy < end) {
+        if (!(phy & (HUGE_PAGE_SIZE - 1)) && phy + HUGE_PAGE_SIZE <= end) {
+            // 以前4K映射留下的空页表还挂着时只能继续用4K页
+            uint64_t *pde = __kernel_pde_locked(addr);
+            if (!pde)
+                goto fail;
+            if (!(*pde & PAGE_PRESENT)) {
+                *pde = phy | flags_2m;
+                invlpg_tlb(addr);
+                phy += HUGE_PAGE_SIZE;
+                addr += HUGE_PAGE_SIZE;
+                continue;
             }
-        } else {
-            found = false;
-            free_page_num = 0;
         }
-        page += 4096;
+        if (__put_page_4k_locked(phy, addr, (uint64_t)vir_ptable4, 5, flags_4k))
+            goto fail;
+        phy += 4096;
+        addr += 4096;
     }
     spin_unlock(&mm.lock);
-    if (found){
-        return start_page + offset;
-    } else {
-        return 0;
+    return vir + (phy_addr & 0xfff);
+fail:
+    // 取不到页表, 拆掉已经建立的映射
+    for (uint64_t a = vir; a < addr;)
+        a += __io_unmap_page_locked(a);
+    spin_unlock(&mm.lock);
+    if (addr > vir)
+        tlb_shootdown(0, vir, addr, 0);
+    return 0;
+}
+
+/// @brief 以不可缓存方式映射设备寄存器
+uint64_t io_remap(uint64_t phy_addr, size_t size)
+{
+    return __io_remap(phy_addr, size, PAGE_KERNEL_IO_4K, PAGE_KERNEL_IO_2M);
+}
+
+/**
+ * @brief 以写合并方式映射帧缓冲这类只写的大块设备内存
+ * @note 写合并不保证写的顺序, 也不适合读; CPU不支持PAT时退回不可缓存
+ */
+uint64_t io_remap_wc(uint64_t phy_addr, size_t size)
+{
+    if (!mm.pat_wc)
+        return io_remap(phy_addr, size);
+    return __io_remap(phy_addr, size, PAGE_KERNEL_WC_4K, PAGE_KERNEL_WC_2M);
+}
+
+/// @brief 解除IO窗口中addr处的映射, 返回解除的大小
+static uint64_t __io_unmap_page_locked(uint64_t addr)
+{
+    uint64_t *pde = __kernel_pde_locked(addr);
+    if (!pde || !(*pde & PAGE_PRESENT))
+        halt();
+    if (*pde & PAGE_BIG_ENTRY) {
+        *pde = 0;
+        return HUGE_PAGE_SIZE;
     }
+    uint64_t *pt = easy_phy2linear(*pde & 0xfffffffffffff000);
+    uint32_t idx = (addr >> TABLE_LEVEL_4_BITS) & 0x1FF;
+    if (!(pt[idx] & PAGE_PRESENT))
+        halt();
+    pt[idx] = 0;
+    return 4096;
 }
 
 void io_unmap(uint64_t vir_addr, size_t size){
-    uint64_t offset = vir_addr & 0xfff;
     uint64_t aligned_start = vir_addr & (~0xffful);
-    size_t page_num = (size + offset + 4095) / 4096;
+    uint64_t end = (vir_addr + size + 0xfff) & (~0xffful);
+    TLB_BATCH batch;
+    tlb_batch_init(&batch, 0);
     spin_lock(&mm.lock);
-    for(size_t i = 0;i < page_num;i++){
-        rm_page_4k(aligned_start + i * 4096,(uint64_t)vir_ptable4);
-        asm volatile("invlpg (%0)" : : "r"(aligned_start + i * 4096) : "memory");
+    for (uint64_t addr = aligned_start; addr < end;) {
+        uint64_t step = __io_unmap_page_locked(addr);
+        tlb_batch_add(&batch, addr, step);
+        addr += step;
     }
     spin_unlock(&mm.lock);
+    // 内核映射可能缓存在任何CPU上, 放掉mm.lock后一次性通知
+    tlb_batch_flush(&batch);
 }
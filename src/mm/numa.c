@@ -0,0 +1,91 @@
+#include "mm/numa.h"
+#include "mm/mm.h"
+#include "mm/page_pool.h"
+#include "machine/cpu.h"
+#include "lib/string.h"
+#include "lib/io.h"
+
+/**
+ * NUMA节点
+ * 启动时从SRAT得到每段内存所在的节点, 把物理区域切到单个节点内;
+ * SLIT给出节点间的距离, 每个节点按距离排好退路顺序, buddy分配时依次尝试.
+ * CPU所在的节点在解析MADT时从SRAT的处理器亲和表查出来, 记在CPU_ITEM.node上.
+ */
+
+extern MM_MANAGER mm;
+extern GLOBAL_CPU *cpus;
+extern PHYSIC_AREA_ITEM pais[];
+
+static NUMA_INFO numa_info;
+
+/// @brief 按距离从近到远排出node的退路顺序, 距离相同时节点号小的在前
+static void numa_build_fallback(uint32_t node)
+{
+    uint8_t *order = mm.node[node].fallback;
+    for (uint32_t i = 0; i < mm.nr_nodes; i++)
+        order[i] = i;
+    for (uint32_t i = 1; i < mm.nr_nodes; i++) {
+        uint8_t n = order[i];
+        uint32_t j = i;
+        while (j && numa_info.distance[node][order[j - 1]] > numa_info.distance[node][n]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = n;
+    }
+}
+
+/**
+ * @brief 解析SRAT/SLIT并按节点切分物理区域
+ * @note 在set_kernel_area之后调用(ACPI表要通过直接映射访问), 这时页缓存还没有启用
+ */
+void init_numa(void)
+{
+    memset(&numa_info, 0, sizeof(numa_info));
+    acpi_numa_init(&numa_info);
+    if (numa_info.nr_nodes <= 1)
+        return;
+    mm.nr_nodes = numa_info.nr_nodes;
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    buddy_split_areas(numa_info.ranges, numa_info.nr_ranges);
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
+    for (uint32_t i = 0; i < mm.nr_nodes; i++)
+        numa_build_fallback(i);
+}
+
+/**
+ * @brief 当前CPU所在的节点
+ * @note 和每CPU页缓存一样依赖get_logic_cpu_id, 在init_page_pcp之前都算节点0
+ */
+uint32_t numa_node_id(void)
+{
+    if (mm.nr_nodes <= 1 || !mm.pcp_enabled)
+        return 0;
+    return cpus->items[get_logic_cpu_id()].node;
+}
+
+uint32_t page_to_node(uint64_t phy_addr)
+{
+    if (mm.nr_nodes <= 1)
+        return 0;
+    return pais[phys_to_page(phy_addr)->area].node;
+}
+
+void numa_stat(NUMA_STAT *stat)
+{
+    memset(stat, 0, sizeof(NUMA_STAT));
+    uint8_t intr = spin_lock_irq_save(&mm.page_lock);
+    stat->nr_nodes = mm.nr_nodes;
+    for (uint32_t i = 0; i < mm.nr_nodes; i++) {
+        stat->node[i].total_pages = mm.node[i].total_pages;
+        stat->node[i].free_pages = mm.node[i].free_pages;
+        stat->node[i].alloc_local = mm.node[i].alloc_local;
+        stat->node[i].alloc_remote = mm.node[i].alloc_remote;
+    }
+    spin_unlock(&mm.page_lock);
+    io_set_intr(intr);
+    // 页缓存里的页在buddy看来已经分配出去了, 也算作已用
+    for (uint32_t i = 0; i < stat->nr_nodes; i++)
+        stat->node[i].used_pages = stat->node[i].total_pages - stat->node[i].free_pages;
+}
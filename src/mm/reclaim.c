@@ -0,0 +1,148 @@
+#include "mm/reclaim.h"
+#include "mm/page_pool.h"
+#include "lib/safelist.h"
+#include "lib/wait_queue.h"
+#include "lib/io.h"
+#include "task.h"
+#include "view/view.h"
+
+/**
+ * 内存回收
+ * 空闲页低于wmark_low时分配路径唤醒kswapd, kswapd依次调用登记的shrinker直到回到wmark_high.
+ * 分配失败时在可以睡眠的上下文里先直接回收几轮, 仍然没有进展才把失败返回给调用者.
+ */
+
+extern MM_MANAGER mm;
+extern bool multi_core_start;
+
+/// @brief shrinker链表, 锁同时保证同一时刻只有一个回收者
+static MUTEX_LIST_HEAD(shrinker_list);
+static wait_queue_t kswapd_wait = {
+    .lock = { .lock = 0 },
+    .list = LIST_HEAD_INIT(kswapd_wait.list),
+};
+static pcb_t *kswapd_task;
+static volatile bool kswapd_sleeping;
+static RECLAIM_STAT stat;
+
+/// @note 后登记的先扫描: 上层缓存释放的对象落回slab, 最后由slab把空页还回去
+void register_shrinker(SHRINKER *shrinker)
+{
+    shrinker->nr_scanned = shrinker->nr_reclaimed = 0;
+    mutex_lock(&shrinker_list.lock);
+    list_add(&shrinker->list, &shrinker_list.list);
+    mutex_unlock(&shrinker_list.lock);
+}
+
+void unregister_shrinker(SHRINKER *shrinker)
+{
+    mutex_lock(&shrinker_list.lock);
+    list_del(&shrinker->list);
+    mutex_unlock(&shrinker_list.lock);
+}
+
+/// @brief 按空闲页数设置水位, 在buddy建立之后调用
+void init_watermarks(void)
+{
+    uint64_t min = mm.tfpp >> 8;
+    if (min < 128)
+        min = 128;
+    if (min > 8192)
+        min = 8192;
+    mm.wmark_low = min * 2;
+    mm.wmark_high = min * 3;
+}
+
+/// @brief 对每个shrinker扫描其可回收对象的1/2^priority, 调用者持有shrinker_list.lock
+static uint64_t shrink_all(uint32_t priority)
+{
+    uint64_t reclaimed = 0;
+    SHRINKER *shrinker;
+    list_for_each_entry(shrinker, &shrinker_list.list, list) {
+        uint64_t nr = shrinker->count(shrinker) >> priority;
+        if (!nr)
+            continue;
+        uint64_t done = shrinker->scan(shrinker, nr);
+        shrinker->nr_scanned += nr;
+        shrinker->nr_reclaimed += done;
+        reclaimed += done;
+    }
+    return reclaimed;
+}
+
+void kswapd_thread(void)
+{
+    kswapd_task = get_current();
+    while (1) {
+        uint8_t intr = spin_lock_irq_save(&kswapd_wait.lock);
+        kswapd_sleeping = true;
+        sleep_on_locked(&kswapd_wait);
+        io_set_intr(intr);
+        kswapd_sleeping = false;
+        stat.kswapd_wakeups++;
+
+        mutex_lock(&shrinker_list.lock);
+        for (int priority = RECLAIM_PRIORITY_MAX; priority >= 0 && mm.tfpp < mm.wmark_high; priority--)
+            stat.kswapd_reclaimed += shrink_all(priority);
+        mutex_unlock(&shrinker_list.lock);
+    }
+}
+
+/// @brief 空闲页低于wmark_low时由分配路径调用, 可以在任何上下文调用
+void wakeup_kswapd(void)
+{
+    if (!kswapd_task || !kswapd_sleeping)
+        return;
+    uint8_t intr = io_cli();
+    wake_up_all(&kswapd_wait);
+    io_set_intr(intr);
+}
+
+/**
+ * @brief 分配失败时同步回收一轮
+ * @note 只有开中断, 没有持有自旋锁, 且没有别人正在回收时才执行, 否则只唤醒kswapd
+ * @return 回收到了对象, 值得重试分配
+ */
+bool reclaim_direct(void)
+{
+    wakeup_kswapd();
+    if (!multi_core_start)
+        return false;
+    uint8_t intr = io_cli();
+    io_set_intr(intr);
+    if (!intr || get_current()->preempt_count)
+        return false;
+    if (!mutex_trylock(&shrinker_list.lock))
+        return false;
+    stat.direct_runs++;
+    uint64_t reclaimed = 0;
+    for (int priority = RECLAIM_PRIORITY_MAX; priority >= 0 && !reclaimed; priority--)
+        reclaimed = shrink_all(priority);
+    mutex_unlock(&shrinker_list.lock);
+    stat.direct_reclaimed += reclaimed;
+    return reclaimed != 0;
+}
+
+void reclaim_alloc_failed(void)
+{
+    __atomic_add_fetch(&stat.alloc_fail, 1, __ATOMIC_RELAXED);
+}
+
+void reclaim_stat(RECLAIM_STAT *out)
+{
+    *out = stat;
+}
+
+/// @return 写入buf的字节数, 每个shrinker一行
+uint32_t shrinker_show(char *buf, uint32_t size)
+{
+    uint32_t pos = 0;
+    SHRINKER *shrinker;
+    mutex_lock(&shrinker_list.lock);
+    list_for_each_entry(shrinker, &shrinker_list.list, list) {
+        pos += sprintf(buf + pos, "  %s: scanned %lu reclaimed %lu\n", size - pos,
+                       shrinker->name, shrinker->nr_scanned, shrinker->nr_reclaimed);
+    }
+    mutex_unlock(&shrinker_list.lock);
+    return pos;
+}
@@ -2,252 +2,596 @@
 #include "lib/string.h"
 #include "mm/mm.h"
 #include "lib/io.h"
+#include "machine/cpu.h"
+#include "mm/reclaim.h"
+#include "task.h"
+#include "mm/swap.h"
+#include "mm/vma.h"
+#include "mm/tlb.h"
+#include "view/view.h"
 
 extern MM_MANAGER mm;
+extern GLOBAL_CPU *cpus;
 extern uint64_t *vir_ptable4;
+extern bool multi_core_start;
 
 extern uint64_t heap_alloc(uint32_t size);
 extern void heap_free(uint64_t addr);
 
-static const SLAB_INFO slab_info[] = {
-    {SLAB_START_32, 32, 127},
-    {SLAB_START_64, 64, 63},
-    {SLAB_START_128, 128, 31},
-    {SLAB_START_256, 256, 15},
-    {SLAB_START_512, 512, 7},
-    {SLAB_START_1024, 1024, 64},
-    {SLAB_START_2048, 2048, 64},
+/// 管理所有kmem_cache_t本身的cache
+static kmem_cache_t cache_cache;
+/// kmalloc的尺寸级, 第i级位于SLAB_START_32 + (i << 39)
+static kmem_cache_t kmalloc_caches[KMALLOC_NR_CLASSES];
+
+static LIST_HEAD(cache_list);
+static spinlock_t cache_list_lock;
+/// 每CPU magazine已建立, 之后创建的cache在创建时建立magazine
+static bool kmem_mag_enabled;
+
+static void kmem_cache_setup_magazines(kmem_cache_t *cache);
+
+static const char *const kmalloc_names[KMALLOC_NR_CLASSES] = {
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
 };
 
-void init_slab(void)
+static inline uint64_t slab_bytes(kmem_cache_t *cache)
 {
-    for (uint64_t i = 0; i < 5; i++)
-    {
-        mm.slabei[i] = 0;
-        mm.nfslabi[i] = 0;
-        uint64_t phy_page = alloc_page_4k();
-        SLAB *slab = (void *)(SLAB_START_32 + (i << 39));
-        __put_page_4k_locked(phy_page, (uint64_t)slab, (uint64_t)vir_ptable4, 0, 0);
-        memset(slab, 0, 4096);
-        slab->bitmap[0] = 1;
-        slab->totalfree = slab_info[i].emptynum;
-        slab->nextfree = 1;
+    return 4096UL << cache->order;
+}
+
+static inline KMEM_SLAB *obj_to_slab(kmem_cache_t *cache, void *obj)
+{
+    return (KMEM_SLAB *)((uint64_t)obj & ~(slab_bytes(cache) - 1));
+}
+
+/// @brief 选择最小的order, 使得slab描述符和尾部碎片不超过slab的1/8
+static void kmem_cache_calc_order(kmem_cache_t *cache)
+{
+    uint32_t offset = (sizeof(KMEM_SLAB) + cache->align - 1) & ~(cache->align - 1);
+    uint32_t order;
+    for (order = 0; order < KMEM_MAX_ORDER; order++) {
+        uint64_t bytes = 4096UL << order;
+        if (offset + cache->size > bytes)
+            continue;
+        uint64_t num = (bytes - offset) / cache->size;
+        if ((bytes - num * cache->size) * 8 <= bytes)
+            break;
     }
+    if (offset + cache->size > (4096UL << order))
+        halt();
+    cache->order = order;
+    cache->offset = offset;
+    cache->objs_per_slab = (slab_bytes(cache) - offset) / cache->size;
+}
 
-    for (uint32_t i = 0; i < 2; i++)
-    {
-        mm.mnfslab[i] = mm.mslab[i] = kmalloc(sizeof(SLAB_MIDDLE));
-        memset(mm.mslab[i], 0, sizeof(SLAB_MIDDLE));
-        mm.mslab[i]->totalfree = 32 * 8;
-        for (uint32_t j = 0; j < (uint32_t)64 << i; j++)
-        {
-            uint64_t phy_addr = alloc_page_4k();
-            __put_page_4k_locked(phy_addr, slab_info[i + 5].area_start_addr + (j << 12), (uint64_t)vir_ptable4, 0, 0);
-        }
+static void kmem_cache_init(kmem_cache_t *cache, const char *name, uint32_t size,
+                            uint32_t align, kmem_ctor_t ctor, uint64_t window)
+{
+    memset(cache, 0, sizeof(kmem_cache_t));
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (align & (align - 1))
+        halt();
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->size = (size + align - 1) & ~(align - 1);
+    cache->ctor = ctor;
+    cache->window_start = cache->window_next = window;
+    for (uint32_t i = 0; i < MAX_NUMA_NODES; i++) {
+        INIT_LIST_HEAD(&cache->partial[i]);
+        INIT_LIST_HEAD(&cache->free[i]);
     }
-    spin_lock_init(&mm.lock);
+    INIT_LIST_HEAD(&cache->full);
+    spin_lock_init(&cache->lock);
+    kmem_cache_calc_order(cache);
+
+    spin_lock(&cache_list_lock);
+    list_add_tail(&cache->cache_list, &cache_list);
+    spin_unlock(&cache_list_lock);
 }
 
-void *slab_alloc(uint32_t size)
+/**
+ * @brief 为cache取得一个新的slab, 调用者持有cache->lock
+ * @note 窗口中的slab逐页取自当前CPU的页缓存, 只有直接映射的slab按node取页
+ */
+static KMEM_SLAB *kmem_cache_grow(kmem_cache_t *cache, uint32_t node)
 {
-    if (size == 0)
-        return (void *)0;
-    uint64_t addr;
-    for (uint64_t i = 0; i < 5; i++)
-    {
-        if (size <= slab_info[i].size)
-        {
-            SLAB *slab = (void *)(slab_info[i].area_start_addr + (mm.nfslabi[i] << 12));
-            addr = (uint64_t)slab + slab->nextfree * slab_info[i].size;
-            slab->bitmap[slab->nextfree >> 3] |= (1 << (slab->nextfree & 7));
-            if (--slab->totalfree)
-            {
-                for (uint16_t j = slab->nextfree + 1; j <= slab_info[i].emptynum; j++)
-                {
-                    if (!(slab->bitmap[j >> 3] & (1 << (j & 7))))
-                    {
-                        slab->nextfree = j;
-                        return (void*)addr;
-                    }
-                }
-                halt();
-            }
-            else
-            {
-                slab->nextfree = 0;
-                for (uint64_t j = mm.nfslabi[i] + 1; j <= mm.slabei[i]; j++)
-                {
-                    SLAB *temp = (void *)(slab_info[i].area_start_addr + (j << 12));
-                    if (temp->totalfree)
-                    {
-                        mm.nfslabi[i] = j;
-                        return (void*)addr;
-                    }
-                }
-                uint64_t phy_page = alloc_page_4k();
-                mm.slabei[i]++;
-                mm.nfslabi[i] = mm.slabei[i];
-                SLAB *newslab = (void *)(slab_info[i].area_start_addr + (mm.slabei[i] << 12));
-                __put_page_4k_locked(phy_page, (uint64_t)newslab, (uint64_t)vir_ptable4, 0, 0);
-                memset(newslab, 0, 4096);
-                newslab->bitmap[0] = 1;
-                newslab->totalfree = slab_info[i].emptynum;
-                newslab->nextfree = 1;
-                return (void*)addr;
+    uint64_t bytes = slab_bytes(cache);
+    KMEM_SLAB *slab;
+    if (cache->window_start) {
+        if (cache->window_next + bytes > cache->window_start + (1UL << 39))
+            return NULL;
+        // 先取齐所有页, 取不到时不留下映射了一半的slab
+        uint64_t phy_pages[1U << KMEM_MAX_ORDER];
+        uint32_t nr = bytes >> 12;
+        for (uint32_t i = 0; i < nr; i++) {
+            phy_pages[i] = alloc_page_4k();
+            if (!phy_pages[i]) {
+                while (i--)
+                    decrease_reference_page_4k(phy_pages[i]);
+                return NULL;
             }
         }
+        spin_lock(&mm.lock);
+        for (uint32_t i = 0; i < nr; i++) {
+            if (!__put_page_4k_locked(phy_pages[i], cache->window_next + ((uint64_t)i << 12), (uint64_t)vir_ptable4, 0, 0))
+                continue;
+            // 取不到页表, 撤掉已经映射的页, 下次从同一个地址重新映射
+            for (uint32_t j = 0; j < i; j++)
+                __unmap_kernel_page_locked(cache->window_next + ((uint64_t)j << 12));
+            spin_unlock(&mm.lock);
+            if (i)
+                tlb_shootdown(0, cache->window_next, cache->window_next + ((uint64_t)i << 12), 0);
+            for (uint32_t j = 0; j < nr; j++)
+                decrease_reference_page_4k(phy_pages[j]);
+            return NULL;
+        }
+        spin_unlock(&mm.lock);
+        slab = (KMEM_SLAB *)cache->window_next;
+        cache->window_next += bytes;
+        slab->node = page_to_node(phy_pages[0]);
+    } else {
+        uint64_t phy_addr;
+        if (cache->order || node != numa_node_id())
+            phy_addr = alloc_n_pages_4k_node(1U << cache->order, node);
+        else
+            phy_addr = alloc_page_4k();
+        if (!phy_addr)
+            return NULL;
+        page_t *page = phys_to_page(phy_addr);
+        for (uint32_t i = 0; i < (1U << cache->order); i++) {
+            page[i].flags |= PG_SLAB;
+            page[i].owner = cache;
+        }
+        slab = easy_phy2linear(phy_addr);
+        slab->node = page_to_node(phy_addr);
     }
-    for (uint32_t i = 0; i < 2; i++)
-    {
-        SLAB_INFO *info = (SLAB_INFO *)&slab_info[5 + i];
-        if (size <= info->size)
-        {
-            SLAB_MIDDLE *slab = mm.mnfslab[i];
-            addr = info->area_start_addr + (slab->id << (18 + i)) + (slab->nextfree << (10 + i));
-            slab->bitmap[slab->nextfree >> 3] |= (1 << (slab->nextfree & 7));
-            if (--slab->totalfree)
-            {
-                for (uint32_t j = slab->nextfree; j < 32 * 8; j++)
-                {
-                    if (!(slab->bitmap[j >> 3] & (1 << (j & 7))))
-                    {
-                        slab->nextfree = j;
-                        return (void*)addr;
-                    }
-                }
-                halt();
-            }
-            else
-            {
-                slab->nextfree = 0;
-                SLAB_MIDDLE *current = mm.mslab[i];
-                SLAB_MIDDLE *last = current;
-                while (current != (void *)0)
-                {
-                    if (current->totalfree)
-                    {
-                        mm.mnfslab[i] = current;
-                        return (void*)addr;
-                    }
-                    else
-                    {
-                        last = current;
-                        current = current->next;
-                    }
-                }
-                mm.mnfslab[i] = current = kmalloc(sizeof(SLAB_MIDDLE));
-                memset(current, 0, sizeof(SLAB_MIDDLE));
-                current->past = last;
-                last->next = current;
-                current->id = last->id + 1;
-                current->totalfree = 32 * 8;
-                for (uint32_t j = 0; j < info->size >> 4; j++)
-                {
-                    uint64_t phy_addr = alloc_page_4k();
-                    __put_page_4k_locked(phy_addr, info->area_start_addr + (current->id << (18 + i)) + (j << 12), (uint64_t)vir_ptable4, 0, 0);
-                }
-                return (void*)addr;
-            }
+    slab->cache = cache;
+    slab->freelist = NULL;
+    slab->unused = cache->objs_per_slab;
+    slab->inuse = 0;
+    slab->magic = KMEM_SLAB_MAGIC;
+    cache->nr_slabs++;
+    return slab;
+}
+
+/// @brief 归还一个空slab, 窗口中的slab保留映射, 只有直接映射区的slab会被释放
+static void kmem_cache_shrink_slab(kmem_cache_t *cache, KMEM_SLAB *slab)
+{
+    if (cache->window_start || cache->nr_free_slabs < KMEM_FREE_SLABS_KEEP) {
+        list_add(&slab->list, &cache->free[slab->node]);
+        cache->nr_free_slabs++;
+        return;
+    }
+    slab->magic = 0;
+    cache->nr_slabs--;
+    free_n_pages_4k(1U << cache->order, (uint64_t)easy_linear2phy(slab));
+}
+
+/// @brief 释放cache中最多nr个空slab, 返回释放的个数, 调用者持有cache->lock
+static uint64_t __kmem_cache_reap_locked(kmem_cache_t *cache, uint64_t nr)
+{
+    uint64_t freed = 0;
+    if (cache->window_start)
+        return 0;
+    for (uint32_t i = 0; i < mm.nr_nodes; i++) {
+        while (freed < nr && !list_empty(&cache->free[i])) {
+            KMEM_SLAB *slab = list_first_entry(&cache->free[i], KMEM_SLAB, list);
+            list_del(&slab->list);
+            cache->nr_free_slabs--;
+            cache->nr_slabs--;
+            slab->magic = 0;
+            free_n_pages_4k(1U << cache->order, (uint64_t)easy_linear2phy(slab));
+            freed++;
         }
     }
-    return (void*)0;
+    return freed;
 }
 
-void *kmalloc(uint32_t size)
+/// @brief spin_trylock不关抢占, 成功后补上, 以便和spin_unlock配对
+static bool slab_trylock(spinlock_t *lock)
 {
-    spin_lock(&mm.lock);
-    void *ret = slab_alloc(size);
-    if (ret == NULL){
-        if (size <= 4096){
-            ret = easy_phy2linear(alloc_page_4k());
-        }else{
-            ret = (void *)heap_alloc(size);
+    if (!spin_trylock(lock))
+        return false;
+    if (multi_core_start)
+        preempt_disable();
+    return true;
+}
+
+static uint64_t slab_shrink_count(UNUSED SHRINKER *shrinker)
+{
+    uint64_t count = 0;
+    kmem_cache_t *cache;
+    if (!slab_trylock(&cache_list_lock))
+        return 0;
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        if (!cache->window_start)
+            count += cache->nr_free_slabs;
+    }
+    spin_unlock(&cache_list_lock);
+    return count;
+}
+
+/// @note 调用者可能正持有某个cache的锁, 所以只用trylock
+static uint64_t slab_shrink_scan(UNUSED SHRINKER *shrinker, uint64_t nr)
+{
+    uint64_t freed = 0;
+    kmem_cache_t *cache;
+    if (!slab_trylock(&cache_list_lock))
+        return 0;
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        if (freed >= nr)
+            break;
+        if (cache->window_start || !cache->nr_free_slabs)
+            continue;
+        uint8_t intr = io_cli();
+        if (slab_trylock(&cache->lock)) {
+            freed += __kmem_cache_reap_locked(cache, nr - freed);
+            spin_unlock(&cache->lock);
         }
+        io_set_intr(intr);
     }
-    spin_unlock(&mm.lock);
-    return ret;
+    spin_unlock(&cache_list_lock);
+    return freed;
 }
 
-uint8_t slab_free(void *vir_addr){
-    uint64_t addr = (uint64_t)vir_addr;
-    for (uint64_t i = 0; i < 5; i++)
-        {
-            if (addr < slab_info[i].area_start_addr + (1UL << 39))
-            {
-                SLAB *slab = (void *)(addr & 0xfffffffffffff000);
-                uint64_t slab_id = ((uint64_t)slab - slab_info[i].area_start_addr) >> 12;
-                if (slab_id > mm.slabei[i])
-                {
-                    halt();
-                }
-                mm.nfslabi[i] = (slab_id < mm.nfslabi[i]) ? slab_id : mm.nfslabi[i];
-                uint8_t id = (uint16_t)(addr & 0xfff) / slab_info[i].size;
-                if (!id || !(slab->bitmap[id >> 3] & (1 << (id & 7))))
-                {
-                    halt();
-                }
-                slab->bitmap[id >> 3] &= ~(1 << (id & 7));
-                if (slab->nextfree == 0){
-                    slab->nextfree = id;
-                }else{
-                    if (slab->nextfree > id)
-                        slab->nextfree = id;
-                }
-                slab->totalfree++;
-                return 0;
+static SHRINKER slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+};
+
+void init_slab(void)
+{
+    spin_lock_init(&cache_list_lock);
+    kmem_cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 64, NULL, 0);
+    for (uint32_t i = 0; i < KMALLOC_NR_CLASSES; i++) {
+        uint32_t size = 1U << (KMALLOC_MIN_SHIFT + i);
+        kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], size, size, NULL, SLAB_START_32 + ((uint64_t)i << 39));
+    }
+    spin_lock_init(&mm.lock);
+    register_shrinker(&slab_shrinker);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    kmem_cache_t *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache)
+        return NULL;
+    kmem_cache_init(cache, name, size, align, ctor, 0);
+    if (kmem_mag_enabled)
+        kmem_cache_setup_magazines(cache);
+    return cache;
+}
+
+/// @brief 取node上有空闲对象的slab, 放在partial[node]上
+static KMEM_SLAB *kmem_cache_node_slab(kmem_cache_t *cache, uint32_t node)
+{
+    KMEM_SLAB *slab;
+    if (!list_empty(&cache->partial[node]))
+        return list_first_entry(&cache->partial[node], KMEM_SLAB, list);
+    if (!list_empty(&cache->free[node])) {
+        slab = list_first_entry(&cache->free[node], KMEM_SLAB, list);
+        list_move(&slab->list, &cache->partial[node]);
+        cache->nr_free_slabs--;
+        return slab;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 从slab中取一个对象, 调用者持有cache->lock
+ * @note 先用node已有的slab, 再新建slab(页仍可能来自别的节点), 最后按距离借用别的节点的slab
+ */
+static void *__kmem_cache_alloc_locked(kmem_cache_t *cache, uint32_t node)
+{
+    if (node >= mm.nr_nodes)
+        node = 0;
+    KMEM_SLAB *slab = kmem_cache_node_slab(cache, node);
+    if (!slab) {
+        slab = kmem_cache_grow(cache, node);
+        if (slab)
+            list_add(&slab->list, &cache->partial[slab->node]);
+    }
+    for (uint32_t i = 1; !slab && i < mm.nr_nodes; i++)
+        slab = kmem_cache_node_slab(cache, mm.node[node].fallback[i]);
+    if (!slab)
+        return NULL;
+
+    void *obj = slab->freelist;
+    if (obj) {
+        slab->freelist = *(void **)obj;
+    } else {
+        /* 从未分配过的对象按地址顺序切出, 新slab不需要预先串起free list */
+        obj = (void *)((uint64_t)slab + cache->offset +
+                       (uint64_t)(cache->objs_per_slab - slab->unused) * cache->size);
+        slab->unused--;
+    }
+    if (++slab->inuse == cache->objs_per_slab)
+        list_move(&slab->list, &cache->full);
+    cache->nr_active++;
+    cache->nr_alloc++;
+    return obj;
+}
+
+/// @brief 把对象还给所属的slab, 调用者持有cache->lock
+static void __kmem_cache_free_locked(kmem_cache_t *cache, void *obj)
+{
+    KMEM_SLAB *slab = obj_to_slab(cache, obj);
+    /* 只能发现连续两次释放同一个对象 */
+    if (!slab->inuse || slab->freelist == obj)
+        halt();
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    if (slab->inuse-- == cache->objs_per_slab) {
+        list_move(&slab->list, &cache->partial[slab->node]);
+    }
+    if (!slab->inuse) {
+        list_del(&slab->list);
+        kmem_cache_shrink_slab(cache, slab);
+    }
+    cache->nr_active--;
+    cache->nr_free++;
+}
+
+static inline void kmem_check_obj(kmem_cache_t *cache, void *obj)
+{
+    KMEM_SLAB *slab = obj_to_slab(cache, obj);
+    if (slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache ||
+        ((uint64_t)obj - (uint64_t)slab - cache->offset) % cache->size) {
+        halt();
+    }
+}
+
+/// @warning 调用时必须关中断
+static inline KMEM_MAGAZINE *this_cpu_mag(kmem_cache_t *cache)
+{
+    if (!kmem_mag_enabled)
+        return NULL;
+    return cache->mag[get_logic_cpu_id()];
+}
+
+static KMEM_MAGAZINE *kmem_magazine_create(kmem_cache_t *cache)
+{
+    KMEM_MAGAZINE *mag = kmalloc(sizeof(KMEM_MAGAZINE));
+    if (!mag)
+        return NULL;
+    memset(mag, 0, sizeof(KMEM_MAGAZINE));
+    if (cache->size <= 256)
+        mag->limit = KMEM_MAG_SIZE;
+    else if (cache->size <= 1024)
+        mag->limit = KMEM_MAG_SIZE / 2;
+    else if (cache->size <= 4096)
+        mag->limit = KMEM_MAG_SIZE / 4;
+    else
+        mag->limit = 2;
+    mag->batch = mag->limit / 2;
+    return mag;
+}
+
+static void kmem_cache_setup_magazines(kmem_cache_t *cache)
+{
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        if (!cache->mag[i])
+            cache->mag[i] = kmem_magazine_create(cache);
+    }
+}
+
+/**
+ * @brief 为所有cache建立每CPU magazine
+ * @note 依赖cpus与Local APIC(get_logic_cpu_id),因此在init_apic_bsp之后调用
+ */
+void init_slab_magazine(void)
+{
+    kmem_cache_t *cache;
+    spin_lock(&cache_list_lock);
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        kmem_cache_setup_magazines(cache);
+    }
+    kmem_mag_enabled = true;
+    spin_unlock(&cache_list_lock);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    return kmem_cache_alloc_node(cache, numa_node_id());
+}
+
+/**
+ * @brief 优先从node上的slab分配对象
+ * @note magazine里只放本CPU所在节点的对象, 给别的节点分配时绕过magazine
+ */
+void *kmem_cache_alloc_node(kmem_cache_t *cache, uint32_t node)
+{
+    void *obj = NULL;
+    uint8_t intr = io_cli();
+    KMEM_MAGAZINE *mag = node == numa_node_id() ? this_cpu_mag(cache) : NULL;
+    if (mag) {
+        if (mag->avail) {
+            mag->alloc_hit++;
+        } else {
+            mag->alloc_miss++;
+            spin_lock(&cache->lock);
+            while (mag->avail < mag->batch) {
+                void *tmp = __kmem_cache_alloc_locked(cache, node);
+                if (!tmp)
+                    break;
+                mag->objs[mag->avail++] = tmp;
             }
+            spin_unlock(&cache->lock);
         }
-        for (uint64_t i = 0; i < 2; i++)
-        {
-            SLAB_INFO *info = (SLAB_INFO *)&slab_info[i + 5];
-            if (addr < info->area_start_addr + (1UL << 39))
-            {
-                uint32_t total_id = (addr - info->area_start_addr) >> (10 + i);
-                uint32_t id = total_id >> 8;
-                uint32_t inside_index = total_id & 0xff;
-                SLAB_MIDDLE *current = mm.mslab[i];
-                while (current->id < id)
-                {
-                    current = current->next;
-                    if (!current)
-                    {
-                        halt();
-                    }
-                }
-                current->bitmap[inside_index >> 3] &= ~(1 << (inside_index & 7));
-                if (current->totalfree == 0){
-                    current->nextfree = inside_index;
-                }else{
-                    if (current->nextfree > inside_index)
-                        current->nextfree = inside_index;
-                }
-                current->totalfree++;
-                if (current->id < mm.mnfslab[i]->id)
-                    mm.mnfslab[i] = current;
-                return 0;
-            }
+        if (mag->avail)
+            obj = mag->objs[--mag->avail];
+    } else {
+        spin_lock(&cache->lock);
+        obj = __kmem_cache_alloc_locked(cache, node);
+        spin_unlock(&cache->lock);
+    }
+    io_set_intr(intr);
+
+    if (obj && cache->ctor)
+        cache->ctor(obj);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (!obj)
+        return;
+    kmem_check_obj(cache, obj);
+    uint8_t intr = io_cli();
+    KMEM_MAGAZINE *mag = this_cpu_mag(cache);
+    // 别的节点的对象直接还给slab, 不让它留在本CPU的magazine里被再分配出去
+    if (mag && obj_to_slab(cache, obj)->node != numa_node_id())
+        mag = NULL;
+    if (mag) {
+        if (mag->avail == mag->limit) {
+            /* 栈底的对象最久没被用过, 先还回去 */
+            spin_lock(&cache->lock);
+            for (uint32_t i = 0; i < mag->batch; i++)
+                __kmem_cache_free_locked(cache, mag->objs[i]);
+            spin_unlock(&cache->lock);
+            mag->avail -= mag->batch;
+            memcpy(mag->objs, mag->objs + mag->batch, mag->avail * sizeof(void *));
+            mag->free_flush++;
+        } else {
+            mag->free_hit++;
         }
-    return 1;
+        mag->objs[mag->avail++] = obj;
+    } else {
+        spin_lock(&cache->lock);
+        __kmem_cache_free_locked(cache, obj);
+        spin_unlock(&cache->lock);
+    }
+    io_set_intr(intr);
+}
+
+/**
+ * @brief 每个cache一行: 对象大小, slab数, 使用中的对象数, 所有CPU的magazine计数之和
+ * @return 写入buf的字节数, 不含结尾的0
+ */
+uint32_t kmem_cache_show(char *buf, uint32_t size)
+{
+    uint32_t pos = 0;
+    kmem_cache_t *cache;
+    spin_lock(&cache_list_lock);
+    list_for_each_entry(cache, &cache_list, cache_list) {
+        uint64_t alloc_hit = 0, alloc_miss = 0, free_hit = 0, free_flush = 0;
+        for (uint32_t i = 0; i < cpus->total_num; i++) {
+            KMEM_MAGAZINE *mag = cache->mag[i];
+            if (!mag)
+                continue;
+            alloc_hit += mag->alloc_hit;
+            alloc_miss += mag->alloc_miss;
+            free_hit += mag->free_hit;
+            free_flush += mag->free_flush;
+        }
+        pos += sprintf(buf + pos, "  %s: size %u slabs %lu active %lu mag_alloc %lu/%lu mag_free %lu/%lu\n",
+                       size - pos, cache->name, cache->object_size, cache->nr_slabs, cache->nr_active,
+                       alloc_hit, alloc_miss, free_hit, free_flush);
+    }
+    spin_unlock(&cache_list_lock);
+    return pos;
+}
+
+static inline uint32_t kmalloc_index(uint32_t size)
+{
+    if (size <= (1U << KMALLOC_MIN_SHIFT))
+        return 0;
+    return 32 - __builtin_clz(size - 1) - KMALLOC_MIN_SHIFT;
+}
+
+void *kmalloc(uint32_t size)
+{
+    if (size <= KMALLOC_MAX_SIZE)
+        return kmem_cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+    if (size <= 4096) {
+        uint64_t phy = alloc_page_4k();
+        return phy ? easy_phy2linear(phy) : NULL;
+    }
+    spin_lock(&mm.lock);
+    void *ret = (void *)heap_alloc(size);
+    spin_unlock(&mm.lock);
+    return ret;
 }
 
 void kfree(void *vir_addr)
 {
     uint64_t addr = (uint64_t)vir_addr;
-    spin_lock(&mm.lock);
     if (addr < VIRTUAL_ADDR_0){
         halt();
     }
-    if (addr < SLAB_START_32)
-        decrease_reference_page_4k((uint64_t)easy_linear2phy(addr));
+    if (addr < SLAB_START_32) {
+        // 直接映射区的slab对象交还给所属的cache, 其它是kmalloc整页
+        page_t *page = virt_to_page(vir_addr);
+        if (page->flags & PG_SLAB)
+            kmem_cache_free(page->owner, vir_addr);
+        else
+            decrease_reference_page_4k((uint64_t)easy_linear2phy(addr));
+    }
+    else if (addr < HEAP_ADDR_START)
+        kmem_cache_free(&kmalloc_caches[(addr - SLAB_START_32) >> 39], vir_addr);
     else{
-        if (slab_free(vir_addr)){
-            heap_free((uint64_t)addr);
+        spin_lock(&mm.lock);
+        heap_free(addr);
+        spin_unlock(&mm.lock);
+    }
+}
+
+/**
+ * @brief 按缺页的方式补上当前进程不在内存的用户页: 换出的页换回来, 区域内的页按区域填充
+ * @note 设备要写入这一页, 可写的区域按写缺页处理, 不会映射共享零页
+ * @return 0 已补上(换出的页还在换出中时也返回0, 由调用者重查), -1 失败或者cr3不是当前进程的
+ */
+static int fault_in_user_page(uint64_t addr, uint64_t cr3)
+{
+    pcb_t *current = get_current();
+    uint64_t page = addr & 0xfffffffffffff000;
+    if (page >= VIRTUAL_ADDR_USER_HIGHEST || !page || current->cr3 != cr3)
+        return -1;
+    int ret = swap_in_user_page(page, cr3);
+    if (ret <= 0)
+        return ret;
+    uint8_t intr = io_cli();
+    ret = vma_fault(current, page, true, intr);
+    if (ret < 0)
+        ret = vma_fault(current, page, false, intr);
+    if (ret == 1) {
+        // 不在任何区域内的老式用户内存, 与缺页处理一致直接给一页
+        uint64_t phy = alloc_zeroed_page_4k();
+        ret = -1;
+        if (phy) {
+            ret = put_page_4k(phy, page, cr3, 1);
+            if (ret)
+                decrease_reference_page_4k(phy);
         }
     }
-    spin_unlock(&mm.lock);
+    io_set_intr(intr);
+    return ret;
 }
 
-uint64_t mem_linear2phy_get(uint64_t addr, uint64_t cr3)
+/**
+ * @brief 在系统调用中先把用户缓冲区的页补上, 之后内核线程替它翻译地址时不会缺页
+ * @return 0 成功, -1 有页补不上
+ */
+int prefault_user_range(const void *buf, uint64_t len)
+{
+    uint64_t addr = (uint64_t)buf;
+    if (!len || addr >= VIRTUAL_ADDR_USER_HIGHEST)
+        return 0;
+    uint64_t cr3 = get_current()->cr3;
+    for (uint64_t page = addr & 0xfffffffffffff000; page < addr + len; page += 4096) {
+        if (!mem_linear2phy_get(page, cr3))
+            return -1;
+    }
+    return 0;
+}
+
+static uint64_t __mem_linear2phy_get(uint64_t addr, uint64_t cr3, bool retry)
 {
     if ((addr < SLAB_START_32) && (addr >= VIRTUAL_ADDR_0))
     {
@@ -272,15 +616,34 @@ uint64_t mem_linear2phy_get(uint64_t addr, uint64_t cr3)
         if ((ptable[level2] & PAGE_PRESENT) == 0 || (ptable[level2] & PAGE_BIG_ENTRY))
             goto reget;
         ptable = easy_phy2linear(ptable[level2] & 0xFFFFFFFFFFFFFE00);
-        if ((ptable[level3] & PAGE_PRESENT) == 0 || (ptable[level3] & PAGE_BIG_ENTRY))
+        if ((ptable[level3] & PAGE_PRESENT) == 0)
             goto reget;
+        if (ptable[level3] & PAGE_BIG_ENTRY) {
+            // 用户2M大页, 写时复制可能把它拆成4K页, 所以处理后重新查一遍
+            if ((ptable[level3] & PAGE_COW) && !do_cow_fault(addr, cr3))
+                return __mem_linear2phy_get(addr, cr3, retry);
+            return (ptable[level3] & 0x000fffffffe00000) + (addr & 0x1FFFFF);
+        }
         ptable = easy_phy2linear(ptable[level3] & 0xFFFFFFFFFFFFFE00);
         if ((ptable[level4] & PAGE_PRESENT) == 0)
             goto reget;
+        // 设备可能写入这一页(DMA不经过页表), 先解除共享
+        if (ptable[level4] & PAGE_COW)
+            do_cow_fault(addr, cr3);
         return (ptable[level4] & 0xFFFFFFFFFFFFF000) + offset;
     reget:
-        uint64_t phy = (uint64_t)easy_linear2phy(kmalloc(4096));
-        put_page_4k(phy,addr & 0xFFFFFFFFFFFFF000,cr3,1);
-        return phy;
+        // 换出表项和没有填充过的文件页都不能直接换成零页, 补一次后重查
+        if (!retry || fault_in_user_page(addr, cr3))
+            return 0;
+        return __mem_linear2phy_get(addr, cr3, false);
     }
 }
+
+/**
+ * @brief 查addr在页表cr3中的物理地址, 用户页不在内存时替当前进程补上
+ * @return 物理地址, 0表示无法映射(调用者应当让请求失败)
+ */
+uint64_t mem_linear2phy_get(uint64_t addr, uint64_t cr3)
+{
+    return __mem_linear2phy_get(addr, cr3, true);
+}
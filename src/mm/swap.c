@@ -0,0 +1,351 @@
+#include "mm/swap.h"
+#include "mm/mm.h"
+#include "mm/reclaim.h"
+#include "mm/tlb.h"
+#include "lib/lz.h"
+#include "lib/safelist.h"
+#include "lib/string.h"
+#include "lib/io.h"
+#include "machine/cpu.h"
+#include "task.h"
+
+/**
+ * 压缩内存交换
+ * 以shrinker的方式接入回收: 按pid轮流扫描用户进程的页表, 访问位置位的页清掉访问位放过一轮,
+ * 没有被再次访问的私有匿名页压缩后放进slot, 物理页还给伙伴系统. 缺页时解压回新页.
+ *
+ * 换出一页分三步, 中间不持有mm.lock:
+ *   1. 持mm.lock把表项改成slot为0的换出表项, 用户再访问会在缺页里等待
+ *   2. 刷掉TLB, 之后没有CPU能再写这一页, 压缩得到slot
+ *   3. 持mm.lock把slot填进表项, 压缩失败时恢复原来的映射
+ * 整个过程持有task的mm_mutex, exit/exec/fork不会在中途拆掉或者复制页表.
+ */
+
+extern MM_MANAGER mm;
+extern GLOBAL_CPU *cpus;
+extern bool multi_core_start;
+extern task_manager_t task_manager;
+extern uint64_t *vir_ptable4;
+
+typedef struct SwapSlot {
+    union {
+        /// @brief 压缩数据, kmalloc得到
+        void *data;
+        /// @brief len为0时整页都是这个值
+        uint64_t fill;
+        /// @brief 空闲slot链表
+        uint64_t next_free;
+    };
+    uint32_t len;
+    uint32_t refcount;
+} SWAP_SLOT;
+
+_Static_assert(sizeof(SWAP_SLOT) * SWAP_SLOTS_PER_CHUNK == 4096, "slot chunk must be one page");
+
+/// @brief 每CPU的压缩输出缓冲与哈希表
+typedef struct SwapBuf {
+    uint8_t out[SWAP_MAX_COMPRESSED];
+    uint16_t hash[LZ_HASH_SIZE];
+} SWAP_BUF;
+
+static spinlock_t swap_lock;
+static SWAP_SLOT *chunks[SWAP_MAX_CHUNKS];
+/// @brief 从没用过的下一个slot, slot 0留给正在换出的表项
+static uint32_t next_unused = 1;
+static uint32_t free_head;
+/// @brief 待释放的压缩数据, 链表节点放在数据开头
+/// @note swap_free可能在mm.lock里调用, kfree要拿cache的锁, 顺序反了, 所以推迟到扫描时释放
+static void *dead_list;
+static uint64_t nr_dead;
+
+static SWAP_BUF *swap_bufs[MAX_CPU_NUM];
+static SWAP_STAT stat;
+
+/* 轮转扫描的位置 */
+static int scan_pid = -1;
+static uint64_t scan_addr;
+
+static inline SWAP_SLOT *slot_of(uint32_t slot)
+{
+    return &chunks[slot / SWAP_SLOTS_PER_CHUNK][slot % SWAP_SLOTS_PER_CHUNK];
+}
+
+/// @brief kmalloc为len字节实际分配的大小
+static inline uint64_t pool_size(uint32_t len)
+{
+    if (len <= (1U << KMALLOC_MIN_SHIFT))
+        return 1U << KMALLOC_MIN_SHIFT;
+    return 1UL << (32 - __builtin_clz(len - 1));
+}
+
+static uint32_t __slot_alloc_locked(void)
+{
+    if (free_head) {
+        uint32_t slot = free_head;
+        free_head = (uint32_t)slot_of(slot)->next_free;
+        return slot;
+    }
+    if (next_unused >= SWAP_MAX_CHUNKS * SWAP_SLOTS_PER_CHUNK)
+        return 0;
+    uint32_t chunk = next_unused / SWAP_SLOTS_PER_CHUNK;
+    if (!chunks[chunk]) {
+        uint64_t phy = alloc_zeroed_page_4k();
+        if (!phy)
+            return 0;
+        chunks[chunk] = easy_phy2linear(phy);
+        stat.chunk_pages++;
+    }
+    return next_unused++;
+}
+
+/// @return 释放的压缩数据块数
+static uint64_t swap_reap_dead(void)
+{
+    spin_lock(&swap_lock);
+    void *list = dead_list;
+    uint64_t nr = nr_dead;
+    dead_list = NULL;
+    nr_dead = 0;
+    spin_unlock(&swap_lock);
+    while (list) {
+        void *next = *(void **)list;
+        kfree(list);
+        list = next;
+    }
+    return nr;
+}
+
+/**
+ * @brief 压缩一页存进新的slot
+ * @return slot, 压缩效果不好或者内存不足时返回0
+ */
+uint32_t swap_store(void *page)
+{
+    uint64_t *w = page;
+    uint32_t i = 1;
+    while (i < 512 && w[i] == w[0])
+        i++;
+    void *data = NULL;
+    uint32_t len = 0;
+    if (i < 512) {
+        if (multi_core_start)
+            preempt_disable();
+        SWAP_BUF *buf = swap_bufs[get_logic_cpu_id()];
+        len = lz_compress(page, 4096, buf->out, SWAP_MAX_COMPRESSED, buf->hash);
+        if (len && (data = kmalloc(len)))
+            memcpy(data, buf->out, len);
+        if (multi_core_start)
+            preempt_enable();
+        if (!len) {
+            __atomic_add_fetch(&stat.reject, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (!data) {
+            __atomic_add_fetch(&stat.fail, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    spin_lock(&swap_lock);
+    uint32_t slot = __slot_alloc_locked();
+    if (!slot) {
+        __atomic_add_fetch(&stat.fail, 1, __ATOMIC_RELAXED);
+        spin_unlock(&swap_lock);
+        if (data)
+            kfree(data);
+        return 0;
+    }
+    SWAP_SLOT *s = slot_of(slot);
+    if (len)
+        s->data = data;
+    else
+        s->fill = w[0];
+    s->len = len;
+    s->refcount = 1;
+    stat.stored++;
+    stat.swap_out++;
+    if (len) {
+        stat.compr_bytes += len;
+        stat.pool_bytes += pool_size(len);
+    } else {
+        stat.same_filled++;
+    }
+    spin_unlock(&swap_lock);
+    return slot;
+}
+
+/// @brief 把slot的内容解压到page, slot仍然有效
+int swap_load(uint32_t slot, void *page)
+{
+    if (!slot || slot >= next_unused)
+        return -1;
+    SWAP_SLOT *s = slot_of(slot);
+    if (!s->len) {
+        uint64_t *w = page;
+        for (int i = 0; i < 512; i++)
+            w[i] = s->fill;
+        return 0;
+    }
+    return lz_decompress(s->data, s->len, page, 4096) == 4096 ? 0 : -1;
+}
+
+/// @brief fork时父子共享换出的页
+void swap_dup(uint32_t slot)
+{
+    spin_lock(&swap_lock);
+    slot_of(slot)->refcount++;
+    spin_unlock(&swap_lock);
+}
+
+void swap_free(uint32_t slot)
+{
+    spin_lock(&swap_lock);
+    SWAP_SLOT *s = slot_of(slot);
+    if (!s->refcount)
+        halt();
+    if (--s->refcount) {
+        spin_unlock(&swap_lock);
+        return;
+    }
+    stat.stored--;
+    if (s->len) {
+        stat.compr_bytes -= s->len;
+        stat.pool_bytes -= pool_size(s->len);
+        *(void **)s->data = dead_list;
+        dead_list = s->data;
+        nr_dead++;
+    } else {
+        stat.same_filled--;
+    }
+    s->next_free = free_head;
+    free_head = slot;
+    spin_unlock(&swap_lock);
+}
+
+void swap_account_in(uint64_t cycles)
+{
+    __atomic_add_fetch(&stat.swap_in, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat.in_cycles, cycles, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stat.in_cycles_max, __ATOMIC_RELAXED);
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&stat.in_cycles_max, &max, cycles, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void swap_stat(SWAP_STAT *out)
+{
+    spin_lock(&swap_lock);
+    *out = stat;
+    spin_unlock(&swap_lock);
+    uint64_t used = out->pool_bytes + out->chunk_pages * 4096;
+    out->ratio = used ? (out->stored - out->same_filled) * 4096 * 100 / used : 0;
+}
+
+/// @brief 取下一个有用户地址空间的task并拿住它的mm_mutex, 上次没扫完的task接着扫
+static pcb_t *swap_next_task(void)
+{
+    pcb_t *task;
+    pcb_t *found = NULL;
+    for (int pass = 0; pass < 2 && !found; pass++) {
+        spin_lock(&task_manager.all_list.lock);
+        list_for_each_entry(task, &task_manager.all_list.list, all_list) {
+            if (!pass && (task->pid < scan_pid || (task->pid == scan_pid && !scan_addr)))
+                continue;
+            if (task->is_ker || task->state == TASK_ZOMBIE || task->state == TASK_DEAD)
+                continue;
+            if (!mutex_trylock(&task->mm_mutex))
+                continue;
+            // fork出来的子进程在页表复制好之前还挂着内核页表
+            if (task->cr3 == (uint64_t)vir_ptable4) {
+                mutex_unlock(&task->mm_mutex);
+                continue;
+            }
+            found = task;
+            break;
+        }
+        spin_unlock(&task_manager.all_list.lock);
+    }
+    return found;
+}
+
+/// @brief 从scan_addr开始换出task的冷页, 调用者持有task->mm_mutex
+static uint64_t swap_out_task(pcb_t *task, uint64_t *scan)
+{
+    SWAP_CANDIDATE batch[SWAP_BATCH];
+    uint64_t cr3 = task->cr3;
+    uint64_t reclaimed = 0;
+    while (*scan && scan_addr < VIRTUAL_ADDR_USER_HIGHEST) {
+        uint32_t n = swap_isolate_user_pages(cr3, &scan_addr, scan, batch, SWAP_BATCH);
+        if (!n)
+            continue;
+        // task可能在别的CPU上留着带PCID的表项, 只刷新正在运行它的CPU不够
+        task_pcid_invalidate(task);
+        TLB_BATCH tlb;
+        tlb_batch_init(&tlb, cr3);
+        tlb_batch_add(&tlb, batch[0].addr, batch[n - 1].addr + 4096 - batch[0].addr);
+        tlb_batch_flush(&tlb);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t slot = swap_store(easy_phy2linear(batch[i].phy));
+            int ret = swap_finish_user_page(cr3, &batch[i], slot);
+            // 表项在换出期间被munmap清掉了, 页和slot都没人要了
+            if (ret < 0 && slot)
+                swap_free(slot);
+            if (ret < 0 || slot)
+                decrease_reference_page_4k(batch[i].phy);
+            if (!ret && slot)
+                reclaimed++;
+        }
+    }
+    return reclaimed;
+}
+
+static uint64_t swap_shrink_count(SHRINKER *shrinker)
+{
+    (void)shrinker;
+    return nr_dead + (mm.tpp - mm.tfpp);
+}
+
+/// @param nr 最多检查的已映射表项数
+static uint64_t swap_shrink_scan(SHRINKER *shrinker, uint64_t nr)
+{
+    (void)shrinker;
+    uint64_t reclaimed = swap_reap_dead();
+    int first = -1;
+    while (nr) {
+        pcb_t *task = swap_next_task();
+        if (!task)
+            break;
+        if (task->pid != scan_pid)
+            scan_addr = 0;
+        // 所有task都扫过一遍了
+        if (task->pid == first && !scan_addr) {
+            mutex_unlock(&task->mm_mutex);
+            break;
+        }
+        if (first < 0)
+            first = task->pid;
+        scan_pid = task->pid;
+        reclaimed += swap_out_task(task, &nr);
+        mutex_unlock(&task->mm_mutex);
+        if (scan_addr >= VIRTUAL_ADDR_USER_HIGHEST)
+            scan_addr = 0;
+    }
+    return reclaimed;
+}
+
+static SHRINKER swap_shrinker = {
+    .name = "swap",
+    .count = swap_shrink_count,
+    .scan = swap_shrink_scan,
+};
+
+void init_swap(void)
+{
+    spin_lock_init(&swap_lock);
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        swap_bufs[i] = kmalloc(sizeof(SWAP_BUF));
+        if (!swap_bufs[i])
+            return;
+    }
+    register_shrinker(&swap_shrinker);
+}
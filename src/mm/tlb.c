@@ -0,0 +1,185 @@
+#include "mm/tlb.h"
+#include "mm/mm.h"
+#include "machine/cpu.h"
+#include "machine/apic.h"
+#include "protect.h"
+#include "lib/io.h"
+#include "lib/safelist.h"
+
+extern GLOBAL_CPU *cpus;
+extern uint64_t *vir_ptable4;
+extern bool multi_core_start;
+
+void send_ipi(uint32_t apic_id, uint8_t vector);
+void set_EOI(void);
+
+/* 同一时刻只有一个刷新请求在途, 目标CPU处理完后清掉自己在tlb_pending中的位 */
+static spinlock_t tlb_lock;
+static struct {
+    uint64_t cr3;
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+} tlb_req;
+static volatile uint64_t tlb_pending;
+static TLB_STAT stat;
+/// @brief BSP已经可以接收刷新IPI, 在此之前只刷新本CPU
+static bool tlb_ready;
+
+/// @brief 本CPU开始参与TLB刷新, 在装好IDT之后调用
+void init_tlb_cpu(void)
+{
+    CPU_ITEM *item = &cpus->items[get_logic_cpu_id()];
+    item->active_cr3 = (uint64_t)vir_ptable4;
+    item->tlb_lazy = false;
+    item->tlb_stale = false;
+    __sync_synchronize();
+    item->tlb_online = true;
+    tlb_ready = true;
+}
+
+/// @brief 刷掉所有PCID下的所有表项, 包括全局页
+static void flush_all_contexts(void)
+{
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+static void load_kernel_cr3(CPU_ITEM *item)
+{
+    uint64_t cr3 = (uint64_t)easy_linear2phy(vir_ptable4);
+    if (pcid_enabled)
+        cr3 |= CR3_NOFLUSH;
+    item->active_cr3 = (uint64_t)vir_ptable4;
+    item->tlb_lazy = false;
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+static void tlb_flush_local(CPU_ITEM *item, uint64_t cr3, uint64_t start, uint64_t end, uint32_t flags)
+{
+    bool full = end - start > (uint64_t)TLB_FULL_FLUSH_PAGES * 4096;
+    if (!cr3) {
+        // 内核映射在每个PCID下都可能有缓存, invlpg只管当前PCID
+        if (full || pcid_enabled) {
+            flush_all_contexts();
+            return;
+        }
+        for (uint64_t addr = start & ~0xfffUL; addr < end; addr += 4096)
+            __asm__ __volatile__("invlpg (%0)" : : "r"(addr) : "memory");
+        return;
+    }
+    if (item->active_cr3 != cr3)
+        return;
+    if (flags & TLB_FREED_TABLES) {
+        load_kernel_cr3(item);
+        return;
+    }
+    if (item->tlb_lazy) {
+        item->tlb_stale = true;
+        return;
+    }
+    if (full) {
+        // 不带不刷新位重新装载, 刷掉当前PCID的表项
+        uint64_t tmp;
+        __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(tmp) : : "memory");
+        return;
+    }
+    for (uint64_t addr = start & ~0xfffUL; addr < end; addr += 4096)
+        __asm__ __volatile__("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static void tlb_handle_pending(uint32_t id)
+{
+    uint64_t bit = (uint64_t)1 << id;
+    if (!(__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE) & bit))
+        return;
+    tlb_flush_local(&cpus->items[id], tlb_req.cr3, tlb_req.start, tlb_req.end, tlb_req.flags);
+    __atomic_fetch_and(&tlb_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+/// @brief 刷新IPI的处理程序
+void tlb_shootdown_intr(void)
+{
+    tlb_handle_pending(get_logic_cpu_id());
+    set_EOI();
+}
+
+/**
+ * @brief 让所有可能缓存了[start, end)的CPU刷新TLB
+ * @param cr3 页表的虚拟地址, 0表示内核映射
+ * @note 只通知当前装载着该页表的CPU; 其他CPU上残留的PCID表项在该进程迁移回去时刷新.
+ * 修改不在运行的进程的页表时, 调用者要先用task_pcid_invalidate作废它的PCID.
+ * 懒惰地运行内核线程的CPU不会访问用户地址, 只记下标记, 切回该地址空间时再刷新.
+ * 调用者不能持有其他CPU可能关中断等待的锁(例如mm.lock)
+ */
+void tlb_shootdown(uint64_t cr3, uint64_t start, uint64_t end, uint32_t flags)
+{
+    uint8_t intr = io_cli();
+    if (!tlb_ready) {
+        // 其他CPU还没启动, 也还没有用户进程
+        if (!cr3)
+            tlb_flush_local(NULL, 0, start, end, flags);
+        io_set_intr(intr);
+        return;
+    }
+    uint32_t id = get_logic_cpu_id();
+    CPU_ITEM *item = &cpus->items[id];
+    // 等锁时也要响应别的CPU发来的请求, 否则双方互相等待
+    while (!spin_trylock(&tlb_lock)) {
+        tlb_handle_pending(id);
+        __asm__ __volatile__("pause");
+    }
+    if (multi_core_start)
+        preempt_disable();
+
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        CPU_ITEM *other = &cpus->items[i];
+        if (i == id || !other->tlb_online)
+            continue;
+        if (cr3) {
+            if (other->active_cr3 != cr3)
+                continue;
+            if (!(flags & TLB_FREED_TABLES) && other->tlb_lazy) {
+                other->tlb_stale = true;
+                __sync_synchronize();
+                // 对方可能刚好切回这个地址空间, 这时仍然要发IPI
+                if (other->tlb_lazy && other->active_cr3 == cr3) {
+                    stat.lazy_skipped++;
+                    continue;
+                }
+            }
+        }
+        mask |= (uint64_t)1 << i;
+    }
+
+    tlb_req.cr3 = cr3;
+    tlb_req.start = start;
+    tlb_req.end = end;
+    tlb_req.flags = flags;
+    stat.shootdowns++;
+    if (end - start > (uint64_t)TLB_FULL_FLUSH_PAGES * 4096)
+        stat.full_flushes++;
+    __atomic_store_n(&tlb_pending, mask, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < cpus->total_num; i++) {
+        if (mask & ((uint64_t)1 << i)) {
+            send_ipi(cpus->physic_apic_id[i], INTERRUPT_VECTOR_TLB_SHOOTDOWN);
+            stat.ipis++;
+        }
+    }
+    tlb_flush_local(item, cr3, start, end, flags);
+    while (__atomic_load_n(&tlb_pending, __ATOMIC_ACQUIRE))
+        __asm__ __volatile__("pause");
+
+    spin_unlock(&tlb_lock);
+    io_set_intr(intr);
+}
+
+void tlb_stat(TLB_STAT *out)
+{
+    uint8_t intr = spin_lock_irq_save(&tlb_lock);
+    *out = stat;
+    spin_unlock(&tlb_lock);
+    io_set_intr(intr);
+}
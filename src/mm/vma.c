@@ -0,0 +1,572 @@
+#include "mm/vma.h"
+#include "mm/mm.h"
+#include "mm/slab.h"
+#include "mm/page_pool.h"
+#include "lib/string.h"
+#include "lib/io.h"
+#include "task.h"
+#include "fs/fs.h"
+#include "fs/fcntl.h"
+#include "fs/fsmod.h"
+#include "mm/mman.h"
+
+extern MM_MANAGER mm;
+extern struct file *fd_get(pcb_t *proc, int fd);
+
+static kmem_cache_t *vma_cachep;
+
+void init_vma(void)
+{
+    vma_cachep = kmem_cache_create("vm_area", sizeof(VM_AREA), 8, NULL);
+}
+
+/// @brief 加入一段区域, 区域之间不允许重叠
+int vma_add(pcb_t *task, uint64_t start, uint64_t end, uint32_t flags,
+            struct file *file, uint64_t file_offset, uint64_t file_start, uint64_t file_end)
+{
+    if ((start & 0xfff) || (end & 0xfff) || start >= end || end > VIRTUAL_ADDR_USER_HIGHEST)
+        return -1;
+    list_head_t *pos;
+    list_head_t *target = &task->vma_list;
+    list_for_each(pos, &task->vma_list) {
+        VM_AREA *tmp = container_of(pos, VM_AREA, list);
+        if (tmp->start < end && start < tmp->end)
+            return -1;
+        if (tmp->start >= end) {
+            target = pos;
+            break;
+        }
+    }
+    VM_AREA *vma = kmem_cache_alloc(vma_cachep);
+    if (!vma)
+        return -1;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->file = file;
+    vma->file_offset = file_offset;
+    vma->file_start = file_start;
+    vma->file_end = file_end;
+    if (file)
+        atomic_inc(&file->refcount);
+    list_add_tail(&vma->list, target);
+    return 0;
+}
+
+VM_AREA *vma_find(pcb_t *task, uint64_t addr)
+{
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (addr < vma->start)
+            return NULL;
+        if (addr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+/// @brief fork时复制区域列表, 已经填充的页由页表的写时复制共享
+int vma_copy(pcb_t *dst, pcb_t *src)
+{
+    VM_AREA *vma;
+    list_for_each_entry(vma, &src->vma_list, list) {
+        if (vma_add(dst, vma->start, vma->end, vma->flags, vma->file,
+                    vma->file_offset, vma->file_start, vma->file_end))
+            return -1;
+    }
+    return 0;
+}
+
+void vma_free_all(pcb_t *task)
+{
+    task->fault_around = 1;
+    task->fault_around_start = task->fault_around_end = 0;
+    VM_AREA *vma, *n;
+    list_for_each_entry_safe(vma, n, &task->vma_list, list) {
+        list_del(&vma->list);
+        if (vma->file)
+            vfs_close(vma->file);
+        kmem_cache_free(vma_cachep, vma);
+    }
+}
+
+/// 文件内容落在页上的情况
+#define PAGE_NO_FILE 0
+/// 文件都在内存里(没有块设备的文件系统), 读取不会等待IO
+#define PAGE_FILE_CACHED 1
+#define PAGE_FILE_IO 2
+
+static int vma_page_file(pcb_t *task, uint64_t page)
+{
+    int ret = PAGE_NO_FILE;
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (!vma->file || vma->file_start >= page + 4096 || vma->file_end <= page)
+            continue;
+        if (vma->file->inode && vma->file->inode->sb && !vma->file->inode->sb->part)
+            ret = ret == PAGE_NO_FILE ? PAGE_FILE_CACHED : ret;
+        else
+            ret = PAGE_FILE_IO;
+    }
+    return ret;
+}
+
+static bool vma_page_writable(pcb_t *task, uint64_t page)
+{
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        // 段的第一页可能登记在前一段的区域里, 所以按页是否重叠判断
+        if (vma->start < page + 4096 && vma->end > page && (vma->flags & VMA_WRITE))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief 分配一页并读入落在这一页的所有文件内容, 其余部分为0
+ * @note 读文件可能睡眠, 调用者负责开中断
+ * @return 物理页, 失败返回0
+ */
+static uint64_t vma_read_page(pcb_t *task, uint64_t page)
+{
+    uint64_t phy_page = alloc_zeroed_page_4k();
+    if (!phy_page)
+        return 0;
+    uint8_t *kpage = easy_phy2linear(phy_page);
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (!vma->file)
+            continue;
+        uint64_t lo = page > vma->file_start ? page : vma->file_start;
+        uint64_t hi = page + 4096 < vma->file_end ? page + 4096 : vma->file_end;
+        if (lo >= hi)
+            continue;
+        ssize_t ret = vfs_pread(vma->file, (char *)kpage + (lo - page), hi - lo,
+                                vma->file_offset + (lo - vma->file_start));
+        if (ret < 0) {
+            decrease_reference_page_4k(phy_page);
+            return 0;
+        }
+    }
+    return phy_page;
+}
+
+static inline uint8_t vma_page_type(VM_AREA *area, bool writable)
+{
+    if ((area->flags & VMA_SHARED) && !area->file)
+        return writable ? 3 : 4;
+    return writable ? 1 : 4;
+}
+
+/**
+ * @brief 按这次缺页的位置调整task的预映射窗口, 返回这次预映射的范围[*start, *end)
+ * 紧接着上一次的范围向上或向下缺页说明是顺序访问, 窗口加倍并朝访问方向展开;
+ * 否则窗口减半, 范围按窗口大小对齐. 范围不出区域, 也不出缺页地址所在的2M块:
+ * 一次只填一张页表, 大页区域里别的2M块留给大页
+ */
+static void fault_around_window(pcb_t *task, VM_AREA *area, uint64_t page,
+                                uint64_t *start, uint64_t *end)
+{
+    uint64_t win = task->fault_around;
+    uint64_t lo, hi;
+    bool up = page == task->fault_around_end;
+    bool down = page + 4096 == task->fault_around_start;
+    if (up || down) {
+        win *= 2;
+    } else if (win > 1) {
+        win /= 2;
+    }
+    if (win > task->fault_around_max)
+        win = task->fault_around_max ? task->fault_around_max : 1;
+    uint64_t size = win << 12;
+    if (up) {
+        lo = page;
+        hi = page + size;
+    } else if (down) {
+        hi = page + 4096;
+        lo = hi > size ? hi - size : 0;
+    } else {
+        lo = page - page % size;
+        hi = lo + size;
+    }
+    uint64_t block = page & ~(HUGE_PAGE_SIZE - 1);
+    if (lo < area->start)
+        lo = area->start;
+    if (lo < block)
+        lo = block;
+    if (hi > area->end)
+        hi = area->end;
+    if (hi > block + HUGE_PAGE_SIZE)
+        hi = block + HUGE_PAGE_SIZE;
+    task->fault_around = win;
+    task->fault_around_start = *start = lo;
+    task->fault_around_end = *end = hi;
+}
+
+/**
+ * @brief 缺页处理完之后映射窗口内其余还没有映射的页
+ * 匿名页: 读缺页映射零页, 写缺页只用预清零池里现成的页, 池空就停;
+ * 文件页: 只填文件内容已经在内存里的页, 需要读盘的留给它自己缺页
+ * @note 已经映射或者换出的页不动; 调用时关中断, 读文件时按intr开中断
+ */
+static void fault_around(pcb_t *task, VM_AREA *area, uint64_t page, bool write, bool intr)
+{
+    uint64_t start, end;
+    fault_around_window(task, area, page, &start, &end);
+    if (end - start <= 4096)
+        return;
+    if (intr)
+        io_sti();
+    for (uint64_t addr = start; addr < end; addr += 4096) {
+        if (addr == page)
+            continue;
+        int file = vma_page_file(task, addr);
+        bool writable = vma_page_writable(task, addr);
+        uint64_t phy;
+        if (file == PAGE_FILE_IO || (file == PAGE_FILE_CACHED && !intr))
+            continue;
+        if (file == PAGE_NO_FILE && (area->flags & VMA_SHARED))
+            continue;
+        if (file == PAGE_FILE_CACHED) {
+            phy = vma_read_page(task, addr);
+        } else if (write && writable) {
+            phy = try_alloc_zeroed_page_4k();
+        } else {
+            phy = mm.zero_page;
+        }
+        if (!phy)
+            break;
+        if (try_put_user_page_4k(phy, addr, task->cr3, vma_page_type(area, writable))) {
+            if (phy != mm.zero_page)
+                decrease_reference_page_4k(phy);
+            continue;
+        }
+        mm.fault_around_map++;
+    }
+    io_cli();
+}
+
+/**
+ * @brief 用户态地址缺页时按区域填充一页, 并按预映射窗口填充同一区域内相邻的页
+ * @param write 是否是写访问, 写不可写的区域返回失败
+ * @param intr 缺页前是否开中断, 读文件可能睡眠, 只有开中断时才允许
+ * @note 相邻两段可能共用一页, 所有文件内容落在这一页的区域都要填充
+ * @return 0 已处理, 1 不在任何区域内且不在mmap范围, -1 失败
+ */
+int vma_fault(pcb_t *task, uint64_t addr, bool write, bool intr)
+{
+    uint64_t page = addr & 0xfffffffffffff000;
+    VM_AREA *area = vma_find(task, addr);
+    if (!area) {
+        // mmap范围内没有区域说明已经munmap或者从未映射
+        if (addr >= VIRTUAL_ADDR_USER_MMAP_START && addr < VIRTUAL_ADDR_USER_MMAP_END)
+            return -1;
+        return 1;
+    }
+    if (!(area->flags & VMA_ACCESS))
+        return -1;
+
+    bool writable = vma_page_writable(task, page);
+    if (write && !writable)
+        return -1;
+
+    if ((area->flags & VMA_HUGE) && !area->file) {
+        uint64_t huge = addr & ~(HUGE_PAGE_SIZE - 1);
+        // 只有整个2M块都在区域内才用大页, 否则或者没有连续内存时退回4K页
+        if (huge >= area->start && huge + HUGE_PAGE_SIZE <= area->end) {
+            uint64_t phy = alloc_huge_page_2m();
+            if (phy) {
+                if (intr)
+                    io_sti();
+                memset(easy_phy2linear(phy), 0, HUGE_PAGE_SIZE);
+                io_cli();
+                if (!put_user_page_2m(phy, huge, task->cr3))
+                    return 0;
+                put_huge_page_2m(phy);
+            }
+            mm.huge_fallback++;
+        }
+    }
+
+    // 没有文件内容落在这一页的私有页, 读缺页先映射零页
+    bool has_file = vma_page_file(task, page) != PAGE_NO_FILE;
+    if (!write && !has_file && !(area->flags & VMA_SHARED)) {
+        if (put_zero_page_4k(page, task->cr3))
+            return -1;
+        fault_around(task, area, page, write, intr);
+        return 0;
+    }
+
+    if (intr)
+        io_sti();
+    uint64_t phy_page = has_file ? vma_read_page(task, page) : alloc_zeroed_page_4k();
+    io_cli();
+    if (!phy_page)
+        return -1;
+    if (put_page_4k(phy_page, page, task->cr3, vma_page_type(area, writable))) {
+        decrease_reference_page_4k(phy_page);
+        return -1;
+    }
+    fault_around(task, area, page, write, intr);
+    return 0;
+}
+
+/// @brief 把区域在addr处拆成两段, 返回后一段
+static VM_AREA *vma_split(VM_AREA *vma, uint64_t addr)
+{
+    VM_AREA *tail = kmem_cache_alloc(vma_cachep);
+    if (!tail)
+        return NULL;
+    *tail = *vma;
+    tail->start = addr;
+    vma->end = addr;
+    if (vma->file) {
+        if (tail->file_start < addr) {
+            tail->file_offset += addr - tail->file_start;
+            tail->file_start = addr;
+        }
+        if (vma->file_end > addr)
+            vma->file_end = addr;
+        atomic_inc(&vma->file->refcount);
+    }
+    list_add(&tail->list, &vma->list);
+    return tail;
+}
+
+/// @brief 保证[start, end)的两端都落在区域边界上
+static int vma_split_range(pcb_t *task, uint64_t start, uint64_t end)
+{
+    VM_AREA *vma = vma_find(task, start);
+    if (vma && vma->start < start && !vma_split(vma, start))
+        return -1;
+    vma = vma_find(task, end);
+    if (vma && vma->start < end && !vma_split(vma, end))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief 删除[start, end)内的区域并释放已经填充的页
+ * @note 先拆页表再删区域: 拆大页内存不足时区域和其中的页都原样保留
+ */
+int vma_unmap(pcb_t *task, uint64_t start, uint64_t end)
+{
+    if (vma_split_range(task, start, end))
+        return -1;
+    if (unmap_user_range(task->cr3, start, end))
+        return -1;
+    VM_AREA *vma, *n;
+    list_for_each_entry_safe(vma, n, &task->vma_list, list) {
+        if (vma->start >= end)
+            break;
+        if (vma->end <= start)
+            continue;
+        list_del(&vma->list);
+        if (vma->file)
+            vfs_close(vma->file);
+        kmem_cache_free(vma_cachep, vma);
+    }
+    return 0;
+}
+
+/**
+ * @brief 修改[start, end)的访问权限
+ * @note 范围必须被区域连续覆盖, 共享的文件映射不允许写
+ */
+int vma_protect(pcb_t *task, uint64_t start, uint64_t end, uint32_t access)
+{
+    uint64_t next = start;
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (vma->end <= next)
+            continue;
+        if (vma->start > next)
+            return -1;
+        if ((access & VMA_WRITE) && vma->file && (vma->flags & VMA_SHARED))
+            return -1;
+        next = vma->end;
+        if (next >= end)
+            break;
+    }
+    if (next < end)
+        return -1;
+    if (vma_split_range(task, start, end))
+        return -1;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (vma->start >= end)
+            break;
+        if (vma->end > start)
+            vma->flags = (vma->flags & ~VMA_ACCESS) | access;
+    }
+    uint32_t prot = 0;
+    if (access)
+        prot |= USER_PROT_ACCESS;
+    if (access & VMA_WRITE)
+        prot |= USER_PROT_WRITE;
+    return protect_user_range(task->cr3, start, end, prot);
+}
+
+/// @brief 在mmap范围内找一段长len的空闲地址, 2M以上的按2M对齐以便使用大页
+uint64_t vma_get_unmapped(pcb_t *task, uint64_t len)
+{
+    uint64_t align = len >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 4096;
+    uint64_t addr = VIRTUAL_ADDR_USER_MMAP_START;
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (vma->end <= addr)
+            continue;
+        if (vma->start >= addr + len)
+            break;
+        addr = (vma->end + align - 1) & ~(align - 1);
+    }
+    if (addr + len > VIRTUAL_ADDR_USER_MMAP_END)
+        return 0;
+    return addr;
+}
+
+static uint32_t prot_to_vma(int prot)
+{
+    uint32_t flags = 0;
+    if (prot & PROT_READ)
+        flags |= VMA_READ;
+    if (prot & PROT_WRITE)
+        flags |= VMA_READ | VMA_WRITE;
+    if (prot & PROT_EXEC)
+        flags |= VMA_READ | VMA_EXEC;
+    return flags;
+}
+
+/**
+ * @brief 建立匿名或文件映射
+ * @note 文件映射只支持只读共享和私有映射, 私有映射写时复制到匿名页, 不会写回文件
+ * @return 映射的起始地址, 失败返回MAP_FAILED
+ */
+void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    pcb_t *current = get_current();
+    uint64_t start = (uint64_t)addr;
+    uint64_t len = (length + 4095) & ~0xfffUL;
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (!length || !len || (offset & 0xfff) || offset < 0)
+        return MAP_FAILED;
+    if (type != MAP_SHARED && type != MAP_PRIVATE)
+        return MAP_FAILED;
+
+    struct file *file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        file = fd_get(current, fd);
+        if (!file || !file->inode)
+            return MAP_FAILED;
+        uint32_t mode = file->inode->mode & S_IFMT;
+        if (mode != S_IFREG)
+            return MAP_FAILED;
+        if ((file->flags & O_ACCMODE) == O_WRONLY)
+            return MAP_FAILED;
+        if (type == MAP_SHARED && (prot & PROT_WRITE))
+            return MAP_FAILED;
+    }
+
+    if (flags & MAP_FIXED) {
+        if ((start & 0xfff) || start + len < start || start + len > VIRTUAL_ADDR_USER_HIGHEST || !start)
+            return MAP_FAILED;
+        if (vma_unmap(current, start, start + len))
+            return MAP_FAILED;
+    } else {
+        start = vma_get_unmapped(current, len);
+        if (!start)
+            return MAP_FAILED;
+    }
+
+    uint32_t vma_flags = prot_to_vma(prot);
+    if (type == MAP_SHARED)
+        vma_flags |= VMA_SHARED;
+    else if (!file)
+        vma_flags |= VMA_HUGE;
+    if (vma_add(current, start, start + len, vma_flags, file,
+                file ? (uint64_t)offset : 0, start, file ? start + len : start))
+        return MAP_FAILED;
+
+    if (type == MAP_SHARED && !file) {
+        // 共享匿名页必须在fork之前存在, 否则父子各自缺页会得到不同的页
+        if ((len >> 12) > mm.tfpp) {
+            vma_unmap(current, start, start + len);
+            return MAP_FAILED;
+        }
+        for (uint64_t page = start; page < start + len; page += 4096) {
+            uint64_t phy = alloc_zeroed_page_4k();
+            if (phy && put_page_4k(phy, page, current->cr3, 3)) {
+                decrease_reference_page_4k(phy);
+                phy = 0;
+            }
+            if (!phy) {
+                vma_unmap(current, start, start + len);
+                return MAP_FAILED;
+            }
+        }
+        if (!(prot & PROT_WRITE))
+            protect_user_range(current->cr3, start, start + len,
+                               prot ? USER_PROT_ACCESS : 0);
+    }
+    return (void *)start;
+}
+
+int sys_munmap(void *addr, size_t length)
+{
+    uint64_t start = (uint64_t)addr;
+    uint64_t len = (length + 4095) & ~0xfffUL;
+    if ((start & 0xfff) || !len || start + len < start || start + len > VIRTUAL_ADDR_USER_HIGHEST)
+        return -1;
+    return vma_unmap(get_current(), start, start + len);
+}
+
+/**
+ * @brief 对[addr, addr + length)的使用建议
+ * @note 只有MADV_DONTNEED有实际动作: 释放已经映射的页但保留区域;
+ *       共享匿名映射的页只存在于页表里, 丢掉就找不回来, 所以不允许
+ */
+int sys_madvise(void *addr, size_t length, int advice)
+{
+    uint64_t start = (uint64_t)addr;
+    uint64_t len = (length + 4095) & ~0xfffUL;
+    if ((start & 0xfff) || !len || start + len < start || start + len > VIRTUAL_ADDR_USER_HIGHEST)
+        return -1;
+    if (advice == MADV_NORMAL || advice == MADV_WILLNEED)
+        return 0;
+    if (advice != MADV_DONTNEED)
+        return -1;
+    pcb_t *task = get_current();
+    VM_AREA *vma;
+    list_for_each_entry(vma, &task->vma_list, list) {
+        if (vma->start < start + len && vma->end > start && (vma->flags & VMA_SHARED))
+            return -1;
+    }
+    return unmap_user_range(task->cr3, start, start + len);
+}
+
+int sys_mprotect(void *addr, size_t length, int prot)
+{
+    uint64_t start = (uint64_t)addr;
+    uint64_t len = (length + 4095) & ~0xfffUL;
+    if ((start & 0xfff) || !len || start + len < start || start + len > VIRTUAL_ADDR_USER_HIGHEST)
+        return -1;
+    return vma_protect(get_current(), start, start + len, prot_to_vma(prot));
+}
+
+/**
+ * @brief 设置当前进程缺页预映射窗口的上限, fork时继承
+ * @param pages 窗口上限(页), 0关闭预映射, 负数只查询
+ * @return 原来的上限, 超过FAULT_AROUND_MAX返回-1
+ */
+int sys_fault_around(int pages)
+{
+    pcb_t *task = get_current();
+    int old = (int)task->fault_around_max;
+    if (pages < 0)
+        return old;
+    if (pages > FAULT_AROUND_MAX)
+        return -1;
+    task->fault_around_max = (uint32_t)pages;
+    if (task->fault_around > task->fault_around_max)
+        task->fault_around = pages ? (uint32_t)pages : 1;
+    return old;
+}
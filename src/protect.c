@@ -7,9 +7,17 @@
 #include "machine/cpu.h"
 #include "protect.h"
 #include "lib/io.h"
+#include "mm/vma.h"
+#include "mm/tlb.h"
+#include "mm/swap.h"
 
 extern GLOBAL_CPU *cpus;
 
+#define CPUID_PCID (1 << 17)
+
+bool pcid_enabled;
+extern bool cmdline_nopcid;
+
 /* 所有的异常处理函数 */
 void Divide_Error(void);
 void Debug(void);
@@ -57,6 +65,9 @@ void intr20(void);
 void intr21(void);
 void intr22(void);
 void intr23(void);
+void intr_tlb_shootdown(void);
+void intr_lapic_timer(void);
+void intr_reschedule(void);
 
 void syscall_enter(void);
 
@@ -138,10 +149,30 @@ void init_protect(uint8_t is_bsp)
     }else {
         make_idt_descriptor(idt_table, INTERRUPT_VECTOR_TIMER, (unsigned long)intr2,0,3,IDT_INTERRUPT_GATE);
     }
+    make_idt_descriptor(idt_table, INTERRUPT_VECTOR_TLB_SHOOTDOWN, (unsigned long)intr_tlb_shootdown, 0, 3, IDT_INTERRUPT_GATE);
+    make_idt_descriptor(idt_table, INTERRUPT_VECTOR_LAPIC_TIMER, (unsigned long)intr_lapic_timer, 0, 3, IDT_INTERRUPT_GATE);
+    make_idt_descriptor(idt_table, INTERRUPT_VECTOR_RESCHEDULE, (unsigned long)intr_reschedule, 0, 3, IDT_INTERRUPT_GATE);
     
     uint64_t* phy_addr = (uint64_t*)(alloc_page_4k() + 0x1000);
     tss->ist1 = (uint64_t)phy_addr;
     load_protect(gdt_ptr, idt_ptr);
+
+    /* 内核态写只读页也要触发缺页, 写时复制依赖这一点 */
+    write_cr0(read_cr0() | CR0_WP);
+
+    /* 进程切换时用PCID区分地址空间, 此时CR3的低12位为0, 可以直接打开 */
+    uint64_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (is_bsp)
+        pcid_enabled = (ecx & CPUID_PCID) && !cmdline_nopcid;
+    if (pcid_enabled) {
+        if (!(ecx & CPUID_PCID))
+            halt();
+        cpu->pcid_gen = 1;
+        cpu->pcid_next = 1;
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+    init_tlb_cpu();
 }
 
 void make_idt_descriptor(uint64_t* idt_table, uint32_t n, uint64_t addr, uint64_t ist, uint64_t dpl, uint64_t type)
@@ -190,13 +221,41 @@ void exception_handler(
             current->fpu.fpu_dirty = true;
             return;
         case 14:
+            if ((error_no & PAGEFAULT_PRESENT) && (error_no & PAGEFAULT_WRITE)) {
+                unsigned long vir_addr;
+                __asm__ __volatile__("mov %%cr2, %0" : "=r"(vir_addr));
+                if (!do_cow_fault(vir_addr, current->cr3))
+                    return;
+                break;
+            }
             if ((error_no & PAGEFAULT_PRESENT) == 0) {
                 unsigned long vir_page;
                 __asm__ __volatile__("mov %%cr2, %0" : "=r"(vir_page));
                 vir_page = (vir_page >> 12) << 12;
                 if (vir_page < VIRTUAL_ADDR_USER_HIGHEST && vir_page != 0){
-                    uint64_t phy_page = (uint64_t)easy_linear2phy(kmalloc(4096));
-                    put_page_4k(phy_page,vir_page,current->cr3,1);
+                    // 压缩换出的页先换回来
+                    int ret = swap_in_user_page(vir_page, current->cr3);
+                    if (ret == 0)
+                        return;
+                    if (ret < 0)
+                        break;
+                    ret = vma_fault(current, vir_page, error_no & PAGEFAULT_WRITE, rflags & 0x200);
+                    if (ret == 0)
+                        return;
+                    if (ret < 0)
+                        break;
+                    // 读缺页先共享零页, 真正写入时再分配
+                    if (error_no & PAGEFAULT_WRITE) {
+                        uint64_t phy_page = alloc_zeroed_page_4k();
+                        if (!phy_page)
+                            break;
+                        if (put_page_4k(phy_page,vir_page,current->cr3,1)) {
+                            decrease_reference_page_4k(phy_page);
+                            break;
+                        }
+                    } else if (put_zero_page_4k(vir_page,current->cr3)) {
+                        break;
+                    }
                     __asm__ __volatile__("invlpg (%0);" ::"r"(vir_page) : "memory");
                     return;
                 }else break;
@@ -32,6 +32,15 @@ void sys_clock_gettime(void *addr);
 int sys_pipe(int pipe[2]);
 int sys_fstat(int fd, stat_t *stat);
 int sys_uuid_config(char *path, char uuid[37], bool read);
+void *sys_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int sys_munmap(void *addr, size_t length);
+int sys_mprotect(void *addr, size_t length, int prot);
+int sys_madvise(void *addr, size_t length, int advice);
+int sys_fault_around(int pages);
+int sys_nice(int inc);
+int sys_nanosleep(const void *req, void *rem);
+int sys_clock_nanosleep(int clock, int flags, const void *req, void *rem);
+int sys_memstat(char *buf, size_t size);
 
 void *syscall_table[MAX_SYSCALL_NUM] = {
     sys_time,
@@ -65,4 +74,13 @@ void *syscall_table[MAX_SYSCALL_NUM] = {
     sys_pipe,
     sys_fstat,
     sys_uuid_config,
+    sys_mmap,
+    sys_munmap,
+    sys_mprotect,
+    sys_madvise,
+    sys_fault_around,
+    sys_nice,
+    sys_nanosleep,
+    sys_clock_nanosleep,
+    sys_memstat,
 };
@@ -6,6 +6,10 @@
 #include "lib/string.h"
 #include "view/view.h"
 #include "lib/io.h"
+#include "mm/vma.h"
+#include "task.h"
+
+extern struct file *fd_get(pcb_t *proc, int fd);
 
 const char elfMagic[] = { 0x7f, 'E', 'L', 'F' };
 
@@ -45,33 +49,54 @@ fail:
     return (void*)0;
 }
 
-int elf_file_copy(int fd, elf64_header_t* header, uint64_t cr3)
+/// @brief 为每个PT_LOAD段登记一段区域, 页面在第一次访问时才从文件读入
+int elf_file_map(int fd, elf64_header_t* header, pcb_t *task)
 {
-    elf64_part_header_t* p_header_tbl = kmalloc(sizeof(elf64_part_header_t) * header->elf_part_header_num);
+    struct file *file = fd_get(task, fd);
+    if (!file)
+        return -1;
+    size_t size = sizeof(elf64_part_header_t) * header->elf_part_header_num;
+    elf64_part_header_t* p_header_tbl = kmalloc(size);
+    if (!p_header_tbl)
+        return -1;
     sys_lseek(fd,header->elf_part_header_offset,SEEK_SET);
-    sys_read(fd,(void*)p_header_tbl,sizeof(elf64_part_header_t) * header->elf_part_header_num);
+    if (sys_read(fd,(void*)p_header_tbl,size) != (ssize_t)size) {
+        kfree(p_header_tbl);
+        return -1;
+    }
     uint64_t start_addr, end_addr;
-    uint64_t temp;
+    int ret = 0;
     for (int i = 0; i < header->elf_part_header_num; i++) {
-        if (p_header_tbl[i].part_type == ELF_PART_TYPE_LOAD) {
-            start_addr = p_header_tbl[i].part_vaddr & 0xfffffffffffff000;
-            end_addr = (p_header_tbl[i].part_vaddr + p_header_tbl[i].part_mem_size + 0xfff) & 0xfffffffffffff000;
-            for (uint64_t j = start_addr; j <= end_addr; j += 4096) {
-                if (!exist_page_4k(j,cr3)) {
-                    temp = (uint64_t)easy_linear2phy(kmalloc(4096));
-                    uint8_t intr = io_cli();
-                    put_page_4k(temp,j,cr3,1);
-                    io_set_intr(intr);
-                }
-            }
-            sys_lseek(fd,p_header_tbl[i].part_offset,SEEK_SET);
-            sys_read(fd,(void*)p_header_tbl[i].part_vaddr,p_header_tbl[i].part_file_size);
-            // 如果 p_memsz > p_filesz，剩余部分清零（即 BSS）
-            if (p_header_tbl[i].part_mem_size > p_header_tbl[i].part_file_size) {
-                memset((void*)(p_header_tbl[i].part_vaddr + p_header_tbl[i].part_file_size), 0,
-                       p_header_tbl[i].part_mem_size - p_header_tbl[i].part_file_size);
+        elf64_part_header_t *part = &p_header_tbl[i];
+        if (part->part_type != ELF_PART_TYPE_LOAD || !part->part_mem_size)
+            continue;
+        start_addr = part->part_vaddr & 0xfffffffffffff000;
+        end_addr = (part->part_vaddr + part->part_mem_size + 0xfff) & 0xfffffffffffff000;
+        uint32_t flags = 0;
+        if (part->part_flags & ELF_PART_FLAGS_R)
+            flags |= VMA_READ;
+        if (part->part_flags & ELF_PART_FLAGS_W)
+            flags |= VMA_WRITE;
+        if (part->part_flags & ELF_PART_FLAGS_X)
+            flags |= VMA_EXEC;
+        // 两段落在同一页时, 后一段从下一页开始登记, 共享页由缺页时一起填充.
+        // 只有共享页取两段权限的并集, 拆成单独一页的区域, 前一段的其余部分不变
+        VM_AREA *prev = vma_find(task, start_addr);
+        if (prev) {
+            if (vma_protect(task, start_addr, start_addr + 4096, (prev->flags | flags) & VMA_ACCESS)) {
+                ret = -1;
+                break;
             }
+            start_addr += 4096;
+            if (start_addr >= end_addr)
+                continue;
+        }
+        if (vma_add(task, start_addr, end_addr, flags, file, part->part_offset,
+                    part->part_vaddr, part->part_vaddr + part->part_file_size)) {
+            ret = -1;
+            break;
         }
     }
-    return 0;
+    kfree(p_header_tbl);
+    return ret;
 }
@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "const.h"
+#include "task.h"
+#include "machine/cpu.h"
+#include "lib/io.h"
+
+/**
+ * 公平调度
+ * 每个任务按权重累计虚拟运行时间vruntime, 就绪任务按vruntime挂在本CPU的红黑树上,
+ * 每次选vruntime最小的运行. 一个调度周期内各任务按权重分时间片, 用完或者落后太多就切换.
+ * 睡眠醒来的任务最多补偿半个调度周期, vruntime明显更小时在下一个时钟中断抢占当前任务.
+ * vruntime只在同一CPU上可比, 迁移时按两边的min_vruntime换算.
+ */
+
+extern GLOBAL_CPU *cpus;
+extern uint64_t hpet_read_ns(void);
+extern void sched_kick(CPU_ITEM *cpu);
+
+/// nice -20..19对应的权重, 相邻两级相差约1.25倍(CPU时间约差10%)
+static const uint32_t nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+static inline bool vruntime_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+static inline pcb_t *rq_first(cfs_rq_t *rq)
+{
+    return rq->leftmost ? rb_entry(rq->leftmost, pcb_t, run_node) : NULL;
+}
+
+/// @brief 实际运行时间折算成task的vruntime增量
+static inline uint64_t calc_delta_fair(uint64_t delta, pcb_t *task)
+{
+    if (task->weight == NICE_0_WEIGHT)
+        return delta;
+    return delta * NICE_0_WEIGHT / task->weight;
+}
+
+static void set_task_nice(pcb_t *task, int nice)
+{
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    task->nice = nice;
+    task->weight = nice_to_weight[nice - NICE_MIN];
+}
+
+void init_cfs_rq(cfs_rq_t *rq)
+{
+    spin_lock_init(&rq->lock);
+    rq->tasks = RB_ROOT;
+    rq->leftmost = NULL;
+    rq->min_vruntime = 0;
+    rq->load = 0;
+}
+
+/// @brief 新任务继承父任务的nice, vruntime在第一次入队时放置
+void sched_fork(pcb_t *task, pcb_t *parent)
+{
+    set_task_nice(task, parent ? parent->nice : 0);
+    task->on_rq = false;
+    task->vruntime = 0;
+    task->exec_start = 0;
+    task->sum_exec = 0;
+    task->slice_start = 0;
+}
+
+/// @brief 调度周期, 任务多时拉长到每个任务至少SCHED_MIN_GRAN_NS
+static inline uint64_t sched_period(uint32_t nr)
+{
+    uint32_t nr_latency = SCHED_LATENCY_NS / SCHED_MIN_GRAN_NS;
+    if (nr > nr_latency)
+        return nr * SCHED_MIN_GRAN_NS;
+    return SCHED_LATENCY_NS;
+}
+
+/// @brief task在一个调度周期中按权重分到的运行时间
+static uint64_t sched_slice(CPU_ITEM *cpu, pcb_t *task)
+{
+    uint64_t load = cpu->rq.load;
+    uint32_t nr = cpu->total_ready_num;
+    if (!task->on_rq) {
+        load += task->weight;
+        nr++;
+    }
+    return sched_period(nr) * task->weight / load;
+}
+
+/// @brief min_vruntime取当前任务与树中最小者的较小值, 但不回退
+static void update_min_vruntime(cfs_rq_t *rq, pcb_t *curr)
+{
+    pcb_t *first = rq_first(rq);
+    uint64_t vruntime;
+    if (curr && first)
+        vruntime = vruntime_before(curr->vruntime, first->vruntime) ? curr->vruntime : first->vruntime;
+    else if (curr)
+        vruntime = curr->vruntime;
+    else if (first)
+        vruntime = first->vruntime;
+    else
+        return;
+    if (vruntime_before(rq->min_vruntime, vruntime))
+        rq->min_vruntime = vruntime;
+}
+
+/**
+ * @brief 把当前任务上次记账以来的运行时间计入vruntime
+ * @note 已经放回树中的任务不再记账, 否则会破坏树的顺序
+ */
+void update_curr(CPU_ITEM *cpu)
+{
+    pcb_t *curr = cpu->now_running;
+    if (curr == cpu->idle || curr->on_rq)
+        return;
+    uint64_t now = hpet_read_ns();
+    int64_t delta = (int64_t)(now - curr->exec_start);
+    curr->exec_start = now;
+    if (delta <= 0)
+        return;
+    curr->sum_exec += delta;
+    curr->vruntime += calc_delta_fair(delta, curr);
+    update_min_vruntime(&cpu->rq, curr);
+}
+
+static void __enqueue(cfs_rq_t *rq, pcb_t *task)
+{
+    rb_node_t **link = &rq->tasks.node;
+    rb_node_t *parent = NULL;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        pcb_t *entry = rb_entry(parent, pcb_t, run_node);
+        // vruntime相同时排在后面, 先来先运行
+        if (vruntime_before(task->vruntime, entry->vruntime)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    if (leftmost)
+        rq->leftmost = &task->run_node;
+    rb_link_node(&task->run_node, parent, link);
+    rb_insert_color(&task->run_node, &rq->tasks);
+}
+
+static void __dequeue(cfs_rq_t *rq, pcb_t *task)
+{
+    if (rq->leftmost == &task->run_node)
+        rq->leftmost = rb_next(&task->run_node);
+    rb_erase(&task->run_node, &rq->tasks);
+}
+
+/// @brief 醒来的任务vruntime比当前任务小得足够多时, 请求下一个时钟中断切换
+static void check_preempt_wakeup(CPU_ITEM *cpu, pcb_t *task)
+{
+    pcb_t *curr = cpu->now_running;
+    // idle在下一个时钟中断看到树不空就会让出
+    if (curr == cpu->idle || curr == task)
+        return;
+    int64_t diff = (int64_t)(curr->vruntime - task->vruntime);
+    if (diff > (int64_t)calc_delta_fair(SCHED_WAKEUP_GRAN_NS, task))
+        cpu->need_resched = true;
+}
+
+/**
+ * @brief 任务放入cpu的就绪树
+ * @param flags ENQUEUE_NEW: 新任务排在一个时间片之后, 避免不停fork挤占已有任务;
+ * ENQUEUE_WAKEUP: 睡眠期间vruntime没有增长, 最多补偿半个调度周期
+ */
+void enqueue_task(CPU_ITEM *cpu, pcb_t *task, int flags)
+{
+    cfs_rq_t *rq = &cpu->rq;
+    if (task->on_rq)
+        return;
+    if (flags & ENQUEUE_NEW) {
+        task->vruntime = rq->min_vruntime + calc_delta_fair(sched_slice(cpu, task), task);
+    } else if (flags & ENQUEUE_WAKEUP) {
+        uint64_t floor = rq->min_vruntime - SCHED_LATENCY_NS / 2;
+        if (vruntime_before(task->vruntime, floor))
+            task->vruntime = floor;
+    }
+    __enqueue(rq, task);
+    task->on_rq = true;
+    rq->load += task->weight;
+    cpu->total_ready_num++;
+    if (flags & ENQUEUE_WAKEUP)
+        check_preempt_wakeup(cpu, task);
+    sched_kick(cpu);
+}
+
+void dequeue_task(CPU_ITEM *cpu, pcb_t *task)
+{
+    if (!task->on_rq)
+        return;
+    __dequeue(&cpu->rq, task);
+    task->on_rq = false;
+    cpu->rq.load -= task->weight;
+    cpu->total_ready_num--;
+}
+
+/**
+ * @brief 取出vruntime最小的任务作为下一个运行的任务, 树空时返回idle
+ * @note 调用前要先update_curr给被换下的任务记账
+ */
+pcb_t *pick_next_task(CPU_ITEM *cpu)
+{
+    cpu->need_resched = false;
+    pcb_t *task = rq_first(&cpu->rq);
+    if (!task)
+        return cpu->idle;
+    dequeue_task(cpu, task);
+    update_min_vruntime(&cpu->rq, task);
+    task->exec_start = hpet_read_ns();
+    task->slice_start = task->sum_exec;
+    return task;
+}
+
+/// @brief 当前任务让出CPU: 排到vruntime最小的任务之后再放回树中
+void yield_task(CPU_ITEM *cpu)
+{
+    pcb_t *curr = cpu->now_running;
+    if (curr == cpu->idle)
+        return;
+    update_curr(cpu);
+    pcb_t *first = rq_first(&cpu->rq);
+    if (first && vruntime_before(curr->vruntime, first->vruntime))
+        curr->vruntime = first->vruntime;
+    curr->state = TASK_STATE_READY;
+    enqueue_task(cpu, curr, 0);
+}
+
+/**
+ * @brief 时钟中断中给当前任务记账
+ * @return 是否需要切换: 时间片用完, 或者运行够最小粒度后vruntime超出最小者一个时间片
+ */
+bool sched_tick(CPU_ITEM *cpu)
+{
+    pcb_t *curr = cpu->now_running;
+    pcb_t *first = rq_first(&cpu->rq);
+    if (curr == cpu->idle)
+        return first != NULL;
+    update_curr(cpu);
+    if (!first)
+        return false;
+    if (cpu->need_resched)
+        return true;
+    uint64_t ran = curr->sum_exec - curr->slice_start;
+    uint64_t slice = sched_slice(cpu, curr);
+    if (ran >= slice)
+        return true;
+    if (ran < SCHED_MIN_GRAN_NS)
+        return false;
+    return (int64_t)(curr->vruntime - first->vruntime) > (int64_t)slice;
+}
+
+/**
+ * @brief 把就绪的task从from移到to
+ * @warning 调用者持有两个CPU的rq.lock
+ */
+void migrate_task(CPU_ITEM *from, CPU_ITEM *to, pcb_t *task)
+{
+    dequeue_task(from, task);
+    task->vruntime = task->vruntime - from->rq.min_vruntime + to->rq.min_vruntime;
+    enqueue_task(to, task, 0);
+}
+
+/**
+ * @brief task刚在原CPU上运行过, 缓存里多半还有它的数据
+ * @note exec_start在被换下时由update_curr更新, 就是最后一次运行的时刻
+ */
+bool task_cache_hot(pcb_t *task, uint64_t now)
+{
+    if (!task->exec_start)
+        return false;
+    return (int64_t)(now - task->exec_start) < (int64_t)SCHED_MIGRATION_COST_NS;
+}
+
+int sys_nice(int inc)
+{
+    uint8_t intr = io_cli();
+    CPU_ITEM *cpu = &cpus->items[get_logic_cpu_id()];
+    pcb_t *curr = cpu->now_running;
+    spin_lock(&cpu->rq.lock);
+    // 先按旧权重记账, 之后的运行时间按新权重折算
+    update_curr(cpu);
+    if (inc < NICE_MIN - NICE_MAX)
+        inc = NICE_MIN - NICE_MAX;
+    if (inc > NICE_MAX - NICE_MIN)
+        inc = NICE_MAX - NICE_MIN;
+    set_task_nice(curr, curr->nice + inc);
+    int nice = curr->nice;
+    spin_unlock(&cpu->rq.lock);
+    io_set_intr(intr);
+    return nice;
+}
@@ -7,6 +7,7 @@
 #include "lib/io.h"
 #include "lib/timer.h"
 #include "fs/fs.h"
+#include "mm/vma.h"
 
 extern GLOBAL_CPU *cpus;
 
@@ -21,15 +22,20 @@ extern void idle(void);
 
 task_manager_t task_manager;
 pcb_t *pcb_of_init;
+/// pcb与内核栈一起分配, 每个对象DEFAULT_PCB_SIZE字节
+static kmem_cache_t *pcb_cachep;
 
 static uint32_t alloc_pid_and_add_to_all_list(pcb_t *new_task);
 static void add_to_cpu_n_ready_list(pcb_t *task,uint32_t n);
 static void free_task(pcb_t *task);
-static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void *arg);
+static void unput_thread(pcb_t *task);
+static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void *arg,uint32_t cpu);
 static pcb_t *kernel_thread(char *name, void *addr,pcb_t *parent,uint32_t n,void *arg);
 
 void init_task(void)
 {
+    // 只需满足fxsave区和栈的16字节对齐, 按页对齐会让每个slab的描述符独占一页
+    pcb_cachep = kmem_cache_create("pcb", DEFAULT_PCB_SIZE, __alignof__(pcb_t), NULL);
     /* task manager */
     spin_list_init(&task_manager.all_list);
     task_manager.next_free_id = 0;
@@ -38,14 +44,19 @@ void init_task(void)
     CPU_ITEM* item;
     for(uint32_t i = 0;i < cpus->total_num;i++){
         item = &cpus->items[i];
-        spin_list_init(&item->ready_list);
+        init_cfs_rq(&item->rq);
         item->total_ready_num = 0;
-        pcb_t *pcb_of_idle = put_thread("idle",idle,NULL,true,NULL);
+        item->need_resched = false;
+        pcb_t *pcb_of_idle = put_thread("idle",idle,NULL,true,NULL,i);
+        if (!pcb_of_idle)
+            halt();
         item->idle = pcb_of_idle;
         item->now_running = pcb_of_idle;
     }
     /* 初始化init进程 */
     pcb_of_init = kernel_thread("init",init,NULL,-1,NULL);
+    if (!pcb_of_init)
+        halt();
 }
 
 static pcb_t *kernel_thread(char *name, void *addr,pcb_t *parent,uint32_t n,void *arg){
@@ -56,8 +67,9 @@ static pcb_t *kernel_thread(char *name, void *addr,pcb_t *parent,uint32_t n,void
         target = n;
     }
     uint8_t intr = io_cli();
-    pcb_t *ret = put_thread(name,addr,parent,true,arg);
-    add_to_cpu_n_ready_list(ret,target);
+    pcb_t *ret = put_thread(name,addr,parent,true,arg,target);
+    if (ret)
+        add_to_cpu_n_ready_list(ret,target);
     io_set_intr(intr);
     return ret;
 }
@@ -69,18 +81,43 @@ extern uint64_t *vir_ptable4;
  * 才是合法的,否则存在内存不安全问题,
  * parent不是自己,则可能随时退出,进而可能访问无效内存(new_task->parent)
  * parent选项的存在是为了可能的疑难问题
+ * cpu是新线程将要运行的CPU, pcb和内核栈从它所在的NUMA节点分配
+ * @return 新的task, 内存不足时返回NULL, 这时还没有挂到任何链表上
  */
-static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void *arg)
+static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void *arg,uint32_t cpu)
 {
-    pcb_t *new_task = kmalloc(DEFAULT_PCB_SIZE);
+    pcb_t *new_task = kmem_cache_alloc_node(pcb_cachep, cpus->items[cpu].node);
+    if (!new_task)
+        return NULL;
+    /* name */
+    if (name)
+    {
+        uint32_t length = strlen((const char*)name);
+        new_task->name = kmalloc(length + 1);
+        if (!new_task->name) {
+            kmem_cache_free(pcb_cachep, new_task);
+            return NULL;
+        }
+        strcpy(new_task->name, name);
+    }
+    else
+    {
+        new_task->name = NULL;
+    }
     INIT_LIST_HEAD(&new_task->all_list);
     INIT_LIST_HEAD(&new_task->child_list_item);
     INIT_LIST_HEAD(&new_task->other_list_item);
-    INIT_LIST_HEAD(&new_task->ready_list_item);
     INIT_LIST_HEAD(&new_task->wait_list_item);
+    INIT_LIST_HEAD(&new_task->vma_list);
+    mutex_init(&new_task->mm_mutex);
+    new_task->fault_around_max = parent ? parent->fault_around_max : FAULT_AROUND_DEFAULT;
+    new_task->fault_around = 1;
+    new_task->fault_around_start = new_task->fault_around_end = 0;
     wait_queue_init(&new_task->wait_queue);
     spin_list_init(&new_task->timers);
     new_task->cr3 = (uint64_t)vir_ptable4;
+    memset(new_task->pcid, 0, sizeof(new_task->pcid));
+    new_task->pcid_cpu = (uint32_t)-1;
     new_task->cpuid = 0;
     new_task->preempt_count = 0;
     new_task->fpu.used_fpu = false;
@@ -102,17 +139,6 @@ static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void
     }
     /* childs */
     spin_list_init(&new_task->childs);
-    /* name */
-    if (name)
-    {
-        uint32_t length = strlen((const char*)name);
-        new_task->name = kmalloc(length + 1);
-        strcpy(new_task->name, name);
-    }
-    else
-    {
-        new_task->name = NULL;
-    }
     for (int i = 0; i < NR_OPEN_DEFAULT; i++){
         new_task->files[i] = NULL;
     }
@@ -120,7 +146,7 @@ static pcb_t *put_thread(char *name, void *addr, pcb_t *parent,bool is_ker,void
     new_task->magic = TASK_MAGIC;
     new_task->signal = 0;
     new_task->state = TASK_STATE_READY;
-    new_task->ticks = DEFUALT_TICKS;
+    sched_fork(new_task, parent);
     /* start up 栈空间 */
     registers_t *reg = (void *)((uint64_t)new_task + DEFAULT_PCB_SIZE - sizeof(registers_t));
     task_start_t *task_start = (void *)((uint64_t)new_task + DEFAULT_PCB_SIZE - (sizeof(registers_t) + sizeof(task_start_t)));
@@ -159,31 +185,92 @@ static uint32_t alloc_pid_and_add_to_all_list(pcb_t *new_task)
     return 0;
 }
 
+/// @brief 撤销put_thread, 只用于还没有放进就绪队列的task
+static void unput_thread(pcb_t *task)
+{
+    spin_list_del(&task->all_list, &task_manager.all_list);
+    if (task->parent)
+        spin_list_del(&task->child_list_item, &task->parent->childs);
+    if (task->cwd)
+        exit_cwd(task->cwd);
+    vma_free_all(task);
+    if (task->name)
+        kfree(task->name);
+    kmem_cache_free(pcb_cachep, task);
+}
+
 static void add_to_cpu_n_ready_list(pcb_t *task,uint32_t n){
     if (n >= cpus->total_num){
         halt();
     }
     task->cpuid = n;
-    spin_list_head_t *tar_ready_list = &cpus->items[n].ready_list;
-    spin_lock(&tar_ready_list->lock);
-    //list_add_tail(&task->ready_list_item,&tar_ready_list->list);
-    list_add(&task->ready_list_item,&tar_ready_list->list);
-    cpus->items[n].total_ready_num++;
-    spin_unlock(&tar_ready_list->lock);
+    CPU_ITEM *cpu = &cpus->items[n];
+    spin_lock(&cpu->rq.lock);
+    enqueue_task(cpu, task, ENQUEUE_NEW);
+    spin_unlock(&cpu->rq.lock);
 }
 
-static inline void switch_cr3_if_needed(pcb_t *will_run)
+/**
+ * @brief 计算task在本CPU上要装入的CR3
+ * @note PCID仍属于本代且上次就在本CPU上装载时带不刷新位;
+ * 在别的CPU上运行期间的页表修改只刷新了那个CPU, 所以迁移回来时要刷新一次.
+ * 别的上下文修改了它的页表时由task_pcid_invalidate作废所有PCID
+ */
+static uint64_t pcid_make_cr3(pcb_t *task, uint32_t id)
 {
-    uint64_t current_cr3;
-    uint64_t new_cr3 = (uint64_t)easy_linear2phy(will_run->cr3);
-    __asm__ __volatile__ (
-        "mov %%cr3, %0"
-        : "=r"(current_cr3)
-        :
-        : "memory"
-    );
-    if (current_cr3 == new_cr3)
-        return;
+    uint64_t phy = (uint64_t)easy_linear2phy(task->cr3);
+    // 内核页表用PCID 0, 内核映射的修改由tlb_shootdown刷新所有PCID
+    if (task->cr3 == (uint64_t)vir_ptable4)
+        return pcid_enabled ? phy | CR3_NOFLUSH : phy;
+    if (!pcid_enabled) {
+        task->pcid_cpu = id;
+        return phy;
+    }
+    CPU_ITEM *item = &cpus->items[id];
+    uint64_t ctx = task->pcid[id];
+    if ((ctx >> 12) == item->pcid_gen) {
+        uint32_t last = task->pcid_cpu;
+        task->pcid_cpu = id;
+        if (last == id) {
+            item->pcid_hit++;
+            return phy | (ctx & CR3_PCID_MASK) | CR3_NOFLUSH;
+        }
+        item->pcid_flush++;
+        return phy | (ctx & CR3_PCID_MASK);
+    }
+    // 用完一代后整体作废, 复用的PCID在第一次装载时刷新
+    if (item->pcid_next > CR3_PCID_MASK) {
+        item->pcid_gen++;
+        item->pcid_next = 1;
+    }
+    ctx = (item->pcid_gen << 12) | item->pcid_next++;
+    task->pcid[id] = ctx;
+    task->pcid_cpu = id;
+    item->pcid_flush++;
+    return phy | (ctx & CR3_PCID_MASK);
+}
+
+/**
+ * @brief 不在运行的task的页表被别的上下文修改了, 作废它在各CPU上的PCID
+ * @note 此后的tlb_shootdown只通知正装载着它的CPU, 曾经运行过它的CPU上残留的表项
+ * 要靠下次装载时分配新PCID刷新. 先作废再发起刷新, 与load_cr3先记active_cr3再取PCID配对:
+ * 要么装载方看到作废, 要么刷新方看到active_cr3
+ */
+void task_pcid_invalidate(pcb_t *task)
+{
+    for (uint32_t i = 0; i < MAX_CPU_NUM; i++)
+        task->pcid[i] = 0;
+    __sync_synchronize();
+}
+
+/// @brief 装载task的页表并记录在本CPU上, 关中断调用
+static void load_cr3(pcb_t *task, uint32_t id)
+{
+    CPU_ITEM *item = &cpus->items[id];
+    item->active_cr3 = task->cr3;
+    item->tlb_lazy = false;
+    __sync_synchronize();
+    uint64_t new_cr3 = pcid_make_cr3(task, id);
     __asm__ __volatile__ (
         "mov %0, %%cr3"
         :
@@ -192,6 +279,27 @@ static inline void switch_cr3_if_needed(pcb_t *will_run)
     );
 }
 
+/**
+ * @note 内核线程不访问用户地址, 沿用当前页表(懒惰模式), 省掉两次CR3切换;
+ * 切回同一地址空间时, 若期间漏掉了刷新或者该进程在别的CPU上运行过, 仍要重新装载
+ */
+static inline void switch_cr3_if_needed(pcb_t *will_run, uint32_t id)
+{
+    CPU_ITEM *item = &cpus->items[id];
+    if (will_run->cr3 == (uint64_t)vir_ptable4) {
+        if (item->active_cr3 != (uint64_t)vir_ptable4)
+            item->tlb_lazy = true;
+        return;
+    }
+    item->tlb_lazy = false;
+    __sync_synchronize();
+    bool stale = item->tlb_stale;
+    item->tlb_stale = false;
+    if (item->active_cr3 == will_run->cr3 && !stale && will_run->pcid_cpu == id)
+        return;
+    load_cr3(will_run, id);
+}
+
 static void handle_fpu_sse(pcb_t *prev){
     if (prev->fpu.fpu_dirty) {
         // 保存当前 FPU 状态到 prev 的 PCB
@@ -207,22 +315,16 @@ void __schedule_locked(uint8_t intr){
     uint32_t id = get_logic_cpu_id();
     CPU_ITEM *item = &cpus->items[id];
     pcb_t *will_run,*before_run = item->now_running;
-    if (item->ready_list.list.next != &item->ready_list.list){
-        list_head_t* next_ = item->ready_list.list.next;
-        list_del_init(next_);
-        will_run = container_of(next_,pcb_t,ready_list_item);
-        item->total_ready_num--;
-    }else{
-        will_run = item->idle;
-    }
+    update_curr(item);
+    will_run = pick_next_task(item);
     if (before_run != will_run)
         handle_fpu_sse(before_run);
-    switch_cr3_if_needed(will_run);
+    switch_cr3_if_needed(will_run, id);
     will_run->cpuid = id;
     item->now_running = will_run;
     will_run->state = TASK_STATE_RUNNING;
     item->tss->rsp0 = (uint64_t)will_run + DEFAULT_PCB_SIZE;
-    task_switch_unlock(before_run,will_run,&item->ready_list.lock,&before_run->preempt_count);
+    task_switch_unlock(before_run,will_run,&item->rq.lock,&before_run->preempt_count);
     io_set_intr(intr);
 }
 
@@ -231,23 +333,17 @@ void __schedule_other_locked(spinlock_t *wq_lock){
     uint32_t id = get_logic_cpu_id();
     CPU_ITEM *item = &cpus->items[id];
     pcb_t *will_run,*before_run = item->now_running;
-    spin_lock(&item->ready_list.lock);
-    if (item->ready_list.list.next != &item->ready_list.list){
-        list_head_t* next_ = item->ready_list.list.next;
-        list_del_init(next_);
-        will_run = container_of(next_,pcb_t,ready_list_item);
-        item->total_ready_num--;
-    }else{
-        will_run = item->idle;
-    }
+    spin_lock(&item->rq.lock);
+    update_curr(item);
+    will_run = pick_next_task(item);
     if (before_run != will_run)
         handle_fpu_sse(before_run);
-    switch_cr3_if_needed(will_run);
+    switch_cr3_if_needed(will_run, id);
     will_run->cpuid = id;
     item->now_running = will_run;
     will_run->state = TASK_STATE_RUNNING;
     item->tss->rsp0 = (uint64_t)will_run + DEFAULT_PCB_SIZE;
-    task_switch_double_unlock(before_run,will_run,&item->ready_list.lock,&before_run->preempt_count,wq_lock);
+    task_switch_double_unlock(before_run,will_run,&item->rq.lock,&before_run->preempt_count,wq_lock);
     io_set_intr(intr);
 }
 
@@ -255,7 +351,7 @@ void schedule(void){
     uint8_t intr = io_cli();
     uint32_t id = get_logic_cpu_id();
     CPU_ITEM *cpu = &cpus->items[id];
-    spin_lock(&cpu->ready_list.lock);
+    spin_lock(&cpu->rq.lock);
     __schedule_locked(intr);
 }
 
@@ -279,13 +375,14 @@ _Noreturn void sys_exit(int exit_status){
     list_head_t *pos;
     list_head_t *n;
 
-    spin_lock(&this_cpu->timer_list.lock);
+    spin_lock(&this_cpu->wheel->lock);
     list_for_each_safe(pos,n,&task->timers.list){
         timer_t *task_timer = container_of(pos,timer_t,in_task_item);
         list_del(&task_timer->in_task_item);
-        kfree(task_timer);
+        timer_wheel_del(this_cpu->wheel, task_timer);
+        kmem_cache_free(timer_cachep, task_timer);
     }
-    spin_unlock(&this_cpu->timer_list.lock);
+    spin_unlock(&this_cpu->wheel->lock);
     io_set_intr(intr);
     
     /* 移交子进程 */
@@ -318,12 +415,13 @@ int sys_waitpid(int pid, int *status)
             if (pid == -1 || child->pid == pid) {
                 if (child->state == TASK_ZOMBIE) {
                     int exit_code = child->exit_status;
+                    int child_pid = child->pid;
                     list_del(&child->child_list_item);
                     spin_unlock(&now_pcb->childs.lock);
                     if (status)
                         *status = exit_code;
                     free_task(child);
-                    return child->pid;
+                    return child_pid;
                 }
             }
         }
@@ -338,21 +436,26 @@ pcb_t *get_current(void){
     return this_cpu->now_running;
 }
 
+/// @brief 唤醒task, 放回它上次运行的CPU, vruntime足够小时抢占那里的当前任务
 void put_to_ready_list_first(pcb_t *task){
     uint32_t cpuid = task->cpuid;
     CPU_ITEM *cpu = &cpus->items[cpuid];
+    uint8_t intr = spin_lock_irq_save(&cpu->rq.lock);
     task->state = TASK_STATE_READY;
-    spin_lock(&cpu->ready_list.lock);
-    list_add(&task->ready_list_item,&cpu->ready_list.list);
-    cpu->total_ready_num++;
-    spin_unlock(&cpu->ready_list.lock);
+    enqueue_task(cpu, task, ENQUEUE_WAKEUP);
+    spin_unlock(&cpu->rq.lock);
+    io_set_intr(intr);
 }
 
 extern int fd_close(pcb_t *proc, int fd);
 
 static void free_task(pcb_t *task){
+    spin_list_del(&task->all_list, &task_manager.all_list);
     if (!task->is_ker){
+        // 等正在扫描它的换出结束
+        mutex_lock(&task->mm_mutex);
         free_ptable_and_mem(task->cr3);
+        mutex_unlock(&task->mm_mutex);
     }
     // close all files
     for (int i = 0; i < NR_OPEN_DEFAULT; i++)
@@ -362,19 +465,17 @@ static void free_task(pcb_t *task){
     // close cwd
     sb_put(task->cwd->in_mnt);
     dentry_put(task->cwd);
+    vma_free_all(task);
 
-    kfree(task);
+    kmem_cache_free(pcb_cachep, task);
 }
 
 void sys_yield(void){
     uint8_t intr = io_cli();
     uint32_t id = get_logic_cpu_id();
     CPU_ITEM *cpu = &cpus->items[id];
-    pcb_t *current = cpu->now_running;
-    spin_lock(&cpu->ready_list.lock);
-    current->state = TASK_STATE_READY;
-    list_add_tail(&current->ready_list_item,&cpus->items[id].ready_list.list);
-    cpu->total_ready_num++;
+    spin_lock(&cpu->rq.lock);
+    yield_task(cpu);
     __schedule_locked(intr);
 }
 
@@ -391,14 +492,16 @@ int init_cwd_for_started_tasks(struct dentry *root){
     return ret;
 }
 
+/// @return 新线程的pid, 内存不足时返回-1
 int kernel_thread_default(char *name, void *addr,void *arg){
     pcb_t *new = kernel_thread(name,addr,get_current(),0,arg);
-    return new->pid;
+    return new ? new->pid : -1;
 }
 
+/// @return 新线程的pid, 内存不足时返回-1
 int kernel_thread_link_init(char *name, void *addr,void *arg){
     pcb_t *new = kernel_thread(name,addr,pcb_of_init,0,arg);
-    return new->pid;
+    return new ? new->pid : -1;
 }
 
 #include "lib/elf.h"
@@ -429,7 +532,18 @@ int sys_execv(const char* path, char* const argv[])
         return -3;
     }
 
+    // 释放旧地址空间之后就不能返回了, 需要的内存先取好
     char* temp = kmalloc(4096);
+    uint64_t cr3_phy = alloc_zeroed_page_4k();
+    if (!temp || !cr3_phy) {
+        if (temp)
+            kfree(temp);
+        if (cr3_phy)
+            decrease_reference_page_4k(cr3_phy);
+        kfree(header);
+        sys_close(fd);
+        return -2;
+    }
     char* pos = temp + 4096;
     char** new_argv = (char**)(pos - len - i * 8 - 8);
     i = 0;
@@ -443,28 +557,45 @@ int sys_execv(const char* path, char* const argv[])
     }
     new_argv[i] = (void*)0;
 
+    mutex_lock(&current->mm_mutex);
     uint8_t intr = io_cli();
     if (current->cr3 != (uint64_t)vir_ptable4){
         uint64_t old_cr3 = current->cr3;
         current->cr3 = (uint64_t)vir_ptable4;
+        // 先离开旧页表再释放它
+        load_cr3(current, get_logic_cpu_id());
         io_set_intr(intr);
         free_ptable_and_mem(old_cr3);
     }else{
         io_set_intr(intr);
     }
-    uint64_t cr3 = (uint64_t)kmalloc(4096);
-    memset((void*)cr3, 0, 2048);
+    vma_free_all(current);
+    uint64_t cr3 = (uint64_t)easy_phy2linear(cr3_phy);
     memcpy((void*)(cr3 + 2048), (void*)((uint64_t)vir_ptable4 + 2048), 2048);
-    uint64_t phy_cr3 = (uint64_t)easy_linear2phy(cr3);
     
     intr = io_cli();
     current->cr3 = cr3;
-    __asm__ __volatile__("mov %0, %%cr3" : : "r"(phy_cr3) : "memory");
-    put_page_4k((uint64_t)easy_linear2phy(temp),VIRTUAL_ADDR_USER_HIGHEST - 4096,cr3,1);
+    // 新的地址空间, 旧的PCID全部作废
+    memset(current->pcid, 0, sizeof(current->pcid));
+    load_cr3(current, get_logic_cpu_id());
+    int map_ret = put_page_4k((uint64_t)easy_linear2phy(temp),VIRTUAL_ADDR_USER_HIGHEST - 4096,cr3,1);
     io_set_intr(intr);
+    mutex_unlock(&current->mm_mutex);
 
-    elf_file_copy(fd, header, cr3);
+    if (map_ret)
+        kfree(temp);
+    else
+        map_ret = elf_file_map(fd, header, current);
     sys_close(fd);
+    // 用户堆是匿名内存, 2M对齐的部分用大页
+    if (!map_ret)
+        map_ret = vma_add(current, VIRTUAL_ADDR_USER_HEAP_START, VIRTUAL_ADDR_USER_HEAP_END,
+                          VMA_READ | VMA_WRITE | VMA_HUGE, NULL, 0, 0, 0);
+    // 旧的地址空间已经没有了, 映射失败只能退出
+    if (map_ret) {
+        kfree(header);
+        sys_exit(-1);
+    }
 
     /* 清理除了std以外的所有文件 */
     for (uint32_t i = 3; i < NR_OPEN_DEFAULT; i++){
@@ -495,13 +626,30 @@ int fork_enter(unsigned long rsp)
     pcb_t* current = get_current();
     if (current->is_ker)
         return -1;
-    uint64_t* cr3 = kmalloc(4096);
-    memset(cr3, 0, 2048);
+    uint64_t cr3_phy = alloc_zeroed_page_4k();
+    if (!cr3_phy)
+        return -1;
+    uint64_t* cr3 = easy_phy2linear(cr3_phy);
     memcpy(cr3 + 256, vir_ptable4 + 256, 2048);
 
-    copy_pagetable_and_mem((uint64_t)cr3,current->cr3);
+    mutex_lock(&current->mm_mutex);
+    int err = copy_pagetable_and_mem((uint64_t)cr3,current->cr3);
+    mutex_unlock(&current->mm_mutex);
+    if (err) {
+        free_ptable_and_mem((uint64_t)cr3);
+        return -1;
+    }
 
-    pcb_t *child = put_thread(current->name,NULL,current,false,NULL);
+    pcb_t *child = put_thread(current->name,NULL,current,false,NULL,0);
+    if (!child) {
+        free_ptable_and_mem((uint64_t)cr3);
+        return -1;
+    }
+    if (vma_copy(child, current)) {
+        unput_thread(child);
+        free_ptable_and_mem((uint64_t)cr3);
+        return -1;
+    }
     int ret = child->pid;
     child->cr3 = (uint64_t)cr3;
 
@@ -31,8 +31,13 @@ int current_tty;
 
 void init_view(MULTIBOOT_INFO* info)
 {
-    // 初始化系统显存屏幕
-    system_screen.vbuffer = easy_phy2linear(info->framebuffer_addr);
+    // 初始化系统显存屏幕: 显存只写不读, 用写合并映射, 清屏和画字的写可以合并成整行突发
+    uint64_t fb_size = (uint64_t)info->framebuffer_pitch * info->framebuffer_height;
+    if (!fb_size)
+        fb_size = SCREEN_WIDTH * SCREEN_HEIGHT * 4;
+    system_screen.vbuffer = (uint32_t *)io_remap_wc(info->framebuffer_addr, fb_size);
+    if (!system_screen.vbuffer)
+        system_screen.vbuffer = easy_phy2linear(info->framebuffer_addr);
     system_screen.disp_c_x = 0;
     system_screen.disp_c_y = 0;
     system_screen.disp_position = 0;
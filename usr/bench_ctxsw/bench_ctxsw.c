@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "uconst.h"
+#include "uprintf.h"
+#include "sysapi.h"
+
+/*
+ * 两个进程通过一对管道来回传一个字节, 每次拿到字节后先访问自己的
+ * 若干页再回传. 切换CR3时如果TLB被刷掉, 这些页每轮都要重新查页表,
+ * 所以每轮的开销随访问的页数增长; 开启PCID后增长应明显变小.
+ * 用nopcid启动参数关闭PCID即可对比.
+ */
+
+#define MAX_PAGES 256
+#define ROUNDS 2000
+
+/* 放在bss里, 按4K页映射(堆会用2M大页, 看不出TLB的差别) */
+static uint8_t work[MAX_PAGES * 4096];
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t touch(int pages) {
+    uint64_t sum = 0;
+    for (int i = 0; i < pages; i++)
+        sum += *(volatile uint8_t *)&work[i * 4096];
+    return sum;
+}
+
+static void child_loop(int rfd, int wfd, int pages) {
+    char c;
+    for (int i = 0; i < ROUNDS; i++) {
+        read(rfd, &c, 1);
+        touch(pages);
+        write(wfd, &c, 1);
+    }
+}
+
+static uint64_t run(int pages) {
+    int to_child[2], to_parent[2];
+    if (pipe(to_child) == -1 || pipe(to_parent) == -1) {
+        printf("pipe create failed\n");
+        exit(-1);
+    }
+    int pid = fork();
+    if (pid == -1) {
+        printf("fork failed\n");
+        exit(-1);
+    }
+    if (pid == 0) {
+        close(to_child[1]);
+        close(to_parent[0]);
+        /* 先把页都摸一遍, 不把缺页算进去 */
+        touch(MAX_PAGES);
+        child_loop(to_child[0], to_parent[1], pages);
+        exit(0);
+    }
+    close(to_child[0]);
+    close(to_parent[1]);
+    touch(MAX_PAGES);
+
+    char c = 'x';
+    /* 预热一轮 */
+    write(to_child[1], &c, 1);
+    read(to_parent[0], &c, 1);
+    touch(pages);
+
+    uint64_t start = rdtsc();
+    for (int i = 1; i < ROUNDS; i++) {
+        write(to_child[1], &c, 1);
+        read(to_parent[0], &c, 1);
+        touch(pages);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    close(to_child[1]);
+    close(to_parent[0]);
+    waitpid(pid, NULL);
+    return cycles / (ROUNDS - 1);
+}
+
+int main(void) {
+    static const int pages[] = {0, 8, 32, 128, MAX_PAGES};
+    uint64_t base = 0;
+    printf("pages\tcycles/round-trip\textra/page\n");
+    for (uint32_t i = 0; i < sizeof(pages) / sizeof(pages[0]); i++) {
+        uint64_t c = run(pages[i]);
+        if (i == 0)
+            base = c;
+        uint64_t extra = (pages[i] && c > base) ? (c - base) / (2 * pages[i]) : 0;
+        printf("%d\t%lu\t%lu\n", pages[i], c, extra);
+    }
+    exit(0);
+}
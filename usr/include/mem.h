@@ -7,5 +7,6 @@ void* malloc(uint64_t size);
 void free(void* ptr);
 void* realloc(void* ptr, uint64_t size);
 void* calloc(uint64_t num, uint64_t size);
+void malloc_stats(void);
 
 #endif
\ No newline at end of file
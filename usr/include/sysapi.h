@@ -21,6 +21,25 @@ typedef struct utimespec {
     uint64_t   tv_nsec; // 纳秒
 } utimespec_t;
 
+/* clock_nanosleep的时钟与标志 */
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+#define TIMER_ABSTIME   1
+
+/* mmap的权限与类型, 与内核include/mm/mman.h一致 */
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+#define MAP_FAILED      ((void *)-1)
+#define MADV_NORMAL     0
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
 typedef struct stat {
     uint64_t block_size;
     uint64_t file_size;
@@ -58,5 +77,14 @@ void clock_gettime(utimespec_t *u);
 int pipe(int pipe[2]);
 int fstat(int fd, stat_t *stat);
 int uuid_config(char *path, char uuid[37], bool read);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t length);
+int mprotect(void *addr, size_t length, int prot);
+int madvise(void *addr, size_t length, int advice);
+int fault_around(int pages);
+int nice(int inc);
+int nanosleep(const utimespec_t *req, utimespec_t *rem);
+int clock_nanosleep(int clock, int flags, const utimespec_t *req, utimespec_t *rem);
+int memstat(char *buf, size_t size);
 
 #endif
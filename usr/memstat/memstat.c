@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "uprintf.h"
+#include "sysapi.h"
+
+// 打印内核的内存统计
+static char buf[8192];
+
+int main(void){
+    int len = memstat(buf, sizeof(buf));
+    if (len < 0) {
+        printf("memstat failed\n");
+        exit(-1);
+    }
+    write(1, buf, len);
+    exit(0);
+}
@@ -1,175 +1,440 @@
 #include "ustring.h"
+#include "sysapi.h"
+#include "uprintf.h"
+#include "mem.h"
 #include <stddef.h>
 #include <stdint.h>
 
-// 内存块头结构
-typedef struct block_header {
-    uint64_t size;
-    struct block_header* next;
-    int is_free;
-} block_header_t;
-
-// 内存池管理
-#define HEAP_START 0x400000000000UL // 堆起始地址
-#define HEAP_END 0x700000000000UL // 堆结束地址
+/*
+ * 用户态malloc
+ * 小对象按尺寸级从64K的run里切, 每级一条还有空闲对象的run链表, 分配和释放都是O(1);
+ * 大对象从另一段地址按整页切run, 相邻的空闲run合并.
+ * 两类放在堆的不同范围里, free只看地址就知道是哪一类.
+ * 内核用2M大页填充堆, madvise只还一个大页的一部分会让内核把它拆成4K页, 所以只还完整的2M块:
+ * 小对象的run在所在2M块的run全都空了时整块还回去, 空闲大对象run只还中间完整的2M块.
+ */
+
+// 堆的范围, 与内核的用户堆区域一致
+#define HEAP_START 0x400000000000UL
+#define SMALL_END  0x500000000000UL // 小对象run放在[HEAP_START, SMALL_END)
+#define HEAP_END   0x700000000000UL
 #define PAGE_SIZE 4096
-#define ALIGNMENT 8
-#define MIN_BLOCK_SIZE (sizeof(block_header_t) + ALIGNMENT)
 
-static block_header_t* free_list = NULL;
-static void* heap_current = (void*)HEAP_START;
+#define RUN_SIZE (64 * 1024)
+#define RUN_HDR 64
+#define RUN_MAGIC 0x52554e21
+#define SMALL_MAX 2048
+#define NR_CLASSES 24
+/// 堆按大页填充, 还给内核的范围按它对齐
+#define CHUNK_SIZE (2 * 1024 * 1024)
+#define RUNS_PER_CHUNK (CHUNK_SIZE / RUN_SIZE)
+/// 整块还回去的2M块最多记这么多个, 再多就不还了
+#define MAX_FREE_CHUNKS 256
+
+#define LARGE_HDR 64
+#define LARGE_MAGIC 0x4c524745
+#define NR_LARGE_BINS 24
+
+/// @brief 小对象run的头, run按RUN_SIZE对齐, 对象地址向下对齐就找到头
+typedef struct run {
+    uint32_t magic;
+    uint16_t cls;
+    uint16_t nfree;
+    uint16_t nobj;
+    /// @brief 只在2M块的第一个run里有意义: 块中不在released_runs里的run数
+    uint16_t chunk_used;
+    /// @brief 释放过的对象, 链表节点放在对象开头
+    void *free_obj;
+    /// @brief 还没有切出去过的对象从这里开始
+    char *bump;
+    /// @brief 所属级的partial链表, 或者released_runs
+    struct run *next;
+    struct run *prev;
+} run_t;
+
+/// @brief 大对象run的头, 占run第一页的开头
+typedef struct large {
+    uint32_t magic;
+    uint32_t free;
+    uint64_t npages;
+    /// @brief 地址上前一个run的页数, 0表示这是第一个
+    uint64_t prev_npages;
+    /// @brief 空闲时在按页数分级的链表上
+    struct large *next;
+    struct large *prev;
+} large_t;
+
+static const uint16_t class_size[NR_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+/// @brief (size + 15) / 16 到尺寸级的映射, 第一次malloc时填好
+static uint8_t class_index[SMALL_MAX / 16 + 1];
+static int class_ready;
+
+/// @brief 每级还有空闲对象的run
+static run_t *partial[NR_CLASSES];
+/// @brief 每级留一个空run不还给内核, 避免在边界上反复缺页
+static run_t *empty_run[NR_CLASSES];
+/// @brief 空run, 等所在2M块的run都空了再一起还给内核
+static run_t *released_runs;
+/// @brief 整块还给了内核的2M块
+static char *free_chunks[MAX_FREE_CHUNKS];
+static int nr_free_chunks;
+static char *small_top = (char *)HEAP_START;
+
+static large_t *bins[NR_LARGE_BINS];
+static char *large_top = (char *)SMALL_END;
+/// @brief 地址最高的大对象run
+static large_t *large_last;
+
+static struct {
+    uint64_t small_objs[NR_CLASSES];
+    uint64_t small_runs;
+    uint64_t released_runs;
+    uint64_t released_chunks;
+    uint64_t large_objs;
+    uint64_t large_pages;
+    uint64_t large_free_pages;
+} stat;
 
-// 对齐工具函数
 static inline uint64_t align_up(uint64_t size, uint64_t alignment)
 {
     return (size + alignment - 1) & ~(alignment - 1);
 }
 
-static inline void* align_ptr(void* ptr, uint64_t alignment)
+/**
+ * @brief 把[addr, addr + len)中完整的2M块还给内核
+ * @note 两端不满2M的部分留着, 否则内核要把整个大页拆成4K页
+ */
+static void heap_release(void *addr, uint64_t len)
 {
-    return (void*)align_up((uint64_t)ptr, alignment);
+    uint64_t start = align_up((uint64_t)addr, CHUNK_SIZE);
+    uint64_t end = ((uint64_t)addr + len) & ~((uint64_t)CHUNK_SIZE - 1);
+    if (start < end)
+        madvise((void *)start, end - start, MADV_DONTNEED);
 }
 
-// 扩展堆空间（触发缺页分配）
-static void* sbrk(uint64_t size)
+static void init_classes(void)
 {
-    void* old_brk = heap_current;
-    void* new_brk = (void*)((char*)heap_current + size);
-
-    if ((uintptr_t)new_brk > HEAP_END) {
-        return NULL; // 堆溢出
+    int cls = 0;
+    for (int i = 0; i <= SMALL_MAX / 16; i++) {
+        while (class_size[cls] < i * 16)
+            cls++;
+        class_index[i] = cls;
     }
+    class_ready = 1;
+}
 
-    heap_current = new_brk;
-    return old_brk;
+/* ====================== 小对象 ====================== */
+
+static void partial_add(int cls, run_t *run)
+{
+    run->prev = NULL;
+    run->next = partial[cls];
+    if (run->next)
+        run->next->prev = run;
+    partial[cls] = run;
 }
 
-// 分割内存块
-static void split_block(block_header_t* block, uint64_t size)
+static void partial_remove(int cls, run_t *run)
 {
-    if (block->size > size + MIN_BLOCK_SIZE) {
-        block_header_t* new_block = (block_header_t*)((char*)block + sizeof(block_header_t) + size);
-        new_block->size = block->size - size - sizeof(block_header_t);
-        new_block->is_free = 1;
-        new_block->next = block->next;
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        partial[cls] = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+}
 
-        block->size = size;
-        block->next = new_block;
+static inline run_t *chunk_head(run_t *run)
+{
+    return (run_t *)((uint64_t)run & ~((uint64_t)CHUNK_SIZE - 1));
+}
 
-        // 将新块插入空闲链表
-        new_block->next = free_list;
-        free_list = new_block;
-    }
+static void released_push(run_t *run)
+{
+    run->prev = NULL;
+    run->next = released_runs;
+    if (run->next)
+        run->next->prev = run;
+    released_runs = run;
+    stat.released_runs++;
 }
 
-// 合并相邻空闲块
-static void coalesce_blocks()
+static void released_remove(run_t *run)
 {
-    block_header_t* curr = free_list;
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        released_runs = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+    stat.released_runs--;
+}
 
-    while (curr && curr->next) {
-        if ((char*)curr + sizeof(block_header_t) + curr->size == (char*)curr->next) {
-            // 合并相邻块
-            curr->size += sizeof(block_header_t) + curr->next->size;
-            curr->next = curr->next->next;
-        } else {
-            curr = curr->next;
-        }
+static run_t *run_get(int cls)
+{
+    run_t *run = empty_run[cls];
+    if (run) {
+        empty_run[cls] = NULL;
+        return run;
+    }
+    if (released_runs) {
+        run = released_runs;
+        released_remove(run);
+    } else if (nr_free_chunks) {
+        // 还给过内核的块重新缺页得到零页, chunk_used从0开始
+        char *chunk = free_chunks[--nr_free_chunks];
+        stat.released_chunks--;
+        for (int i = RUNS_PER_CHUNK - 1; i > 0; i--)
+            released_push((run_t *)(chunk + i * RUN_SIZE));
+        run = (run_t *)chunk;
+    } else {
+        if ((uint64_t)small_top + RUN_SIZE > SMALL_END)
+            return NULL;
+        run = (run_t *)small_top;
+        small_top += RUN_SIZE;
     }
+    chunk_head(run)->chunk_used++;
+    run->magic = RUN_MAGIC;
+    run->cls = cls;
+    run->nobj = (RUN_SIZE - RUN_HDR) / class_size[cls];
+    run->nfree = run->nobj;
+    run->free_obj = NULL;
+    run->bump = (char *)run + RUN_HDR;
+    stat.small_runs++;
+    return run;
 }
 
-// malloc实现
-void* malloc(uint64_t size)
+/// @brief 空run放进released_runs, 所在2M块的run都空了时整块还给内核
+static void run_release(run_t *run)
 {
-    if (size == 0)
-        return NULL;
-
-    // 对齐大小，包含块头
-    uint64_t aligned_size = align_up(size, ALIGNMENT);
-    uint64_t total_size = aligned_size + sizeof(block_header_t);
+    run->magic = 0;
+    released_push(run);
+    stat.small_runs--;
+    run_t *head = chunk_head(run);
+    if (--head->chunk_used)
+        return;
+    // 块还没有切完, 或者记不下了, 先留着
+    if ((char *)head + CHUNK_SIZE > small_top || nr_free_chunks == MAX_FREE_CHUNKS)
+        return;
+    for (int i = 0; i < RUNS_PER_CHUNK; i++)
+        released_remove((run_t *)((char *)head + i * RUN_SIZE));
+    madvise(head, CHUNK_SIZE, MADV_DONTNEED);
+    free_chunks[nr_free_chunks++] = (char *)head;
+    stat.released_chunks++;
+}
 
-    // 首次分配，初始化空闲链表
-    if (free_list == NULL) {
-        // 分配初始堆空间（触发缺页）
-        uint64_t initial_size = align_up(total_size * 4, PAGE_SIZE);
-        void* heap = sbrk(initial_size);
-        if (!heap)
+static void *small_alloc(int cls)
+{
+    run_t *run = partial[cls];
+    if (!run) {
+        run = run_get(cls);
+        if (!run)
             return NULL;
-
-        free_list = (block_header_t*)heap;
-        free_list->size = initial_size - sizeof(block_header_t);
-        free_list->is_free = 1;
-        free_list->next = NULL;
+        partial_add(cls, run);
+    }
+    void *obj;
+    if (run->free_obj) {
+        obj = run->free_obj;
+        run->free_obj = *(void **)obj;
+    } else {
+        obj = run->bump;
+        run->bump += class_size[cls];
     }
+    if (--run->nfree == 0)
+        partial_remove(cls, run);
+    stat.small_objs[cls]++;
+    return obj;
+}
 
-    // 首次适应算法寻找空闲块
-    block_header_t* prev = NULL;
-    block_header_t* curr = free_list;
-
-    while (curr) {
-        if (curr->is_free && curr->size >= aligned_size) {
-            // 找到合适块
-            if (prev) {
-                prev->next = curr->next;
-            } else {
-                free_list = curr->next;
-            }
+static void small_free(void *ptr)
+{
+    run_t *run = (run_t *)((uint64_t)ptr & ~((uint64_t)RUN_SIZE - 1));
+    if (run->magic != RUN_MAGIC)
+        return;
+    int cls = run->cls;
+    *(void **)ptr = run->free_obj;
+    run->free_obj = ptr;
+    stat.small_objs[cls]--;
+    if (run->nfree++ == 0)
+        partial_add(cls, run);
+    if (run->nfree < run->nobj)
+        return;
+    partial_remove(cls, run);
+    if (!empty_run[cls])
+        empty_run[cls] = run;
+    else
+        run_release(run);
+}
 
-            curr->is_free = 0;
-            curr->next = NULL;
+/* ====================== 大对象 ====================== */
 
-            // 分割块（如果可能）
-            split_block(curr, aligned_size);
+static inline int bin_of(uint64_t npages)
+{
+    int bin = 63 - __builtin_clzl(npages);
+    return bin < NR_LARGE_BINS ? bin : NR_LARGE_BINS - 1;
+}
 
-            return (void*)((char*)curr + sizeof(block_header_t));
-        }
+static inline large_t *large_after(large_t *run)
+{
+    char *next = (char *)run + run->npages * PAGE_SIZE;
+    return next < large_top ? (large_t *)next : NULL;
+}
 
-        prev = curr;
-        curr = curr->next;
-    }
+static void bin_insert(large_t *run)
+{
+    int bin = bin_of(run->npages);
+    run->prev = NULL;
+    run->next = bins[bin];
+    if (run->next)
+        run->next->prev = run;
+    bins[bin] = run;
+    stat.large_free_pages += run->npages;
+}
 
-    // 没有找到合适块，扩展堆
-    uint64_t extend_size = align_up(total_size, PAGE_SIZE);
-    block_header_t* new_block = (block_header_t*)sbrk(extend_size);
-    if (!new_block)
-        return NULL;
+static void bin_remove(large_t *run)
+{
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        bins[bin_of(run->npages)] = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+    stat.large_free_pages -= run->npages;
+}
 
-    new_block->size = extend_size - sizeof(block_header_t);
-    new_block->is_free = 0;
-    new_block->next = NULL;
+/// @brief run的大小变了, 更新后一个run记录的prev_npages
+static void fix_next_prev(large_t *run)
+{
+    large_t *next = large_after(run);
+    if (next)
+        next->prev_npages = run->npages;
+}
 
-    // 如果扩展的块与最后一个块相邻，合并它们
-    if (prev && (char*)prev + sizeof(block_header_t) + prev->size == (char*)new_block) {
-        prev->size += extend_size;
-        return (void*)((char*)prev + sizeof(block_header_t));
+static void *large_alloc(uint64_t size)
+{
+    uint64_t npages = align_up(size + LARGE_HDR, PAGE_SIZE) / PAGE_SIZE;
+    large_t *run = NULL;
+    for (int bin = bin_of(npages); bin < NR_LARGE_BINS && !run; bin++) {
+        for (large_t *r = bins[bin]; r; r = r->next) {
+            if (r->npages >= npages) {
+                run = r;
+                break;
+            }
+        }
     }
 
-    return (void*)((char*)new_block + sizeof(block_header_t));
+    if (run) {
+        bin_remove(run);
+        if (run->npages > npages) {
+            // 后半段仍然空闲, 它的头页可能之前还给了内核, 写头时重新缺页
+            large_t *tail = (large_t *)((char *)run + npages * PAGE_SIZE);
+            tail->magic = LARGE_MAGIC;
+            tail->free = 1;
+            tail->npages = run->npages - npages;
+            tail->prev_npages = npages;
+            fix_next_prev(tail);
+            if (large_last == run)
+                large_last = tail;
+            run->npages = npages;
+            bin_insert(tail);
+        }
+    } else {
+        if ((uint64_t)large_top + npages * PAGE_SIZE > HEAP_END)
+            return NULL;
+        run = (large_t *)large_top;
+        large_top += npages * PAGE_SIZE;
+        run->magic = LARGE_MAGIC;
+        run->npages = npages;
+        run->prev_npages = large_last ? large_last->npages : 0;
+        large_last = run;
+    }
+    run->free = 0;
+    stat.large_objs++;
+    stat.large_pages += run->npages;
+    return (char *)run + LARGE_HDR;
 }
 
-// free实现
-void free(void* ptr)
+static void large_free(void *ptr)
 {
-    if (!ptr)
+    large_t *run = (large_t *)((char *)ptr - LARGE_HDR);
+    if (((uint64_t)run & (PAGE_SIZE - 1)) || run->magic != LARGE_MAGIC || run->free)
         return;
+    run->free = 1;
+    stat.large_objs--;
+    stat.large_pages -= run->npages;
+
+    large_t *next = large_after(run);
+    if (next && next->free) {
+        bin_remove(next);
+        run->npages += next->npages;
+        if (large_last == next)
+            large_last = run;
+        fix_next_prev(run);
+    }
+    if (run->prev_npages) {
+        large_t *prev = (large_t *)((char *)run - run->prev_npages * PAGE_SIZE);
+        if (prev->free) {
+            bin_remove(prev);
+            prev->npages += run->npages;
+            if (large_last == run)
+                large_last = prev;
+            fix_next_prev(prev);
+            run = prev;
+        }
+    }
 
-    block_header_t* block = (block_header_t*)((char*)ptr - sizeof(block_header_t));
-
-    if (block->is_free) {
-        return; // 重复释放
+    // 最高处的空闲run整个还给内核
+    if (run == large_last) {
+        large_last = run->prev_npages ? (large_t *)((char *)run - run->prev_npages * PAGE_SIZE) : NULL;
+        large_top = (char *)run;
+        heap_release(run, run->npages * PAGE_SIZE);
+        return;
     }
+    // 头所在的页要留着
+    if (run->npages > 1)
+        heap_release((char *)run + PAGE_SIZE, (run->npages - 1) * PAGE_SIZE);
+    bin_insert(run);
+}
 
-    block->is_free = 1;
+/* ====================== 接口 ====================== */
 
-    // 插入到空闲链表头部
-    block->next = free_list;
-    free_list = block;
+void* malloc(uint64_t size)
+{
+    if (size == 0)
+        return NULL;
+    if (size <= SMALL_MAX) {
+        if (!class_ready)
+            init_classes();
+        return small_alloc(class_index[(size + 15) >> 4]);
+    }
+    return large_alloc(size);
+}
+
+void free(void* ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+    if (addr >= HEAP_START && addr < (uint64_t)small_top)
+        small_free(ptr);
+    else if (addr >= SMALL_END && addr < (uint64_t)large_top)
+        large_free(ptr);
+}
 
-    // 合并相邻空闲块
-    coalesce_blocks();
+/// @brief ptr所在块实际可用的大小
+static uint64_t usable_size(void *ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+    if (addr < SMALL_END) {
+        run_t *run = (run_t *)(addr & ~((uint64_t)RUN_SIZE - 1));
+        return class_size[run->cls];
+    }
+    large_t *run = (large_t *)(addr - LARGE_HDR);
+    return run->npages * PAGE_SIZE - LARGE_HDR;
 }
 
-// realloc实现
 void* realloc(void* ptr, uint64_t size)
 {
     if (!ptr)
@@ -178,64 +443,42 @@ void* realloc(void* ptr, uint64_t size)
         free(ptr);
         return NULL;
     }
-
-    block_header_t* block = (block_header_t*)((char*)ptr - sizeof(block_header_t));
-    uint64_t old_size = block->size;
-    uint64_t aligned_size = align_up(size, ALIGNMENT);
-
-    // 如果当前块足够大，直接使用
-    if (old_size >= aligned_size) {
-        split_block(block, aligned_size);
-        return ptr;
-    }
-
-    // 检查是否可以与后面的空闲块合并
-    if (block->next && block->next->is_free && old_size + sizeof(block_header_t) + block->next->size >= aligned_size) {
-
-        // 合并块
-        block->size += sizeof(block_header_t) + block->next->size;
-        block->next = block->next->next;
-
-        // 从空闲链表中移除被合并的块
-        block_header_t* curr = free_list;
-        block_header_t* prev = NULL;
-        while (curr) {
-            if (curr == block->next) {
-                if (prev) {
-                    prev->next = curr->next;
-                } else {
-                    free_list = curr->next;
-                }
-                break;
-            }
-            prev = curr;
-            curr = curr->next;
-        }
-
-        split_block(block, aligned_size);
+    uint64_t old_size = usable_size(ptr);
+    if (size <= old_size)
         return ptr;
-    }
-
-    // 需要分配新内存
     void* new_ptr = malloc(size);
     if (!new_ptr)
         return NULL;
-
-    // 复制数据
-    uint64_t copy_size = old_size < size ? old_size : size;
-    memcpy(new_ptr, ptr, copy_size);
-
+    memcpy(new_ptr, ptr, old_size);
     free(ptr);
     return new_ptr;
 }
 
-// calloc实现
 void* calloc(uint64_t num, uint64_t size)
 {
     uint64_t total_size = num * size;
+    if (size && total_size / size != num)
+        return NULL;
     void* ptr = malloc(total_size);
     if (ptr) {
         memset(ptr, 0, total_size);
     }
     return ptr;
 }
+
+void malloc_stats(void)
+{
+    uint64_t small_bytes = 0;
+    printf("class   size   in use\n");
+    for (int i = 0; i < NR_CLASSES; i++) {
+        if (!stat.small_objs[i])
+            continue;
+        printf("%5d %6d %8ld\n", i, class_size[i], stat.small_objs[i]);
+        small_bytes += stat.small_objs[i] * class_size[i];
+    }
+    printf("small: %ld bytes in use, %ld runs (%ld KiB), %ld empty runs, %ld chunks returned\n",
+           small_bytes, stat.small_runs, stat.small_runs * (RUN_SIZE / 1024), stat.released_runs,
+           stat.released_chunks);
+    printf("large: %ld blocks, %ld pages in use, %ld pages free\n",
+           stat.large_objs, stat.large_pages, stat.large_free_pages);
+}
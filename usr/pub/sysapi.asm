@@ -29,6 +29,15 @@ global clock_gettime
 global pipe
 global fstat
 global uuid_config
+global mmap
+global munmap
+global mprotect
+global madvise
+global fault_around
+global nice
+global nanosleep
+global clock_nanosleep
+global memstat
 
 section .text
     bits 64
@@ -186,3 +195,48 @@ section .text
         mov rax,30
         int 0x80
         ret
+
+    mmap:
+        mov rax,31
+        int 0x80
+        ret
+
+    munmap:
+        mov rax,32
+        int 0x80
+        ret
+
+    mprotect:
+        mov rax,33
+        int 0x80
+        ret
+
+    madvise:
+        mov rax,34
+        int 0x80
+        ret
+
+    fault_around:
+        mov rax,35
+        int 0x80
+        ret
+
+    nice:
+        mov rax,36
+        int 0x80
+        ret
+
+    nanosleep:
+        mov rax,37
+        int 0x80
+        ret
+
+    clock_nanosleep:
+        mov rax,38
+        int 0x80
+        ret
+
+    memstat:
+        mov rax,39
+        int 0x80
+        ret
@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "uconst.h"
+#include "uprintf.h"
+#include "sysapi.h"
+
+#define SLEEP_NS    50000UL
+#define ROUNDS      5
+
+/* tv_nsec是单调时钟对1秒取余, 间隔小于1秒时差值是准的 */
+static uint64_t elapsed_ns(utimespec_t *a, utimespec_t *b){
+    return (b->tv_nsec + 1000000000UL - a->tv_nsec) % 1000000000UL;
+}
+
+int main(void){
+    utimespec_t req = {0, SLEEP_NS};
+    utimespec_t rem;
+    utimespec_t u;
+    utimespec_t u1;
+
+    for (int i = 0; i < ROUNDS; i++){
+        clock_gettime(&u);
+        nanosleep(&req,&rem);
+        clock_gettime(&u1);
+        printf("nanosleep 50us: slept %lu ns\n",elapsed_ns(&u,&u1));
+    }
+
+    for (int i = 0; i < ROUNDS; i++){
+        clock_gettime(&u);
+        clock_nanosleep(CLOCK_MONOTONIC,0,&req,NULL);
+        clock_gettime(&u1);
+        printf("clock_nanosleep monotonic 50us: slept %lu ns\n",elapsed_ns(&u,&u1));
+    }
+
+    /* 绝对时刻: 睡到当前墙上时间之后50us */
+    for (int i = 0; i < ROUNDS; i++){
+        clock_gettime(&u);
+        utimespec_t until = {u.tv_sec, u.tv_nsec + SLEEP_NS};
+        if (until.tv_nsec >= 1000000000UL){
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000UL;
+        }
+        clock_nanosleep(CLOCK_REALTIME,TIMER_ABSTIME,&until,NULL);
+        clock_gettime(&u1);
+        printf("clock_nanosleep realtime abs 50us: slept %lu ns\n",elapsed_ns(&u,&u1));
+    }
+
+    utimespec_t bad = {0, 1000000000UL};
+    if (nanosleep(&bad,NULL) != -1 || clock_nanosleep(2,0,&req,NULL) != -1){
+        printf("nanosleep: invalid argument accepted\n");
+        exit(-1);
+    }
+    exit(0);
+}